@@ -0,0 +1,1610 @@
+// Lexer and parser benchmarks over generated corpora (or given files).
+//
+//   g++ -std=c++23 -O2 -Wall -Wextra -Werror -I . -o build/bench bench.cpp
+//   build/bench [--size=MB] [--iterations=N] [--json] [--check] [file...]
+//
+// Each corpus is lexed into a TokenStream, parsed from it, and lexed and
+// parsed again in one streamed pass; every phase is run --iterations times
+// and the median is reported. Corpora come from a seeded generator, so
+// the same seed and size give the same bytes on every platform. --check
+// runs the self-checks below on each corpus instead of timing it, plus a
+// parallel lexing check on inputs built to be cut mid-token.
+#define JS_PARSER_NO_MAIN
+#include "main.cpp"
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/* ?? -- ?? -- ? ALLOCATION COUNTING ? -- ?? -- ??*/
+// Every C++ allocation goes through these. The AST arena takes its blocks
+// from malloc, so it is reported separately as arena bytes.
+// GCC sees the inlined free() pairing with operator new at every delete
+// site and warns, although both sides are replaced here.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static std::atomic<uint64_t> s_allocations { 0 };
+static std::atomic<uint64_t> s_allocated { 0 };
+
+void* operator new(size_t size) {
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    s_allocated.fetch_add(size, std::memory_order_relaxed);
+    void* data = malloc(size ? size : 1);
+    if (data == nullptr)
+        throw std::bad_alloc();
+    return data;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* data) noexcept {
+    free(data);
+}
+
+void operator delete(void* data, size_t) noexcept {
+    free(data);
+}
+
+void operator delete[](void* data) noexcept {
+    free(data);
+}
+
+void operator delete[](void* data, size_t) noexcept {
+    free(data);
+}
+
+struct AllocationCount {
+    uint64_t allocations;
+    uint64_t bytes;
+
+    static AllocationCount now() {
+        return AllocationCount { s_allocations.load(std::memory_order_relaxed), s_allocated.load(std::memory_order_relaxed) };
+    }
+
+    AllocationCount since(AllocationCount start) const {
+        return AllocationCount { allocations - start.allocations, bytes - start.bytes };
+    }
+};
+
+// Linux can reset the high-water mark, so there each corpus gets its own
+// peak; elsewhere it is the peak of the whole run so far.
+void reset_peak_rss() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file != nullptr) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+uint64_t peak_rss() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#elif defined(__linux__)
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == nullptr)
+        return 0;
+    char line[256];
+    uint64_t kilobytes = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (strncmp(line, "VmHWM:", 6) == 0) {
+            kilobytes = strtoull(line + 6, nullptr, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return kilobytes << 10;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (uint64_t) usage.ru_maxrss;
+#endif
+}
+
+/* ?? -- ?? -- ? CORPUS GENERATION ? -- ?? -- ??*/
+// xorshift64*; std:: distributions differ between standard libraries, so
+// they would not give the same corpus everywhere.
+class Random {
+public:
+    explicit Random(uint64_t seed)
+        : m_state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t next() {
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return m_state * 0x2545F4914F6CDD1Dull;
+    }
+
+    size_t below(size_t count) { return (size_t) (next() % count); }
+
+    size_t between(size_t low, size_t high) { return low + below(high - low + 1); }
+
+    bool chance(unsigned percent) { return below(100) < percent; }
+
+    // Skewed towards small values, like name use in real code.
+    size_t skewed(size_t count) { return below(below(count) + 1); }
+
+private:
+    uint64_t m_state;
+};
+
+enum class CorpusKind : uint8_t {
+    Minified,
+    Pretty,
+    Identifiers,
+    Strings,
+    Nested,
+    Operators,
+};
+
+static constexpr CorpusKind CORPUS_KINDS[] = {
+    CorpusKind::Minified,
+    CorpusKind::Pretty,
+    CorpusKind::Identifiers,
+    CorpusKind::Strings,
+    CorpusKind::Nested,
+    CorpusKind::Operators,
+};
+
+const char* CorpusKindName(CorpusKind kind) {
+    switch (kind) {
+        case CorpusKind::Minified: return "minified";
+        case CorpusKind::Pretty: return "pretty";
+        case CorpusKind::Identifiers: return "identifiers";
+        case CorpusKind::Strings: return "strings";
+        case CorpusKind::Nested: return "nested";
+        case CorpusKind::Operators: return "operators";
+    }
+    return "unknown";
+}
+
+// Writes whole statements until the corpus reaches the requested size.
+// Only syntax the parser accepts is generated, so every corpus parses.
+class CorpusGenerator {
+public:
+    CorpusGenerator(uint64_t seed)
+        : m_random(seed),
+          m_pretty(false),
+          m_indent(0) {
+        static const char* WORDS[] = {
+            "value", "index", "count", "item", "node", "parent", "child", "result", "buffer", "offset",
+            "length", "handler", "callback", "options", "config", "state", "cache", "token", "source", "target",
+            "element", "request", "response", "message", "error", "event", "listener", "module", "entry", "record",
+        };
+        size_t words = sizeof(WORDS) / sizeof(WORDS[0]);
+        for (size_t i = 0; i < 4096; ++i) {
+            std::string name = WORDS[i % words];
+            for (size_t j = i / words; j > 0; j /= words) {
+                std::string word = WORDS[j % words];
+                word[0] = (char) toupper(word[0]);
+                name += word;
+            }
+            m_names.push_back(name);
+        }
+    }
+
+    std::string generate(CorpusKind kind, size_t bytes) {
+        std::string out;
+        out.reserve(bytes + 64 * 1024);
+        m_pretty = kind != CorpusKind::Minified;
+        m_indent = 0;
+        while (out.size() < bytes) {
+            switch (kind) {
+                case CorpusKind::Minified:
+                case CorpusKind::Pretty:
+                    statement(&out, 0);
+                    break;
+                case CorpusKind::Identifiers:
+                    identifier_unit(&out);
+                    break;
+                case CorpusKind::Strings:
+                    string_unit(&out);
+                    break;
+                case CorpusKind::Nested:
+                    nested_unit(&out);
+                    break;
+                case CorpusKind::Operators:
+                    operator_unit(&out);
+                    break;
+            }
+        }
+        return out;
+    }
+
+private:
+    static constexpr size_t MAX_DEPTH = 3;
+
+    void space(std::string* out) {
+        if (m_pretty)
+            out->push_back(' ');
+    }
+
+    void newline(std::string* out) {
+        if (!m_pretty)
+            return;
+        out->push_back('\n');
+        out->append(m_indent * 4, ' ');
+    }
+
+    // Minified code uses short names, everything else descriptive ones.
+    // Short names that spell a keyword (`in`, `do`) get a `$`.
+    void name(std::string* out) {
+        size_t index = m_random.skewed(m_pretty ? m_names.size() : 52 * 27);
+        if (m_pretty) {
+            out->append(m_names[index]);
+            return;
+        }
+        static const char LETTERS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        size_t start = out->size();
+        out->push_back(LETTERS[index % 52]);
+        if (index >= 52)
+            out->push_back(LETTERS[index / 52 - 1]);
+        if (keywords::classify(out->data() + start, out->size() - start) != Lexer::TokenType::Identifier)
+            out->push_back('$');
+    }
+
+    void number(std::string* out) {
+        out->append(std::to_string(m_random.below(m_random.chance(80) ? 100 : 1000000)));
+    }
+
+    void text(std::string* out, char quote, size_t length) {
+        static const char CHARS[] = "abcdefghijklmnopqrstuvwxyz     ABCDEFGHIJ0123456789.,:-";
+        out->push_back(quote);
+        for (size_t i = 0; i < length; ++i) {
+            if (m_random.chance(3)) {
+                static const char* ESCAPES[] = { "\\n", "\\t", "\\\\", "\\u00e9", "\\x41" };
+                out->append(ESCAPES[m_random.below(5)]);
+                continue;
+            }
+            if (m_random.chance(1)) {
+                out->push_back('\\');
+                out->push_back(quote);
+                continue;
+            }
+            out->push_back(CHARS[m_random.below(sizeof(CHARS) - 1)]);
+        }
+        out->push_back(quote);
+    }
+
+    void binary_operator(std::string* out) {
+        static const char* OPERATORS[] = {
+            "+", "-", "*", "/", "%", "<<", ">>", ">>>", "&", "|", "^", "&&", "||",
+            "==", "!=", "===", "!==", "<", ">", "<=", ">=",
+        };
+        space(out);
+        out->append(OPERATORS[m_random.below(sizeof(OPERATORS) / sizeof(OPERATORS[0]))]);
+        space(out);
+    }
+
+    // `??` may not share an operand with `||` or `&&`, so it is generated
+    // with both operands and itself parenthesized.
+    void coalesce(std::string* out, size_t depth) {
+        out->append("((");
+        expression(out, depth + 1);
+        out->push_back(')');
+        space(out);
+        out->append("??");
+        space(out);
+        out->push_back('(');
+        expression(out, depth + 1);
+        out->append("))");
+    }
+
+    void arguments(std::string* out, size_t depth) {
+        out->push_back('(');
+        size_t count = m_random.below(4);
+        for (size_t i = 0; i < count; ++i) {
+            if (i > 0) {
+                out->push_back(',');
+                space(out);
+            }
+            expression(out, depth + 1);
+        }
+        out->push_back(')');
+    }
+
+    void function(std::string* out, bool named) {
+        out->append("function");
+        if (named) {
+            out->push_back(' ');
+            name(out);
+        }
+        out->push_back('(');
+        size_t count = m_random.below(4);
+        for (size_t i = 0; i < count; ++i) {
+            if (i > 0) {
+                out->push_back(',');
+                space(out);
+            }
+            name(out);
+        }
+        out->push_back(')');
+        space(out);
+        block(out, MAX_DEPTH - 1, true);
+    }
+
+    void expression(std::string* out, size_t depth) {
+        size_t choice = m_random.below(depth >= MAX_DEPTH ? 3 : 12);
+        switch (choice) {
+            case 0:
+                name(out);
+                break;
+            case 1:
+                number(out);
+                break;
+            case 2:
+                text(out, m_random.chance(50) ? '"' : '\'', m_random.between(1, 12));
+                break;
+            case 3:
+                name(out);
+                out->push_back('.');
+                name(out);
+                break;
+            case 4:
+                name(out);
+                out->push_back('[');
+                expression(out, depth + 1);
+                out->push_back(']');
+                break;
+            case 5:
+                name(out);
+                arguments(out, depth);
+                break;
+            case 6:
+            case 7:
+                if (m_random.chance(7)) {
+                    coalesce(out, depth);
+                    break;
+                }
+                expression(out, depth + 1);
+                binary_operator(out);
+                expression(out, depth + 1);
+                break;
+            case 8:
+                expression(out, depth + 1);
+                space(out);
+                out->push_back('?');
+                space(out);
+                expression(out, depth + 1);
+                space(out);
+                out->push_back(':');
+                space(out);
+                expression(out, depth + 1);
+                break;
+            case 9:
+                out->push_back('[');
+                expression(out, depth + 1);
+                out->push_back(',');
+                space(out);
+                expression(out, depth + 1);
+                out->push_back(']');
+                break;
+            case 10:
+                out->push_back('!');
+                out->push_back('(');
+                expression(out, depth + 1);
+                out->push_back(')');
+                break;
+            default:
+                function(out, false);
+                break;
+        }
+    }
+
+    void block(std::string* out, size_t depth, bool returns) {
+        out->push_back('{');
+        ++m_indent;
+        size_t count = m_random.between(1, 4);
+        for (size_t i = 0; i < count; ++i) {
+            newline(out);
+            statement(out, depth + 1);
+        }
+        if (returns) {
+            newline(out);
+            out->append("return ");
+            expression(out, depth + 1);
+            out->push_back(';');
+        }
+        --m_indent;
+        newline(out);
+        out->push_back('}');
+    }
+
+    void statement(std::string* out, size_t depth) {
+        if (m_pretty && depth == 0 && m_random.chance(10)) {
+            bool line = m_random.chance(50);
+            out->append(line ? "// " : "/* ");
+            out->append(m_names[m_random.skewed(m_names.size())]);
+            out->append(" keeps the ");
+            out->append(m_names[m_random.skewed(m_names.size())]);
+            out->append(" in sync");
+            out->append(line ? "" : " */");
+            newline(out);
+        }
+        size_t choice = m_random.below(depth >= MAX_DEPTH ? 2 : 6);
+        switch (choice) {
+            case 0:
+                name(out);
+                space(out);
+                out->push_back('=');
+                space(out);
+                expression(out, depth);
+                out->push_back(';');
+                break;
+            case 1:
+                name(out);
+                out->push_back('.');
+                name(out);
+                arguments(out, depth);
+                out->push_back(';');
+                break;
+            case 2:
+                function(out, true);
+                break;
+            case 3:
+                out->append("if");
+                space(out);
+                out->push_back('(');
+                expression(out, depth + 1);
+                out->push_back(')');
+                space(out);
+                block(out, depth, false);
+                if (m_random.chance(50)) {
+                    space(out);
+                    out->append("else");
+                    space(out);
+                    block(out, depth, false);
+                }
+                break;
+            case 4:
+                out->append("while");
+                space(out);
+                out->push_back('(');
+                expression(out, depth + 1);
+                out->push_back(')');
+                space(out);
+                block(out, depth, false);
+                break;
+            default:
+                name(out);
+                space(out);
+                out->push_back('=');
+                space(out);
+                function(out, false);
+                out->push_back(';');
+                break;
+        }
+        if (depth == 0)
+            out->push_back('\n');
+    }
+
+    void identifier_unit(std::string* out) {
+        name(out);
+        for (size_t i = m_random.below(4); i > 0; --i) {
+            out->push_back('.');
+            name(out);
+        }
+        if (m_random.chance(50)) {
+            out->append(" = ");
+            name(out);
+            out->push_back('[');
+            name(out);
+            out->append("] || ");
+            name(out);
+        } else {
+            out->push_back('(');
+            for (size_t i = m_random.between(1, 4); i > 0; --i) {
+                name(out);
+                if (i > 1)
+                    out->append(", ");
+            }
+            out->push_back(')');
+        }
+        out->append(";\n");
+    }
+
+    void string_unit(std::string* out) {
+        name(out);
+        out->append(" = ");
+        for (size_t i = m_random.between(1, 3); i > 0; --i) {
+            if (m_random.chance(25)) {
+                out->push_back('`');
+                text(out, ' ', m_random.between(8, 60));
+                out->append("${");
+                name(out);
+                out->push_back('}');
+                text(out, ' ', m_random.between(8, 60));
+                out->push_back('`');
+            } else {
+                text(out, m_random.chance(50) ? '"' : '\'', m_random.between(8, 120));
+            }
+            if (i > 1)
+                out->append(" + ");
+        }
+        out->append(";\n");
+    }
+
+    void nested_unit(std::string* out) {
+        size_t depth = m_random.between(16, 256);
+        switch (m_random.below(4)) {
+            case 0:
+                name(out);
+                out->append(" = ");
+                out->append(depth, '(');
+                name(out);
+                for (size_t i = 0; i < depth; ++i)
+                    out->append(" + 1)");
+                break;
+            case 1:
+                name(out);
+                out->append(" = ");
+                out->append(depth, '[');
+                number(out);
+                for (size_t i = 0; i < depth; ++i)
+                    out->append(", 1]");
+                break;
+            case 2:
+                for (size_t i = 0; i < depth; ++i) {
+                    name(out);
+                    out->push_back('(');
+                }
+                name(out);
+                out->append(depth, ')');
+                break;
+            default:
+                depth /= 4;
+                for (size_t i = 0; i < depth; ++i) {
+                    out->append("if (");
+                    name(out);
+                    out->append(") {\n");
+                }
+                name(out);
+                out->append("();\n");
+                out->append(depth, '}');
+                break;
+        }
+        out->append(";\n");
+    }
+
+    void operator_unit(std::string* out) {
+        name(out);
+        out->append(" = ");
+        for (size_t i = m_random.between(200, 2000); i > 0; --i) {
+            if (m_random.chance(5))
+                out->push_back('-');
+            if (m_random.chance(5)) {
+                out->push_back('(');
+                name(out);
+                out->append(" ?? ");
+                number(out);
+                out->push_back(')');
+            } else if (m_random.chance(50)) {
+                name(out);
+            } else {
+                number(out);
+            }
+            if (i > 1)
+                binary_operator(out);
+        }
+        out->append(";\n");
+    }
+
+    Random m_random;
+    bool m_pretty;
+    size_t m_indent;
+    std::vector<std::string> m_names;
+};
+
+/* ?? -- ?? -- ? MEASUREMENT ? -- ?? -- ??*/
+class NodeCounter : public AstVisitor<NodeCounter> {
+public:
+    void visitNode(Node*) { ++m_count; }
+
+    size_t getCount() { return m_count; }
+
+private:
+    size_t m_count = 0;
+};
+
+struct BenchOptions {
+    double size_mb = 4;
+    unsigned iterations = 5;
+    uint64_t seed = 1;
+    uint64_t parse_options = 0;
+    bool json = false;
+    bool check = false;
+    std::vector<std::string> corpora;
+};
+
+// Median time of one phase; allocations are from its last run.
+struct Phase {
+    double seconds = 0;
+    AllocationCount allocations {};
+};
+
+struct Measurement {
+    std::string name;
+    size_t bytes = 0;
+    size_t tokens = 0;
+    size_t nodes = 0;
+    size_t token_bytes = 0;
+    size_t arena_bytes = 0;
+    uint64_t peak_rss = 0;
+    bool ok = true;
+    Phase lex;
+    Phase parse;
+    Phase stream;
+};
+
+double median(std::vector<double> samples) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Prints the first few problems with a corpus (real files may use syntax
+// the parser does not handle yet).
+void report_failure(const char* name, const char* phase, const DiagnosticSink& diagnostics) {
+    std::string text;
+    diagnostics.render(&text, DiagnosticSink::Format::Text);
+    fprintf(stderr, "%sERROR: failed to %s %s\n", text.c_str(), phase, name);
+}
+
+Measurement measure(const std::string& name, std::string_view text, const BenchOptions& options) {
+    Measurement result;
+    result.name = name;
+    result.bytes = text.size();
+    reset_peak_rss();
+
+    SourceFile file(result.name.c_str(), SourceBuffer::borrow_padded(text.data(), text.size()));
+    DiagnosticSink diagnostics(10);
+    std::vector<double> lex_times, parse_times, stream_times;
+    for (unsigned i = 0; i < options.iterations && result.ok; ++i) {
+        bool last = i + 1 == options.iterations;
+        {
+            Lexer lexer(&file);
+            lexer.setDiagnostics(&diagnostics);
+            Lexer::TokenStream tokens;
+            AllocationCount allocations = AllocationCount::now();
+            auto start = std::chrono::steady_clock::now();
+            bool lexed = lexer.parse(&tokens);
+            lex_times.push_back(seconds_since(start));
+            result.lex.allocations = AllocationCount::now().since(allocations);
+            if (!lexed) {
+                report_failure(name.c_str(), "lex", diagnostics);
+                result.ok = false;
+                break;
+            }
+
+            Parser parser(&tokens);
+            parser.setOptions(options.parse_options);
+            parser.setDiagnostics(&diagnostics);
+            allocations = AllocationCount::now();
+            start = std::chrono::steady_clock::now();
+            Program* program = parser.parse();
+            parse_times.push_back(seconds_since(start));
+            result.parse.allocations = AllocationCount::now().since(allocations);
+            if (program == nullptr) {
+                report_failure(name.c_str(), "parse", diagnostics);
+                result.ok = false;
+                break;
+            }
+            if (last) {
+                NodeCounter counter;
+                counter.visitProgram(program);
+                result.nodes = counter.getCount();
+                result.tokens = tokens.size();
+                result.token_bytes = tokens.memoryUsage();
+                result.arena_bytes = program->getArena().getReserved();
+            }
+            delete program;
+        }
+        {
+            AllocationCount allocations = AllocationCount::now();
+            auto start = std::chrono::steady_clock::now();
+            Lexer lexer(&file);
+            Parser parser(&lexer);
+            parser.setOptions(options.parse_options);
+            Program* program = parser.parse();
+            stream_times.push_back(seconds_since(start));
+            result.stream.allocations = AllocationCount::now().since(allocations);
+            delete program;
+        }
+    }
+    result.lex.seconds = median(lex_times);
+    result.parse.seconds = median(parse_times);
+    result.stream.seconds = median(stream_times);
+    result.peak_rss = peak_rss();
+    return result;
+}
+
+/* ?? -- ?? -- ? SELF-CHECKS ? -- ?? -- ??*/
+// Each check gets the same answer two ways that must agree exactly, and
+// prints the first place they do not.
+
+// Syntax the generated corpora leave out, checked along with them.
+static const char CHECK_SAMPLE[] = R"(a = ++b + c-- - -d * ~e;
+f?.g?.(h, i)?.[j] ?? k;
+async function* l(m, n = o ? p : q, r = [s, t]) {
+    debugger;
+    ;
+    if (u) v(); else { w.x = typeof y; }
+    while (!z) z = delete aa.bb;
+    return;
+}
+cc = function (dd = function ee() { return ff; }) { return gg[hh](ii) || jj && kk; };
+ll += mm <<= nn ** 2;
+oo = (pp, qq), rr = [ss, (tt, uu)];
+(vv || ww) ?? (xx && yy);
+zz = (-aaa) ** ++bbb ** 2;
+function ccc() { function ddd() { return eee; } return ddd; }
+fff = ggg / hhh / iii, jjj = /k/g, lll = `m${nnn}o`, ppp = "q";
+function qqq() { return
+    rrr }
+sss
+++ttt
+uuu = 1
+vvv = vvv /*
+*/ --www
+async.map(let, static / yield, implements);
+xxx = async function () { return await yyy; };
+async
+function zzz(await) { return interface; }
+)";
+
+// Statements end at `;`, `}`, the end of input or a line break, never
+// between two operands on one line; `return` and postfix `++`/`--` do not
+// reach across a line break. Each input parses into `statements` top-level
+// statements, or with none first fails at offset `error`, lazily too.
+struct StatementEnds {
+    const char* text;
+    size_t statements;
+    uint32_t error;
+};
+
+static const StatementEnds STATEMENT_ENDS[] = {
+    { "x = 1 2;", 0, 6 },
+    { "a b c;", 0, 2 },
+    { "f(a b)", 0, 4 },
+    { "debugger a", 0, 9 },
+    { "return\n1", 2, 0 },
+    { "return /*\n*/ 1", 2, 0 },
+    { "a\n++b", 2, 0 },
+    { "a\n--b\nc", 3, 0 },
+    { "x = 1\ny = 2", 2, 0 },
+    { "a\n(b)", 1, 0 },
+    { "{ a } b", 2, 0 },
+    { "{ }\n/a/.test(b)", 0, 4 },
+    { "if (a) /b/.test(c)", 0, 7 },
+    { "x = e.default/2; y = a?.in/b.return/2", 2, 0 },
+    { "function f() { if (a) /[}]/.test(b); }", 0, 22 },
+    { "async.map(a, b); x = static; y = await", 3, 0 },
+    { "let\nlet = 1", 0, 0 },
+    { "await x", 0, 6 },
+};
+
+// Whether a `/` starts a regex, by the tokens before it. A keyword after
+// `.` or `?.` is a property name, so a `/` after it divides. After a `}` or
+// `)` it is always division, even where a regex was meant (see
+// Lexer::regex_may_follow); the last two cases pin that down. Token
+// `index` of each input has type `type`.
+struct RegexContext {
+    const char* text;
+    size_t index;
+    Lexer::TokenType type;
+};
+
+static const RegexContext REGEX_CONTEXTS[] = {
+    { "x = a / b / c", 3, Lexer::TokenType::Slash },
+    { "x = (/a/)", 3, Lexer::TokenType::Regex },
+    { "x = [1] / 2", 5, Lexer::TokenType::Slash },
+    { "{ }\n(/a/)", 3, Lexer::TokenType::Regex },
+    { "a = {}\n/b/g", 4, Lexer::TokenType::Slash },
+    { "x = e.default/2", 5, Lexer::TokenType::Slash },
+    { "x = a?.in/2", 5, Lexer::TokenType::Slash },
+    { "x = typeof /a/", 3, Lexer::TokenType::Regex },
+    { "{ }\n/a/.test(b)", 2, Lexer::TokenType::Slash },
+    { "if (a) /b/.test(c)", 4, Lexer::TokenType::Slash },
+    { "x = static / 2", 3, Lexer::TokenType::Slash },
+    { "x = await /a/", 3, Lexer::TokenType::Regex },
+};
+
+// Expressions nested far deeper than a native stack could recurse through:
+// the parser and every tree walk have to get through them on heap stacks.
+std::string generate_deep(size_t depth) {
+    std::string out = "x = a";
+    for (size_t i = 0; i < depth; ++i)
+        out.append(" + a");
+    out.append(";\ny = ");
+    out.append(depth, '(');
+    out.append("b");
+    out.append(depth, ')');
+    out.append(";\nz = ");
+    for (size_t i = 0; i < depth / 2; ++i)
+        out.append("c ? d : ");
+    out.append("e;\nf");
+    for (size_t i = 0; i < depth / 2; ++i)
+        out.append(i % 2 ? ".g" : "[h](i)");
+    out.append(";\nj = ");
+    out.append(depth / 2, '[');
+    out.append(depth / 2, ']');
+    out.append(";\nk = ");
+    for (size_t i = 0; i < depth / 2; ++i)
+        out.append("l = ");
+    out.append("m;\nn = ");
+    out.append(depth / 2, '!');
+    out.append("o;\n");
+    return out;
+}
+
+bool check_failed(const char* name, const char* check, const std::string& detail) {
+    printf("%s: %s FAILED: %s\n", name, check, detail.c_str());
+    return false;
+}
+
+bool check_statement_ends(const char* name) {
+    for (size_t i = 0; i < 2 * std::size(STATEMENT_ENDS); ++i) {
+        const StatementEnds& expect = STATEMENT_ENDS[i / 2];
+        std::string text = expect.text;
+        text.append(SourceBuffer::PADDING, '\0');
+        SourceFile file(name, SourceBuffer::borrow_padded(text.data(), text.size() - SourceBuffer::PADDING));
+        DiagnosticSink diagnostics(10);
+        Lexer lexer(&file);
+        lexer.setDiagnostics(&diagnostics);
+        Lexer::TokenStream tokens;
+        lexer.parse(&tokens);
+        Parser parser(&tokens);
+        parser.setLazy(i % 2 != 0);
+        parser.setDiagnostics(&diagnostics);
+        std::unique_ptr<Program> program(parser.parse());
+        size_t statements = program != nullptr ? program->statements().size() : 0;
+        uint32_t error = diagnostics.size() != 0 ? diagnostics.at(0).start : 0;
+        if (statements != expect.statements || (diagnostics.size() == 0) != (expect.statements != 0) || error != expect.error)
+            return check_failed(name, "statement ends", std::format("input {}{}: {} statements, {} diagnostics, the first at {}", i / 2,
+                                                                    i % 2 ? " (lazy)" : "", statements, diagnostics.size(), error));
+    }
+    printf("%s: statement ends ok, %zu inputs\n", name, std::size(STATEMENT_ENDS));
+    return true;
+}
+
+bool check_regex_contexts(const char* name) {
+    for (size_t i = 0; i < std::size(REGEX_CONTEXTS); ++i) {
+        const RegexContext& expect = REGEX_CONTEXTS[i];
+        std::string text = expect.text;
+        text.append(SourceBuffer::PADDING, '\0');
+        SourceFile file(name, SourceBuffer::borrow_padded(text.data(), text.size() - SourceBuffer::PADDING));
+        DiagnosticSink diagnostics(10);
+        Lexer lexer(&file);
+        lexer.setDiagnostics(&diagnostics);
+        Lexer::TokenStream tokens;
+        if (!lexer.parse(&tokens) || tokens.size() <= expect.index || tokens.getType(expect.index) != expect.type)
+            return check_failed(name, "regex contexts", std::format("input {}: token {} is not {}", i, expect.index,
+                                                                    Lexer::TokenTypeName(expect.type)));
+    }
+    printf("%s: regex contexts ok, %zu inputs\n", name, std::size(REGEX_CONTEXTS));
+    return true;
+}
+
+// Inputs for the parallel lexing check, each made of one construct that a
+// chunk lexed speculatively from the middle would misread. The lexer moves
+// a chunk boundary to just past the next newline within 64 KiB, so strings,
+// regexes and line comments go on lines longer than that, and templates and
+// block comments span many short lines.
+enum class LexStress : uint8_t {
+    Strings,
+    Templates,
+    Regexes,
+    Comments,
+};
+
+static constexpr LexStress LEX_STRESS_KINDS[] = {
+    LexStress::Strings,
+    LexStress::Templates,
+    LexStress::Regexes,
+    LexStress::Comments,
+};
+
+const char* LexStressName(LexStress kind) {
+    switch (kind) {
+        case LexStress::Strings: return "lex-strings";
+        case LexStress::Templates: return "lex-templates";
+        case LexStress::Regexes: return "lex-regexes";
+        case LexStress::Comments: return "lex-comments";
+    }
+    return "unknown";
+}
+
+// Text that looks like the start of some other construct, so a chunk
+// starting inside the enclosing one goes astray.
+void append_pieces(std::string* out, Random* random, size_t bytes, const std::vector<const char*>& pieces) {
+    for (size_t end = out->size() + bytes; out->size() < end;)
+        out->append(pieces[random->below(pieces.size())]);
+}
+
+std::string generate_lex_stress(LexStress kind, size_t bytes, uint64_t seed) {
+    Random random(seed);
+    std::string out;
+    out.reserve(bytes + 256 * 1024);
+    while (out.size() < bytes) {
+        switch (kind) {
+            case LexStress::Strings: {
+                char quote = random.chance(50) ? '"' : '\'';
+                out.append("s = ");
+                out.push_back(quote);
+                append_pieces(&out, &random, random.between(1000, 8000),
+                              { "text ", "\\\"", "\\'", "\\\\", "\\n", "`", "${", "}", "//", "/*", "*/", "/x/" });
+                out.push_back(quote);
+                out.append("; ");
+                break;
+            }
+            case LexStress::Templates:
+                out.append("t = `");
+                append_pieces(&out, &random, random.between(1000, 8000),
+                              { "text ", "\n", "\n", "${a}", "${f(\"}\")}", "${`in ${b} `}", "\\`", "\\${", "$ ", "{", "}",
+                                "\"", "'", "//", "/*", "/x/" });
+                out.append("`;\n");
+                break;
+            case LexStress::Regexes:
+                out.append(random.chance(20) ? "x = a / b / c; " : random.chance(20) ? "x = e.default / b.in / c; " : "");
+                out.append("r = /a");
+                append_pieces(&out, &random, random.between(1000, 4000),
+                              { "bc", "\\/", "[/]", "[^\\]/]", "(?:x|y)", "*", "+", "\"", "'", "`", "\\d{2,3}", "${" });
+                out.append("/gi; ");
+                break;
+            case LexStress::Comments:
+                if (random.chance(10)) {
+                    out.append("// ");
+                    append_pieces(&out, &random, random.between(70000, 100000), { "text ", "/*", "\"", "'", "`", "/x/" });
+                    out.append("\na = b;\n");
+                    break;
+                }
+                out.append("/* ");
+                append_pieces(&out, &random, random.between(1000, 8000),
+                              { "text ", "\n", "* ", " /", "//", "\"", "'", "`", "/x/", "${" });
+                out.append(" */ a = b;\n");
+                break;
+        }
+        // Lines of strings and regexes must stay longer than the lookahead.
+        if (kind == LexStress::Strings || kind == LexStress::Regexes) {
+            if (random.chance(1))
+                out.push_back('\n');
+        }
+    }
+    return out;
+}
+
+// Where a chunk boundary can fall, indexed by LexStress for the first four.
+static const char* CUT_KINDS[] = { "string", "template", "regex", "comment", "token", "space" };
+
+// Where a chunk boundary at `offset` fell in the serial token stream: the
+// kind of token it cuts, or a comment or plain space between tokens.
+size_t boundary_kind(const Lexer::TokenStream& tokens, std::string_view text, size_t offset) {
+    size_t low = 0, high = tokens.size();
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (tokens.getStart(middle) < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    size_t gap = 0;
+    if (low > 0) {
+        size_t index = low - 1;
+        if (offset < tokens.getEnd(index)) {
+            switch (tokens.getType(index)) {
+                case Lexer::TokenType::String: return 0;
+                case Lexer::TokenType::Template: return 1;
+                case Lexer::TokenType::Regex: return 2;
+                default: return 4;
+            }
+        }
+        gap = tokens.getEnd(index);
+    }
+    std::string_view between = text.substr(gap, offset - gap);
+    return between.find("//") != std::string_view::npos || between.find("/*") != std::string_view::npos ? 3 : 5;
+}
+
+// parse_parallel must give the tokens and atoms parse does, whatever the
+// thread count. The boundaries are recomputed as the lexer places them (see
+// Lexer::chunk_boundary) to show what each run actually cut through; a
+// stress input has to be cut inside its construct at least once.
+bool check_parallel_lex(const char* name, SourceFile* file, const LexStress* expect = nullptr) {
+    DiagnosticSink serial_diagnostics(10);
+    Lexer serial_lexer(file);
+    serial_lexer.setDiagnostics(&serial_diagnostics);
+    Lexer::TokenStream serial;
+    bool serial_ok = serial_lexer.parse(&serial);
+    std::string_view text(file->getBuffer().getData(), file->getBuffer().getLength());
+    if (expect != nullptr && !serial_ok)
+        return check_failed(name, "parallel lex", "the generated input does not lex");
+
+    size_t cuts[std::size(CUT_KINDS)] = {};
+    size_t total = 0;
+    for (unsigned threads = 2; threads <= 8; ++threads) {
+        size_t count = std::min<size_t>(threads, text.size() >> 20);
+        if (count < 2)
+            break;
+        DiagnosticSink diagnostics(10);
+        Lexer lexer(file);
+        lexer.setDiagnostics(&diagnostics);
+        Lexer::TokenStream parallel;
+        bool ok = lexer.parse_parallel(&parallel, threads);
+        if (ok != serial_ok || diagnostics.getErrorCount() != serial_diagnostics.getErrorCount())
+            return check_failed(name, "parallel lex", std::format("{} threads: {} with {} errors, serial {} with {}", threads,
+                                                                  ok ? "succeeded" : "failed", diagnostics.getErrorCount(),
+                                                                  serial_ok ? "succeeded" : "failed", serial_diagnostics.getErrorCount()));
+        if (parallel.size() != serial.size())
+            return check_failed(name, "parallel lex", std::format("{} threads: {} tokens, serial {}", threads, parallel.size(), serial.size()));
+        for (size_t i = 0; i < serial.size(); ++i) {
+            if (parallel.getType(i) != serial.getType(i) || parallel.getStart(i) != serial.getStart(i)
+                || parallel.getLength(i) != serial.getLength(i) || parallel.getAtom(i) != serial.getAtom(i))
+                return check_failed(name, "parallel lex", std::format("{} threads: token {} at offset {} differs", threads, i,
+                                                                      serial.getStart(i)));
+        }
+        for (size_t i = 0; i + 1 < count; ++i) {
+            size_t offset = text.size() * (i + 1) / count;
+            size_t newline = text.substr(offset, 64 << 10).find('\n');
+            cuts[boundary_kind(serial, text, newline == std::string_view::npos ? offset : offset + newline + 1)]++;
+            ++total;
+        }
+    }
+    if (total == 0) {
+        printf("%s: parallel lex skipped, under 2 MiB\n", name);
+        return true;
+    }
+    std::string summary;
+    for (size_t i = 0; i < std::size(CUT_KINDS); ++i) {
+        if (cuts[i] > 0)
+            summary += std::format("{}{} {}", summary.empty() ? "" : ", ", cuts[i], CUT_KINDS[i]);
+    }
+    if (expect != nullptr && cuts[(size_t) *expect] == 0)
+        return check_failed(name, "parallel lex", std::format("no boundary fell inside a {} ({})", CUT_KINDS[(size_t) *expect], summary));
+    printf("%s: parallel lex ok, 2-8 threads, cuts in %s\n", name, summary.c_str());
+    return true;
+}
+
+// A lexing error leaves an Error token up to the end of its line and lexing
+// goes on, so the parser still reports the rest of the file in the same
+// pass. `text` gets `count` bad lines spread through it and a parse error at
+// the end; each must be reported once, on its own line, and parse_parallel
+// must agree. Every other bad line is a string left open, which must not
+// run on into the next.
+bool check_lex_errors(const char* name, std::string text, size_t count) {
+    static const char* BAD_LINES[] = { "@ oops;\n", "u = \"oops;\n" };
+    std::vector<size_t> bad_offsets;
+    {
+        SourceFile clean(name, SourceBuffer::borrow_padded(text.data(), text.size()));
+        Lexer lexer(&clean);
+        Lexer::TokenStream tokens;
+        if (!lexer.parse(&tokens))
+            return check_failed(name, "lex errors", "the generated input does not lex");
+        // Insert back to front so the clean offsets stay valid.
+        for (size_t i = count; i > 0; --i) {
+            size_t offset = text.find('\n', text.size() * i / (count + 1));
+            while (offset != std::string::npos && boundary_kind(tokens, text, offset + 1) != 5)
+                offset = text.find('\n', offset + 1);
+            if (offset == std::string::npos)
+                return check_failed(name, "lex errors", "no line between tokens to break");
+            text.insert(offset + 1, BAD_LINES[i % 2]);
+            bad_offsets.push_back(offset + 1);
+        }
+        // Each line moves right by the ones inserted before it.
+        std::reverse(bad_offsets.begin(), bad_offsets.end());
+        for (size_t i = 1, shift = 0; i < bad_offsets.size(); ++i) {
+            shift += strlen(BAD_LINES[i % 2]);
+            bad_offsets[i] += shift;
+        }
+        text.append("a = ;\n");
+    }
+    text.append(SourceBuffer::PADDING, '\0');
+    SourceFile file(name, SourceBuffer::borrow_padded(text.data(), text.size() - SourceBuffer::PADDING));
+    DiagnosticSink diagnostics(0);
+    Lexer lexer(&file);
+    lexer.setDiagnostics(&diagnostics);
+    Lexer::TokenStream tokens;
+    if (lexer.parse(&tokens))
+        return check_failed(name, "lex errors", "the broken input lexed");
+    Parser parser(&tokens);
+    parser.setDiagnostics(&diagnostics);
+    std::unique_ptr<Program> program(parser.parse());
+    size_t unexpected = 0;
+    for (size_t i = 0; i < diagnostics.size() && i < count; ++i) {
+        DiagnosticCode code = i % 2 ? DiagnosticCode::UnexpectedCharacter : DiagnosticCode::UnterminatedString;
+        uint32_t column = i % 2 ? 0 : 4;
+        unexpected += diagnostics.at(i).code == code && diagnostics.at(i).start == bad_offsets[i] + column;
+    }
+    if (program != nullptr || unexpected != count || diagnostics.size() != count + 1
+        || diagnostics.at(count).code != DiagnosticCode::UnexpectedToken)
+        return check_failed(name, "lex errors", std::format("{} diagnostics, {} from the lexer where expected; expected {} and the parse error",
+                                                            diagnostics.size(), unexpected, count));
+    // The lexer fills a one-entry sink before the parser starts; the parse
+    // must still fail rather than come back empty.
+    DiagnosticSink capped(1);
+    Lexer capped_lexer(&file);
+    capped_lexer.setDiagnostics(&capped);
+    Lexer::TokenStream capped_tokens;
+    capped_lexer.parse(&capped_tokens);
+    Parser capped_parser(&capped_tokens);
+    capped_parser.setDiagnostics(&capped);
+    std::unique_ptr<Program> capped_program(capped_parser.parse());
+    FlatAst flat;
+    FlatParser flat_parser(&capped_tokens);
+    flat_parser.setDiagnostics(&capped);
+    if (capped_program != nullptr || flat_parser.parse_flat(&flat) || !capped.isLimited())
+        return check_failed(name, "lex errors", "a parse capped by the lexer's diagnostics succeeded");
+    if (!check_parallel_lex(name, &file))
+        return false;
+    printf("%s: lex errors ok, %zu bad lines and the parse error after them reported\n", name, count);
+    return true;
+}
+
+// Compares `actual` with `expected` column by column and reports the first
+// node that differs.
+bool same_flat(const char* name, const char* check, FlatAst* actual, FlatAst* expected) {
+    if (actual->size() != expected->size() || actual->getRootCount() != expected->getRootCount())
+        return check_failed(name, check, std::format("{} nodes in {} roots, expected {} in {}", actual->size(),
+                                                     actual->getRootCount(), expected->size(), expected->getRootCount()));
+    for (FlatAst::Index i = 0; i < actual->size(); ++i) {
+        bool same = actual->getKind(i) == expected->getKind(i) && actual->getFlags(i) == expected->getFlags(i)
+                 && actual->getOffset(i) == expected->getOffset(i) && actual->getEnd(i) == expected->getEnd(i);
+        if (same && actual->getKind(i) == NodeKind::Literal) {
+            same = actual->getLiteral(i).length == expected->getLiteral(i).length
+                && actual->getLiteral(i).atom == expected->getLiteral(i).atom;
+        } else if (same) {
+            same = actual->getData(i) == expected->getData(i);
+        }
+        if (!same)
+            return check_failed(name, check, std::format("node {} ({} at offset {}) differs", i,
+                                                         NodeKindName(expected->getKind(i)), expected->getOffset(i)));
+    }
+    return true;
+}
+
+// FlatParser emits the flat tree directly; it must match lowering the
+// pointer tree Parser builds from the same tokens, column for column.
+bool check_flat(const char* name, SourceFile* file, const BenchOptions& options) {
+    DiagnosticSink diagnostics(10);
+    Lexer lexer(file);
+    lexer.setDiagnostics(&diagnostics);
+    Lexer::TokenStream tokens;
+    if (!lexer.parse(&tokens)) {
+        report_failure(name, "lex", diagnostics);
+        return false;
+    }
+    Parser parser(&tokens);
+    parser.setOptions(options.parse_options);
+    parser.setDiagnostics(&diagnostics);
+    std::unique_ptr<Program> program(parser.parse());
+    if (program == nullptr) {
+        report_failure(name, "parse", diagnostics);
+        return false;
+    }
+    FlatAst lowered;
+    lowered.reset(file->getId(), file->getBuffer(), program->shareAtoms());
+    FlatAstLowering lowering(&lowered);
+    lowering.visitProgram(program.get());
+
+    FlatParser flat_parser(&tokens);
+    flat_parser.setOptions(options.parse_options);
+    flat_parser.setDiagnostics(&diagnostics);
+    FlatAst emitted;
+    if (!flat_parser.parse_flat(&emitted)) {
+        report_failure(name, "flat parse", diagnostics);
+        return false;
+    }
+
+    if (!same_flat(name, "flat", &emitted, &lowered))
+        return false;
+    NodeCounter counter;
+    counter.visitProgram(program.get());
+    if (counter.getCount() != emitted.size())
+        return check_failed(name, "flat", std::format("{} nodes visited, {} lowered", counter.getCount(), emitted.size()));
+    printf("%s: flat ok, %zu nodes\n", name, emitted.size());
+    return true;
+}
+
+// Expands every body a lazy parse skipped, then visits it so that the
+// functions nested in it are expanded in turn.
+struct LazyExpander : AstVisitor<LazyExpander> {
+    Program* program;
+    const SourceFile* file;
+    DiagnosticSink* diagnostics = nullptr;
+    size_t expanded = 0;
+    bool failed = false;
+
+    void visitFunctionDeclarationStatement(FunctionDeclarationStatement* node) {
+        expanded += node->isLazy();
+        if (Parser::parse_lazy_body(program, file, node, diagnostics) == nullptr) {
+            failed = true;
+            return;
+        }
+        AstVisitor::visitFunctionDeclarationStatement(node);
+    }
+};
+
+// A lazy parse with every body expanded afterwards must give the tree an
+// eager parse of the same tokens does.
+bool check_lazy(const char* name, SourceFile* file) {
+    DiagnosticSink diagnostics(10);
+    Lexer lexer(file);
+    lexer.setDiagnostics(&diagnostics);
+    Lexer::TokenStream tokens;
+    if (!lexer.parse(&tokens)) {
+        report_failure(name, "lex", diagnostics);
+        return false;
+    }
+    Parser eager_parser(&tokens);
+    eager_parser.setDiagnostics(&diagnostics);
+    std::unique_ptr<Program> eager(eager_parser.parse());
+    Parser lazy_parser(&tokens);
+    lazy_parser.setLazy(true);
+    lazy_parser.setDiagnostics(&diagnostics);
+    std::unique_ptr<Program> lazy(lazy_parser.parse());
+    if (eager == nullptr || lazy == nullptr) {
+        report_failure(name, "parse", diagnostics);
+        return false;
+    }
+    LazyExpander expander;
+    expander.program = lazy.get();
+    expander.file = file;
+    expander.diagnostics = &diagnostics;
+    expander.visitProgram(lazy.get());
+    if (expander.failed) {
+        report_failure(name, "lazy expansion", diagnostics);
+        return false;
+    }
+
+    FlatAst expected, expanded;
+    expected.reset(file->getId(), file->getBuffer(), eager->shareAtoms());
+    FlatAstLowering(&expected).visitProgram(eager.get());
+    expanded.reset(file->getId(), file->getBuffer(), lazy->shareAtoms());
+    FlatAstLowering(&expanded).visitProgram(lazy.get());
+    if (!same_flat(name, "lazy", &expanded, &expected))
+        return false;
+    printf("%s: lazy ok, %zu bodies expanded\n", name, expander.expanded);
+    return true;
+}
+
+// Lexes and parses the document's current text from scratch, sharing its
+// atoms so that both sides number names alike, and compares the result with
+// what the document kept up to date. `edited` is what apply_edit returned.
+bool same_as_full_parse(const char* name, Document* document, bool edited, size_t edit) {
+    const char* check = "incremental";
+    DiagnosticSink diagnostics(0);
+    Lexer lexer(document->getFile(), document->shareAtoms());
+    lexer.setDiagnostics(&diagnostics);
+    Lexer::TokenStream tokens;
+    lexer.parse(&tokens);
+    Parser parser(&tokens);
+    parser.setDiagnostics(&diagnostics);
+    std::unique_ptr<Program> program(parser.parse());
+    if (edited != (program != nullptr))
+        return check_failed(name, check, std::format("edit {} {}, a full parse {}", edit, edited ? "succeeded" : "failed",
+                                                     program != nullptr ? "succeeds" : "fails"));
+    // A full parse reports every lexer error before the parser's; the
+    // document goes statement by statement, so only the sets must match.
+    const DiagnosticSink& reported = document->getDiagnostics();
+    auto where = [](const DiagnosticSink& sink) {
+        std::vector<std::pair<uint32_t, DiagnosticCode>> all;
+        for (size_t i = 0; i < sink.size(); ++i)
+            all.emplace_back(sink.at(i).start, sink.at(i).code);
+        std::sort(all.begin(), all.end());
+        return all;
+    };
+    if (!edited && where(reported) != where(diagnostics))
+        return check_failed(name, check, std::format("edit {}: {} diagnostics, a full parse reports {}", edit, reported.size(),
+                                                     diagnostics.size()));
+
+    // Errors or not, the tokens must read the current text.
+    const Lexer::TokenStream& kept = document->getTokens();
+    if (kept.size() != tokens.size())
+        return check_failed(name, check, std::format("edit {}: {} tokens, expected {}", edit, kept.size(), tokens.size()));
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (kept.getType(i) != tokens.getType(i) || kept.getStart(i) != tokens.getStart(i)
+            || kept.getLength(i) != tokens.getLength(i) || kept.getAtom(i) != tokens.getAtom(i))
+            return check_failed(name, check, std::format("edit {}: token {} at offset {} differs", edit, i, tokens.getStart(i)));
+    }
+    if (!edited)
+        return true;
+    FlatAst expected;
+    expected.reset(document->getFile()->getId(), document->getBuffer(), document->shareAtoms());
+    FlatAstLowering(&expected).visitProgram(program.get());
+    FlatAst actual;
+    actual.reset(document->getFile()->getId(), document->getBuffer(), document->shareAtoms());
+    FlatAstLowering(&actual).lower(document->getStatements());
+    return same_flat(name, check, &actual, &expected);
+}
+
+// Pieces an edit inserts; several change how the text after them lexes.
+static const char* EDIT_PIECES[] = {
+    " ", "\n", ";", "a", "1", ",", "+", "(", ")", "{", "}", "[", "]", "/", "/*", "*/", "//", "`", "\"", "'",
+    "x = 1;\n", "if (a) b();\n", "function f() { return 1; }\n", "/* c */", "(a, b)",
+};
+
+// Applies random edits to a Document and checks each incremental relex and
+// reparse against a full parse of the edited text. An edit that breaks the
+// text is undone by the inverse edit, which has to recover the tree too.
+bool check_incremental(const char* name, std::string_view text, uint64_t seed) {
+    Document document(name, text);
+    if (!document.parse()) {
+        report_failure(name, "incremental parse", document.getDiagnostics());
+        return false;
+    }
+    Random random(seed);
+    size_t edits = text.size() < (1 << 20) ? 400 : 16;
+    size_t relexed = 0, reparsed = 0, undone = 0;
+    for (size_t edit = 1; edit <= edits; ++edit) {
+        size_t length = document.getLength();
+        size_t offset = random.below(length + 1);
+        size_t removed = 0;
+        std::string inserted;
+        switch (random.below(3)) {
+            case 0:
+                removed = std::min<size_t>(random.between(1, 16), length - offset);
+                break;
+            case 1: {
+                size_t from = random.below(length + 1);
+                inserted.assign(document.getBuffer().getData() + from, std::min<size_t>(random.between(1, 40), length - from));
+                break;
+            }
+            default:
+                removed = std::min<size_t>(random.below(3), length - offset);
+                inserted = EDIT_PIECES[random.below(std::size(EDIT_PIECES))];
+                break;
+        }
+        std::string old(document.getBuffer().getData() + offset, removed);
+        bool edited = document.apply_edit(offset, removed, inserted);
+        relexed += document.getRelexedTokens();
+        reparsed += document.getReparsedStatements();
+        if (!same_as_full_parse(name, &document, edited, edit))
+            return false;
+        if (!edited) {
+            ++undone;
+            edited = document.apply_edit(offset, inserted.size(), old);
+            if (!same_as_full_parse(name, &document, edited, edit))
+                return false;
+            if (!edited)
+                return check_failed(name, "incremental", std::format("undoing edit {} at offset {} did not parse", edit, offset));
+        }
+    }
+    printf("%s: incremental ok, %zu edits (%zu undone), %zu tokens relexed, %zu statements reparsed\n", name, edits, undone,
+           relexed, reparsed);
+    return true;
+}
+
+bool run_checks(const std::string& name, std::string_view text, const BenchOptions& options) {
+    SourceFile file(name.c_str(), SourceBuffer::borrow_padded(text.data(), text.size()));
+    bool ok = check_flat(name.c_str(), &file, options);
+    ok = check_lazy(name.c_str(), &file) && ok;
+    ok = check_parallel_lex(name.c_str(), &file) && ok;
+    return check_incremental(name.c_str(), text, options.seed) && ok;
+}
+
+double per_second(size_t count, double seconds) {
+    return seconds > 0 ? count / seconds : 0;
+}
+
+void print_table_header() {
+    printf("%-14s %8s %10s %10s | %9s %8s %9s | %9s %9s %9s %9s | %9s | %8s\n", "corpus", "MB", "tokens", "nodes",
+           "lex MB/s", "Mtok/s", "allocs", "parse MB/s", "Mnodes/s", "allocs", "arena MB", "strm MB/s", "peak MB");
+}
+
+void print_table_row(const Measurement& m) {
+    if (!m.ok) {
+        printf("%-14s %8.2f  failed\n", m.name.c_str(), m.bytes / 1e6);
+        return;
+    }
+    printf("%-14s %8.2f %10zu %10zu | %9.1f %8.2f %9llu | %10.1f %9.2f %9llu %9.2f | %9.1f | %8.1f\n",
+           m.name.c_str(), m.bytes / 1e6, m.tokens, m.nodes,
+           megabytes_per_second(m.bytes, m.lex.seconds), per_second(m.tokens, m.lex.seconds) / 1e6,
+           (unsigned long long) m.lex.allocations.allocations,
+           megabytes_per_second(m.bytes, m.parse.seconds), per_second(m.nodes, m.parse.seconds) / 1e6,
+           (unsigned long long) m.parse.allocations.allocations, m.arena_bytes / 1e6,
+           megabytes_per_second(m.bytes, m.stream.seconds), m.peak_rss / 1e6);
+}
+
+void print_json_string(const std::string& text) {
+    putchar('"');
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\')
+            printf("\\%c", ch);
+        else if ((unsigned char) ch < 0x20)
+            printf("\\u%04x", (unsigned) ch);
+        else
+            putchar(ch);
+    }
+    putchar('"');
+}
+
+void print_json_phase(const char* name, const Phase& phase, size_t bytes) {
+    printf("\"%s\":{\"seconds\":%.9f,\"mb_per_s\":%.3f,\"allocations\":%llu,\"allocated_bytes\":%llu", name, phase.seconds,
+           megabytes_per_second(bytes, phase.seconds), (unsigned long long) phase.allocations.allocations,
+           (unsigned long long) phase.allocations.bytes);
+}
+
+void print_json(const std::vector<Measurement>& results, const BenchOptions& options) {
+    printf("{\"seed\":%llu,\"iterations\":%u,\"corpora\":[", (unsigned long long) options.seed, options.iterations);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Measurement& m = results[i];
+        printf(i ? ",{\"name\":" : "{\"name\":");
+        print_json_string(m.name);
+        printf(",\"ok\":%s,\"bytes\":%zu,\"tokens\":%zu,\"nodes\":%zu,\"peak_rss\":%llu,", m.ok ? "true" : "false", m.bytes,
+               m.tokens, m.nodes, (unsigned long long) m.peak_rss);
+        print_json_phase("lex", m.lex, m.bytes);
+        printf(",\"tokens_per_s\":%.0f,\"token_bytes\":%zu},", per_second(m.tokens, m.lex.seconds), m.token_bytes);
+        print_json_phase("parse", m.parse, m.bytes);
+        printf(",\"nodes_per_s\":%.0f,\"arena_bytes\":%zu},", per_second(m.nodes, m.parse.seconds), m.arena_bytes);
+        print_json_phase("stream", m.stream, m.bytes);
+        printf("}}");
+    }
+    printf("]}\n");
+}
+
+void print_bench_usage(const char* program) {
+    fprintf(stderr, "usage: %s [options] [file...]\n", program);
+    fprintf(stderr, "    --size=MB       size of each generated corpus (default 4)\n");
+    fprintf(stderr, "    --iterations=N  runs per phase; the median is reported (default 5)\n");
+    fprintf(stderr, "    --seed=N        generator seed (default 1)\n");
+    fprintf(stderr, "    --corpus=NAME   only run this corpus (repeatable): ");
+    for (CorpusKind kind : CORPUS_KINDS)
+        fprintf(stderr, "%s ", CorpusKindName(kind));
+    fprintf(stderr, "\n                    and with --check: deep ");
+    for (LexStress kind : LEX_STRESS_KINDS)
+        fprintf(stderr, "%s ", LexStressName(kind));
+    fprintf(stderr, "lex-errors\n");
+    fprintf(stderr, "    --lazy          skip function bodies while parsing\n");
+    fprintf(stderr, "    --json          print results as JSON\n");
+    fprintf(stderr, "    --check         run the self-checks instead of timing\n");
+    fprintf(stderr, "Files are benchmarked instead of the generated corpora.\n");
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    std::vector<const char*> paths;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (strncmp(arg, "--size=", 7) == 0) {
+            char* end;
+            options.size_mb = strtod(arg + 7, &end);
+            if (end == arg + 7 || *end != 0 || options.size_mb <= 0) {
+                fprintf(stderr, "ERROR: invalid size '%s'\n", arg + 7);
+                return -1;
+            }
+        }
+        else if (strncmp(arg, "--iterations=", 13) == 0) {
+            char* end;
+            long iterations = strtol(arg + 13, &end, 10);
+            if (end == arg + 13 || *end != 0 || iterations < 1) {
+                fprintf(stderr, "ERROR: invalid iteration count '%s'\n", arg + 13);
+                return -1;
+            }
+            options.iterations = (unsigned) iterations;
+        }
+        else if (strncmp(arg, "--seed=", 7) == 0)
+            options.seed = strtoull(arg + 7, nullptr, 10);
+        else if (strncmp(arg, "--corpus=", 9) == 0)
+            options.corpora.push_back(arg + 9);
+        else if (strcmp(arg, "--lazy") == 0)
+            options.parse_options |= PARSE_LAZY_FUNCTIONS;
+        else if (strcmp(arg, "--json") == 0)
+            options.json = true;
+        else if (strcmp(arg, "--check") == 0)
+            options.check = true;
+        else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_bench_usage(argv[0]);
+            return 0;
+        }
+        else if (arg[0] == '-' && arg[1] != 0) {
+            fprintf(stderr, "ERROR: unknown option '%s'\n", arg);
+            print_bench_usage(argv[0]);
+            return -1;
+        }
+        else
+            paths.push_back(arg);
+    }
+    for (const std::string& name : options.corpora) {
+        bool known = false;
+        for (CorpusKind kind : CORPUS_KINDS)
+            known = known || name == CorpusKindName(kind);
+        for (LexStress kind : LEX_STRESS_KINDS)
+            known = known || (options.check && name == LexStressName(kind));
+        known = known || (options.check && (name == "deep" || name == "lex-errors"));
+        if (!known) {
+            fprintf(stderr, "ERROR: unknown corpus '%s'\n", name.c_str());
+            return -1;
+        }
+    }
+
+    if (!options.json && !options.check)
+        print_table_header();
+    std::vector<Measurement> results;
+    bool checked = true;
+    auto run = [&](const std::string& name, std::string_view text) {
+        if (options.check) {
+            checked = run_checks(name, text, options) && checked;
+            fflush(stdout);
+            return;
+        }
+        Measurement measurement = measure(name, text, options);
+        if (!options.json) {
+            print_table_row(measurement);
+            fflush(stdout);
+        }
+        results.push_back(std::move(measurement));
+    };
+
+    if (!paths.empty()) {
+        for (const char* path : paths) {
+            MappedFile file;
+            if (!file.open(path))
+                return -1;
+            const SourceBuffer& source = file.getBuffer();
+            run(path, std::string_view(source.getData(), source.getLength()));
+        }
+    } else {
+        if (options.check) {
+            std::string sample = CHECK_SAMPLE;
+            sample.append(SourceBuffer::PADDING, '\0');
+            run("sample", std::string_view(sample.data(), sample.size() - SourceBuffer::PADDING));
+            checked = check_statement_ends("sample") && checked;
+            checked = check_regex_contexts("sample") && checked;
+        }
+        size_t bytes = (size_t) (options.size_mb * (1 << 20));
+        for (CorpusKind kind : CORPUS_KINDS) {
+            std::string name = CorpusKindName(kind);
+            if (!options.corpora.empty() && std::find(options.corpora.begin(), options.corpora.end(), name) == options.corpora.end())
+                continue;
+            // Each corpus starts from the seed on its own, so filtering
+            // with --corpus does not change the others.
+            CorpusGenerator generator(options.seed);
+            std::string text = generator.generate(kind, bytes);
+            text.append(SourceBuffer::PADDING, '\0');
+            run(name, std::string_view(text.data(), text.size() - SourceBuffer::PADDING));
+        }
+        if (options.check && (options.corpora.empty() || std::find(options.corpora.begin(), options.corpora.end(), "deep") != options.corpora.end())) {
+            std::string text = generate_deep(200000);
+            text.append(SourceBuffer::PADDING, '\0');
+            run("deep", std::string_view(text.data(), text.size() - SourceBuffer::PADDING));
+        }
+        // Big enough for eight chunks whatever --size says.
+        for (LexStress kind : LEX_STRESS_KINDS) {
+            if (!options.check)
+                break;
+            std::string name = LexStressName(kind);
+            if (!options.corpora.empty() && std::find(options.corpora.begin(), options.corpora.end(), name) == options.corpora.end())
+                continue;
+            std::string text = generate_lex_stress(kind, std::max<size_t>(bytes, 8 << 20), options.seed);
+            text.append(SourceBuffer::PADDING, '\0');
+            SourceFile file(name.c_str(), SourceBuffer::borrow_padded(text.data(), text.size() - SourceBuffer::PADDING));
+            checked = check_parallel_lex(name.c_str(), &file, &kind) && checked;
+            fflush(stdout);
+        }
+        if (options.check && (options.corpora.empty() || std::find(options.corpora.begin(), options.corpora.end(), "lex-errors") != options.corpora.end())) {
+            checked = check_lex_errors("lex-errors", generate_lex_stress(LexStress::Strings, std::max<size_t>(bytes, 8 << 20), options.seed), 16) && checked;
+            fflush(stdout);
+        }
+    }
+
+    if (options.json && !options.check)
+        print_json(results, options);
+    if (!checked)
+        return -1;
+    for (const Measurement& measurement : results) {
+        if (!measurement.ok)
+            return -1;
+    }
+    return 0;
+}
@@ -1 +1,2 @@
-g++ -std=c++23 -Wall -Wextra -Werror -I . -o build/main main.cpp
\ No newline at end of file
+g++ -std=c++23 -Wall -Wextra -Werror -I . -o build/main main.cpp
+g++ -std=c++23 -O2 -Wall -Wextra -Werror -I . -o build/bench bench.cpp
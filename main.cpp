@@ -3,10 +3,65 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
-#include <functional>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <format>
 #include <vector>
-#include <map>
+#include <algorithm>
+#include <memory>
+#include <string_view>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <deque>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <intrin.h>
+#include <direct.h>
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JS_PARSER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define JS_PARSER_AVX2 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define JS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define JS_TARGET_AVX2
+#endif
+#endif
+
+// ParseStats counters, phase timers and the tracer are compiled in unless
+// JS_PARSER_NO_STATS is defined; JS_STAT wraps each hook so that without
+// them nothing is left behind.
+#ifndef JS_PARSER_NO_STATS
+#define JS_PARSER_STATS 1
+#define JS_STAT(...) __VA_ARGS__
+#else
+#define JS_STAT(...)
+#endif
 
 char* strslice(const char* input, int start, int end) {
     int length = end - start;
@@ -28,1042 +83,7786 @@ char* strslice(const char* input, int start, int end) {
 }
 
 template <typename T>
-bool vcontains(std::vector<T> vector, T item) {
-    for (int i = 0; i < vector.size(); ++i) {
-        T it = vector.at(i);
-        if (it == item || strcmp(it, item) == 0)
+bool vcontains(const std::vector<T>& vector, T item) {
+    for (size_t i = 0; i < vector.size(); ++i) {
+        if (vector[i] == item)
             return true;
     }
     return false;
 }
 
-class Location {
+inline uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Fast non-cryptographic 64-bit hash, eight bytes per step with a
+// splitmix-style finalizer.
+uint64_t hash_bytes(const void* data, size_t length, uint64_t seed = 0) {
+    const uint64_t K0 = 0x9E3779B97F4A7C15ull;
+    const uint64_t K1 = 0xBF58476D1CE4E5B9ull;
+    const unsigned char* p = (const unsigned char*) data;
+    uint64_t hash = seed ^ (length * K0);
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = rotate_left(hash ^ (word * K1), 29) * K0;
+        p += 8;
+        length -= 8;
+    }
+    if (length > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, length);
+        hash = rotate_left(hash ^ (word * K1), 29) * K0;
+    }
+    hash ^= hash >> 31;
+    hash *= K1;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// Source text the lexer runs over. The PADDING bytes after the last
+// character are always readable and zero, so scanning loops can look ahead
+// without bounds checks. EOF is decided by length alone, which means the
+// input does not need to be NUL-terminated and may contain embedded NULs.
+class SourceBuffer {
 public:
-    Location()
-        : m_file_path(nullptr),
-          m_cursor(0),
-          m_row(0),
-          m_bol(0) {}
+    static constexpr size_t PADDING = 64;
+
+    SourceBuffer()
+        : m_data(s_empty),
+          m_length(0) {}
+
+    // Copies `length` bytes into an owned, zero-padded allocation.
+    SourceBuffer(const char* data, size_t length)
+        : m_data(s_empty),
+          m_length(0) {
+        char* storage = (char*) malloc(length + PADDING);
+        if (storage == nullptr) {
+            fprintf(stderr, "ERROR: failed to allocate %zu byte source buffer\n", length);
+            return;
+        }
+        if (length > 0)
+            memcpy(storage, data, length);
+        memset(storage + length, 0, PADDING);
+        m_storage = std::shared_ptr<char>(storage, free);
+        m_data = storage;
+        m_length = length;
+    }
 
-    Location(const char* file_path, int cursor, int row, int bol)
-        : m_file_path(file_path),
-          m_cursor(cursor),
-          m_row(row),
-          m_bol(bol) {}
+    SourceBuffer(const char* input)
+        : SourceBuffer(input, input ? strlen(input) : 0) {}
+
+    // Wraps memory owned by the caller without copying. The caller
+    // guarantees that data[length .. length + PADDING) is readable and zero
+    // for as long as the buffer (or any copy of it) is in use.
+    static SourceBuffer borrow_padded(const char* data, size_t length) {
+        SourceBuffer buffer;
+        buffer.m_data = data;
+        buffer.m_length = length;
+        return buffer;
+    }
 
-    const char* getPath() { return !m_file_path ? "repl" : m_file_path; }
+    // Takes ownership of a malloc'd block that already has PADDING zero
+    // bytes after data[length].
+    static SourceBuffer adopt(char* data, size_t length) {
+        SourceBuffer buffer;
+        buffer.m_storage = std::shared_ptr<char>(data, free);
+        buffer.m_data = data;
+        buffer.m_length = length;
+        return buffer;
+    }
 
-    int getCursor() { return m_cursor; }
+    const char* getData() const { return m_data; }
 
-    int getRow() { return m_row; }
+    size_t getLength() const { return m_length; }
 
-    int getCol() { return m_cursor - m_bol; }
+    const char* getEnd() const { return m_data + m_length; }
 
-    int getBol() { return m_bol; }
+    // Valid for any index below getLength() + PADDING.
+    char at(size_t index) const { return m_data[index]; }
 
 private:
-    const char* m_file_path;
-    int m_cursor;
-    int m_row;
-    int m_bol;
+    static constexpr char s_empty[PADDING] = {};
+
+    const char* m_data;
+    size_t m_length;
+    std::shared_ptr<char> m_storage;
 };
 
-class Lexer {
-public:
-    enum TokenType : int {
-        Identifier,
-        Keyword,
-        String,
-        Number,
-
-        Plus,
-        Dash,
-        Slash,
-        Asterisk,
-        Pipe,
-        Carot,
-        Ampersand,
-        Percent,
-        Exclamation,
-        QuestionMark,
-        Equal,
-
-        Colon,
-        Semicolon,
-        Period,
-        Comma,
-        Hashtag,
-
-        OpenParen,
-        CloseParen,
-        OpenBracket,
-        CloseBracket,
-        OpenSquareBracket,
-        CloseSquareBracket,
-        OpenAngleBracket,
-        CloseAngleBracket
-    };
+inline unsigned count_trailing_zeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned) index;
+#else
+    return (unsigned) __builtin_ctz(mask);
+#endif
+}
 
-    static const char* TokenTypeName(TokenType type) {
-        switch (type) {
-            case Identifier: return "Identifier";
-            case Keyword: return "Keyword";
-            case String: return "String";
-            case Number: return "Number";
-            case Plus: return "Plus";
-            case Dash: return "Dash";
-            case Slash: return "Slash";
-            case Asterisk: return "Asterisk";
-            case Pipe: return "Pipe";
-            case Carot: return "Carot";
-            case Ampersand: return "Ampersand";
-            case Percent: return "Percent";
-            case Exclamation: return "Exclamation";
-            case QuestionMark: return "QuestionMark";
-            case Equal: return "Equal";
-            case Colon: return "Colon";
-            case Semicolon: return "Semicolon";
-            case Period: return "Period";
-            case Comma: return "Comma";
-            case Hashtag: return "Hashtag";
-            case OpenParen: return "OpenParen";
-            case CloseParen: return "CloseParen";
-            case OpenBracket: return "OpenBracket";
-            case CloseBracket: return "CloseBracket";
-            case OpenSquareBracket: return "OpenSquareBracket";
-            case CloseSquareBracket: return "CloseSquareBracket";
-            case OpenAngleBracket: return "OpenAngleBracket";
-            case CloseAngleBracket: return "CloseAngleBracket";            
+// Appends the offset of every line start (0 and one past each '\n') in
+// source. Sixteen bytes per step where SSE2 is available; the zero padding
+// makes the final partial block safe to load and it never matches.
+void find_line_starts(const SourceBuffer& source, std::vector<uint32_t>* out) {
+    const char* data = source.getData();
+    size_t length = source.getLength();
+    out->push_back(0);
+#ifdef JS_PARSER_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (size_t i = 0; i < length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (data + i));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask != 0) {
+            out->push_back((uint32_t) (i + count_trailing_zeros(mask) + 1));
+            mask &= mask - 1;
         }
-        assert(false && "unreachable");
     }
+#else
+    const char* cursor = data;
+    const char* end = data + length;
+    while ((cursor = (const char*) memchr(cursor, '\n', end - cursor)) != nullptr)
+        out->push_back((uint32_t) (++cursor - data));
+#endif
+}
 
-    class Token {
-    public:
-        Token(TokenType type, const char* slice, Location location)
-            : m_type(type),
-              m_slice(slice),
-              m_location(location) {}
+// Scanning kernels for the lexer's hot loops. Each one takes a pointer
+// into a SourceBuffer and returns the first byte that ends the run, so they
+// rely on the zero padding: NUL is never part of a run, which stops every
+// kernel at the end of the input without a length check. Callers have to
+// tell an embedded NUL apart from EOF by comparing against the end.
+namespace scan {
 
-        TokenType getType() { return m_type; }
+inline bool is_space(unsigned char ch) {
+    return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
 
-        const char* getSlice() { return m_slice; }
-        
-        Location getLocation() { return m_location; }
+inline bool is_identifier_part(unsigned char ch) {
+    return (ch >= '0' && ch <= '9') || ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z') || ch == '_' || ch == '$';
+}
 
-    private:
-        TokenType m_type;
-        const char* m_slice;
-        Location m_location;
-    };
+const char* skip_whitespace_scalar(const char* p) {
+    while (is_space(*p))
+        ++p;
+    return p;
+}
 
-    Lexer(const char* file_path, const char* input)
-        : m_file_path(file_path),
-          m_input(input),
-          m_cursor(0),
-          m_row(0),
-          m_bol(0) {}
+const char* find_line_end_scalar(const char* p) {
+    while (*p != '\n' && *p != 0)
+        ++p;
+    return p;
+}
 
-    void report(const char* message, Location location) {
-        char* part = strslice(m_input, location.getCursor(), location.getCursor() + 12);
-        fprintf(stderr, "[Lexer] (%s:%i:%i)\n", location.getPath(), location.getRow(), location.getCol());
-        fprintf(stderr, ">       %s\n", part);
-        fprintf(stderr, "        ^\n");
-        fprintf(stderr, "        %s\n", message);
-        free(part);
-    }
+const char* skip_identifier_scalar(const char* p) {
+    while (is_identifier_part(*p))
+        ++p;
+    return p;
+}
+
+const char* find_string_special_scalar(const char* p, char quote) {
+    while (*p != quote && *p != '\\' && *p != '\n' && *p != '\r' && *p != 0)
+        ++p;
+    return p;
+}
 
-    void report(std::string message, Location location) {
-        report(message.c_str(), location);
+#ifdef JS_PARSER_SSE2
+// Unsigned `lo <= x <= hi` per byte.
+inline __m128i in_range_sse2(__m128i x, char lo, char hi) {
+    __m128i shifted = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8((char) (hi - lo))), shifted);
+}
+
+const char* skip_whitespace_sse2(const char* p) {
+    for (;; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), in_range_sse2(block, '\t', '\r'));
+        uint32_t stop = ~(uint32_t) _mm_movemask_epi8(space) & 0xFFFF;
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    bool is_eof() {
-        return current() == 0;
+const char* find_line_end_sse2(const char* p) {
+    for (;; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+        uint32_t stop = (uint32_t) _mm_movemask_epi8(hit);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    char current() {
-        if (m_cursor > strlen(m_input))
-            return 0; // null?
-        return m_input[m_cursor];
+const char* skip_identifier_sse2(const char* p) {
+    for (;; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i letter = in_range_sse2(_mm_or_si128(block, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i digit = in_range_sse2(block, '0', '9');
+        __m128i symbol = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('_')), _mm_cmpeq_epi8(block, _mm_set1_epi8('$')));
+        __m128i part = _mm_or_si128(_mm_or_si128(letter, digit), symbol);
+        uint32_t stop = ~(uint32_t) _mm_movemask_epi8(part) & 0xFFFF;
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    char peek() {
-        if (m_cursor + 1 >= strlen(m_input))
-            return 0; // null?
-        return m_input[m_cursor + 1];
+const char* find_string_special_sse2(const char* p, char quote) {
+    for (;; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(quote)), _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+        __m128i line = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+        hit = _mm_or_si128(_mm_or_si128(hit, line), _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+        uint32_t stop = (uint32_t) _mm_movemask_epi8(hit);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
+#endif
 
-    Location getLocation() {
-        return Location(m_file_path, m_cursor, m_row, m_bol);
+#ifdef JS_PARSER_AVX2
+JS_TARGET_AVX2 inline __m256i in_range_avx2(__m256i x, char lo, char hi) {
+    __m256i shifted = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8((char) (hi - lo))), shifted);
+}
+
+JS_TARGET_AVX2 const char* skip_whitespace_avx2(const char* p) {
+    for (;; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')), in_range_avx2(block, '\t', '\r'));
+        uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(space);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    char consume() {
-        if (is_eof())
-            return '\0';
-        char ch = m_input[m_cursor++];
-        if (ch == '\n') {
-            m_row++;
-            m_bol = m_cursor;
-        }
-        return ch;
+JS_TARGET_AVX2 const char* find_line_end_avx2(const char* p) {
+    for (;; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(block, _mm256_setzero_si256()));
+        uint32_t stop = (uint32_t) _mm256_movemask_epi8(hit);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    bool consume_expect(const char* word) {
-        if (is_eof() || word == nullptr)
-            return false;
-        char* value = strslice((char*) m_input, m_cursor, m_cursor + strlen(word));
-        bool same = strcmp(value, word) == 0;
-        if (same) 
-            m_cursor += strlen(word);
-        free(value);
-        return same;
+JS_TARGET_AVX2 const char* skip_identifier_avx2(const char* p) {
+    for (;; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i letter = in_range_avx2(_mm256_or_si256(block, _mm256_set1_epi8(0x20)), 'a', 'z');
+        __m256i digit = in_range_avx2(block, '0', '9');
+        __m256i symbol = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('$')));
+        __m256i part = _mm256_or_si256(_mm256_or_si256(letter, digit), symbol);
+        uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(part);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    bool consume_expect(char ch) {
-        if (is_eof() || ch == 0)
-            return false;
-        bool same = current() == ch;
-        if (same) 
-            consume();
-        return same;
+JS_TARGET_AVX2 const char* find_string_special_avx2(const char* p, char quote) {
+    for (;; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*) p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(quote)), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\')));
+        __m256i line = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')));
+        hit = _mm256_or_si256(_mm256_or_si256(hit, line), _mm256_cmpeq_epi8(block, _mm256_setzero_si256()));
+        uint32_t stop = (uint32_t) _mm256_movemask_epi8(hit);
+        if (stop != 0)
+            return p + count_trailing_zeros(stop);
     }
+}
 
-    void consume_while(std::function<bool(char)> condition) {
-        while (!is_eof() && condition(current()))
-            consume();
+bool cpu_has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+#endif
+
+struct Kernels {
+    const char* name;
+    const char* (*skip_whitespace)(const char* p);
+    const char* (*find_line_end)(const char* p);
+    const char* (*skip_identifier)(const char* p);
+    const char* (*find_string_special)(const char* p, char quote);
+};
+
+constexpr Kernels SCALAR = { "scalar", skip_whitespace_scalar, find_line_end_scalar, skip_identifier_scalar, find_string_special_scalar };
+#ifdef JS_PARSER_SSE2
+constexpr Kernels SSE2 = { "sse2", skip_whitespace_sse2, find_line_end_sse2, skip_identifier_sse2, find_string_special_sse2 };
+#endif
+#ifdef JS_PARSER_AVX2
+constexpr Kernels AVX2 = { "avx2", skip_whitespace_avx2, find_line_end_avx2, skip_identifier_avx2, find_string_special_avx2 };
+#endif
+
+// Atomic because batch workers construct lexers concurrently; every thread
+// that races on first use stores the same pointer.
+inline std::atomic<const Kernels*> s_active = nullptr;
+
+const Kernels* best() {
+#ifdef JS_PARSER_AVX2
+    if (cpu_has_avx2())
+        return &AVX2;
+#endif
+#ifdef JS_PARSER_SSE2
+    return &SSE2;
+#else
+    return &SCALAR;
+#endif
+}
+
+// Picked once from the CPU on first use unless select() overrides it.
+inline const Kernels& kernels() {
+    const Kernels* active = s_active.load(std::memory_order_relaxed);
+    if (active == nullptr) {
+        active = best();
+        s_active.store(active, std::memory_order_relaxed);
     }
+    return *active;
+}
 
-    void trim_left() {
-        consume_while(isspace);
+// Forces a kernel set by name ("scalar", "sse2", "avx2"); false if that set
+// is not compiled in or not supported by this CPU.
+bool select(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        s_active = &SCALAR;
+        return true;
+    }
+#ifdef JS_PARSER_SSE2
+    if (strcmp(name, "sse2") == 0) {
+        s_active = &SSE2;
+        return true;
     }
+#endif
+#ifdef JS_PARSER_AVX2
+    if (strcmp(name, "avx2") == 0 && cpu_has_avx2()) {
+        s_active = &AVX2;
+        return true;
+    }
+#endif
+    return false;
+}
 
-    bool parse(std::vector<Token>* tokens) {
-        tokens->clear(); // Clear if anything is in vector
+} // namespace scan
 
-        while (!is_eof()) {
-            trim_left();
-            char ch = current();
-            Location startLocation = getLocation();
+struct LineColumn {
+    int row;
+    int col;
+    int bol;
+};
 
-            // Comments
-            if (ch == '/' && peek() == '/') {
-                consume_expect("//");
-                consume_while([](char ch) { return ch != 10; /* '\n' */ });
-                continue;
-            }
+// A source text registered under a 32-bit id so that a Location only has
+// to carry (file id, byte offset). Rows and columns are resolved on demand
+// from a line-start table that is built the first time one is asked for.
+// The file must outlive every Location that refers to it.
+//
+// Resolving an id takes no lock: the registry is a fixed array of slot
+// segments that never move once allocated. Each thread takes ids from the
+// shared pool a block at a time and keeps the ids of files it drops, so
+// registering and unregistering only lock the pool once per block and
+// when the thread exits.
+class SourceFile {
+public:
+    SourceFile(const char* path, SourceBuffer source)
+        : m_path(path),
+          m_source(source) {
+        IdCache& cache = t_ids;
+        if (cache.ids.empty())
+            refill(&cache);
+        m_id = cache.ids.back();
+        cache.ids.pop_back();
+        slot(m_id)->store(this, std::memory_order_release);
+    }
 
-            // Strings
-            else if (ch == '\'' || ch == '"' || ch == '`') {
-                size_t start = m_cursor;
-                char quote = consume();
-         
-                while (!is_eof() && current() != quote) {
-                    char ch = consume();
-                    if (ch == '\\')
-                        consume();
-                }
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    ~SourceFile() {
+        slot(m_id)->store(nullptr, std::memory_order_release);
+        IdCache& cache = t_ids;
+        cache.ids.push_back(m_id);
+        // A thread that drops files others registered hands the surplus on.
+        if (cache.ids.size() >= 2 * ID_BLOCK) {
+            std::lock_guard<std::mutex> lock(s_pool_mutex);
+            s_pool.insert(s_pool.end(), cache.ids.end() - ID_BLOCK, cache.ids.end());
+            cache.ids.resize(cache.ids.size() - ID_BLOCK);
+        }
+    }
 
-                // expecting closing quote
-                if (!consume_expect(quote)) {
-                    report("expected closing quote on string", startLocation);
-                    return false;
-                }
+    // Id 0 is never handed out, so a default Location refers to no file.
+    static SourceFile* get(uint32_t id) {
+        if (id >> SEGMENT_BITS >= SEGMENT_COUNT)
+            return nullptr;
+        std::atomic<SourceFile*>* segment = s_segments[id >> SEGMENT_BITS].load(std::memory_order_acquire);
+        return segment ? segment[id & SEGMENT_MASK].load(std::memory_order_acquire) : nullptr;
+    }
 
-                char* out = strslice(m_input, start, m_cursor);
-                tokens->push_back(Token(TokenType::String, out, startLocation));
-                continue;
-            }
+    uint32_t getId() const { return m_id; }
 
-            // Identifiers/Keywords
-            else if (isalpha(ch) || ch == '_') {
-                Location location = getLocation();
-                size_t start = m_cursor;
-                consume_while([](char ch) {
-                    return isalnum(ch) || ch == '_';
-                });
-                char* word = strslice((char*) m_input, start, m_cursor);
-                if (word == nullptr) {
-                    report("ERROR: failed to get value for identifier, is null.", location);
-                    free(word);
-                    return false;
-                }
-                TokenType type = isKeyword(word) ? TokenType::Keyword : TokenType::Identifier;
-                tokens->push_back(Token(type, word, location));
-                continue;
-            }
+    const char* getPath() const { return !m_path ? "repl" : m_path; }
 
-            // Numbers
-            else if (isdigit(ch)) {
-                size_t start = m_cursor;
-                consume_while([](char ch) { return isdigit(ch); });
-                char* value = strslice(m_input, start, m_cursor);
-                tokens->push_back(Token(TokenType::Number, value, startLocation));
-                continue;
-            }
+    const SourceBuffer& getBuffer() const { return m_source; }
 
-            TokenType charType = charTokenType(ch);
-            if (charType > 0) {
-                int start = m_cursor;
-                consume();
-                const char* ch = strslice(m_input, start, m_cursor);
-                tokens->push_back(Token(charType, ch, startLocation));
-                continue;
-            }
+    // Swaps in edited text (see Document). Nothing may be resolving
+    // locations in this file at the same time.
+    void setBuffer(SourceBuffer source) {
+        m_source = source;
+        m_line_starts.clear();
+        m_line_starts_once = std::make_unique<std::once_flag>();
+    }
 
-            report(std::format("Unexpected char whilst lexing... ('%c', %i)\n", ch, ch), startLocation);
-            return false;
-        }
+    const std::vector<uint32_t>& getLineStarts() const {
+        std::call_once(*m_line_starts_once, [this]() { find_line_starts(m_source, &m_line_starts); });
+        return m_line_starts;
+    }
 
-        return true;
+    LineColumn resolve(uint32_t offset) const {
+        const std::vector<uint32_t>& lines = getLineStarts();
+        auto line = std::upper_bound(lines.begin(), lines.end(), offset) - 1;
+        return LineColumn { (int) (line - lines.begin()), (int) (offset - *line), (int) *line };
     }
 
 private:
-    bool isKeyword(const char* word) {
-        const char* KEYWORDS[] = {
-            "this", "new",
-            "async", "function", 
-            "return", "yield", "continue", "break",
-            "let", "const", "var",
-            "private", "public", "protected", "override",
-            "interface", "class", "enum",
-            "if", "while", "do", "else", "catch",
-            "debugger"
-        };
-
-        #define KEYWORDS_LEN (sizeof(KEYWORDS) / sizeof(const char*))
-
-        for (size_t i = 0; i < KEYWORDS_LEN; ++i) {
-            const char* keyword = KEYWORDS[i];
-            if (strcmp(keyword, word) == 0)
-                return true;
+    static constexpr uint32_t SEGMENT_BITS = 12;
+    static constexpr uint32_t SEGMENT_MASK = (1u << SEGMENT_BITS) - 1;
+    static constexpr uint32_t SEGMENT_COUNT = 4096;
+    static constexpr size_t ID_BLOCK = 64;
+
+    // Ids this thread may hand out; whatever is left goes back to the pool
+    // when the thread exits.
+    struct IdCache {
+        std::vector<uint32_t> ids;
+
+        ~IdCache() {
+            std::lock_guard<std::mutex> lock(s_pool_mutex);
+            s_pool.insert(s_pool.end(), ids.begin(), ids.end());
         }
+    };
 
-        return false;
+    static std::atomic<SourceFile*>* slot(uint32_t id) {
+        return &s_segments[id >> SEGMENT_BITS].load(std::memory_order_relaxed)[id & SEGMENT_MASK];
     }
 
-    TokenType charTokenType(char word) {
-        std::map<char, TokenType> CHAR_TOKENS = std::map<char, TokenType>();
-        CHAR_TOKENS['+'] = TokenType::Plus;
-        CHAR_TOKENS['-'] = TokenType::Dash;
-        CHAR_TOKENS['/'] = TokenType::Slash;
-        CHAR_TOKENS['*'] = TokenType::Asterisk;
-        CHAR_TOKENS['|'] = TokenType::Pipe;
-        CHAR_TOKENS['^'] = TokenType::Carot;
-        CHAR_TOKENS['&'] = TokenType::Ampersand;
-        CHAR_TOKENS['%'] = TokenType::Percent;
-        CHAR_TOKENS['!'] = TokenType::Exclamation;
-        CHAR_TOKENS['?'] = TokenType::QuestionMark;
-        CHAR_TOKENS['='] = TokenType::Equal;
-        CHAR_TOKENS[':'] = TokenType::Colon;
-        CHAR_TOKENS[';'] = TokenType::Semicolon;
-        CHAR_TOKENS['.'] = TokenType::Period;
-        CHAR_TOKENS[','] = TokenType::Comma;
-        CHAR_TOKENS['#'] = TokenType::Hashtag;
-        CHAR_TOKENS['('] = TokenType::OpenParen;
-        CHAR_TOKENS[')'] = TokenType::CloseParen;
-        CHAR_TOKENS['{'] = TokenType::OpenBracket;
-        CHAR_TOKENS['}'] = TokenType::CloseBracket;
-        CHAR_TOKENS['['] = TokenType::OpenSquareBracket;
-        CHAR_TOKENS[']'] = TokenType::CloseSquareBracket;
-        CHAR_TOKENS['<'] = TokenType::OpenAngleBracket;
-        CHAR_TOKENS['>'] = TokenType::CloseAngleBracket;
-        return CHAR_TOKENS[word];
-    }
-
-    const char* m_file_path;
-    const char* m_input;
+    // Takes a block of returned ids, or fresh ones when too few came back,
+    // allocating the segments they live in.
+    static void refill(IdCache* cache) {
+        std::lock_guard<std::mutex> lock(s_pool_mutex);
+        while (cache->ids.size() < ID_BLOCK && !s_pool.empty()) {
+            cache->ids.push_back(s_pool.back());
+            s_pool.pop_back();
+        }
+        while (cache->ids.size() < ID_BLOCK) {
+            uint32_t id = s_next_id++;
+            if (id >> SEGMENT_BITS >= SEGMENT_COUNT) {
+                fprintf(stderr, "ERROR: too many source files open at once\n");
+                abort();
+            }
+            std::atomic<std::atomic<SourceFile*>*>& segment = s_segments[id >> SEGMENT_BITS];
+            if (segment.load(std::memory_order_relaxed) == nullptr)
+                segment.store(new std::atomic<SourceFile*>[SEGMENT_MASK + 1](), std::memory_order_release);
+            cache->ids.push_back(id);
+        }
+    }
 
-    size_t m_cursor;
-    int m_row;
-    int m_bol;
+    static inline std::atomic<std::atomic<SourceFile*>*> s_segments[SEGMENT_COUNT] = {};
+    static inline std::mutex s_pool_mutex;
+    static inline std::vector<uint32_t> s_pool;
+    static inline uint32_t s_next_id = 1;
+    static inline thread_local IdCache t_ids;
+
+    const char* m_path;
+    SourceBuffer m_source;
+    uint32_t m_id;
+    std::unique_ptr<std::once_flag> m_line_starts_once = std::make_unique<std::once_flag>();
+    mutable std::vector<uint32_t> m_line_starts;
 };
 
-// Expressions
-class Expression {
+class Location {
 public:
-    Expression() = default;
+    Location()
+        : m_file_id(0),
+          m_offset(0) {}
 
-    Expression(Location location)
-        : m_location(location) {}
-    
-    const char* m_class_name = "Expression";
+    Location(uint32_t file_id, uint32_t offset)
+        : m_file_id(file_id),
+          m_offset(offset) {}
 
-    const char* getClassName() { return m_class_name; }
+    uint32_t getFileId() { return m_file_id; }
 
-    Location getLocation() { return m_location; }
+    const char* getPath() {
+        SourceFile* file = SourceFile::get(m_file_id);
+        return file ? file->getPath() : "repl";
+    }
+
+    uint32_t getCursor() { return m_offset; }
+
+    LineColumn resolve() {
+        SourceFile* file = SourceFile::get(m_file_id);
+        return file ? file->resolve(m_offset) : LineColumn { 0, (int) m_offset, 0 };
+    }
+
+    int getRow() { return resolve().row; }
+
+    int getCol() { return resolve().col; }
+
+    int getBol() { return resolve().bol; }
 
 private:
-    Location m_location;
+    uint32_t m_file_id;
+    uint32_t m_offset;
 };
 
-class Identifier : public Expression {
-public:
-    Identifier(const char* name, Location location)
-        : m_name(name),
-          m_location(location) {
-            m_class_name = "Identifier";
+// Appends printf-style text to `out`, or prints it to stderr when `out`
+// is null.
+void print_diagnostic(std::string* out, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (out == nullptr) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(nullptr, 0, format, copy);
+    va_end(copy);
+    if (length > 0) {
+        size_t size = out->size();
+        out->resize(size + length + 1);
+        vsnprintf(out->data() + size, length + 1, format, args);
+        out->resize(size + length);
+    }
+    va_end(args);
+}
+
+// Appends `text` to `out` as a quoted JSON string.
+void append_json_string(std::string* out, std::string_view text) {
+    out->push_back('"');
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            out->push_back('\\');
+            out->push_back(ch);
+        } else if ((unsigned char) ch < 0x20) {
+            print_diagnostic(out, "\\u%04x", (unsigned) ch);
+        } else {
+            out->push_back(ch);
         }
+    }
+    out->push_back('"');
+}
 
-    const char* getName() { return m_name; }
+enum class Severity : uint8_t {
+    Error,
+    Warning,
+};
 
-    Location getLocation() { return m_location; }
+const char* SeverityName(Severity severity) {
+    return severity == Severity::Error ? "error" : "warning";
+}
 
-private:
-    const char* m_name;
-    Location m_location;
+// Stable codes tools can match on; the message text may change.
+enum class DiagnosticCode : uint8_t {
+    // Lexer
+    InputTooLarge,
+    UnexpectedCharacter,
+    UnterminatedString,
+    UnterminatedRegex,
+    UnterminatedTemplate,
+    UnterminatedComment,
+    // Parser
+    UnexpectedEnd,
+    UnexpectedToken,
+    ExpectedToken,
+    UnbalancedBracket,
+    InvalidTarget,
+    Unsupported,
+    NestingTooDeep,
+    // Document
+    EditOutOfRange,
 };
 
-class Literal : public Expression {
+const char* DiagnosticCodeName(DiagnosticCode code) {
+    switch (code) {
+        case DiagnosticCode::InputTooLarge: return "input-too-large";
+        case DiagnosticCode::UnexpectedCharacter: return "unexpected-character";
+        case DiagnosticCode::UnterminatedString: return "unterminated-string";
+        case DiagnosticCode::UnterminatedRegex: return "unterminated-regex";
+        case DiagnosticCode::UnterminatedTemplate: return "unterminated-template";
+        case DiagnosticCode::UnterminatedComment: return "unterminated-comment";
+        case DiagnosticCode::UnexpectedEnd: return "unexpected-end";
+        case DiagnosticCode::UnexpectedToken: return "unexpected-token";
+        case DiagnosticCode::ExpectedToken: return "expected-token";
+        case DiagnosticCode::UnbalancedBracket: return "unbalanced-bracket";
+        case DiagnosticCode::InvalidTarget: return "invalid-target";
+        case DiagnosticCode::Unsupported: return "unsupported";
+        case DiagnosticCode::NestingTooDeep: return "nesting-too-deep";
+        case DiagnosticCode::EditOutOfRange: return "edit-out-of-range";
+    }
+    return "unknown";
+}
+
+// One reported problem over the source bytes [start, end). The message
+// text lives in the sink's pool.
+struct Diagnostic {
+    DiagnosticCode code;
+    Severity severity;
+    uint32_t file_id;
+    uint32_t start;
+    uint32_t end;
+    uint32_t message_offset;
+    uint32_t message_length;
+};
+
+// Collects diagnostics as plain records and renders them once, at the end,
+// as text or as one JSON object per line. Room for `limit` records is
+// reserved up front; past that reports are only counted, and isFull tells
+// the parser to stop recovering (0 means no limit).
+class DiagnosticSink {
 public:
-    Literal(const char* value, Location location)
-        : m_value(value),
-          m_location(location) {
-            m_class_name = "Literal";
+    enum class Format : uint8_t {
+        Text,
+        Json,
+    };
+
+    static constexpr size_t DEFAULT_LIMIT = 100;
+
+    DiagnosticSink(size_t limit = DEFAULT_LIMIT)
+        : m_limit(0),
+          m_errors(0),
+          m_dropped(0) {
+        setLimit(limit);
+    }
+
+    void setLimit(size_t limit) {
+        m_limit = limit ? limit : SIZE_MAX;
+        size_t reserve = std::min<size_t>(m_limit, 1024);
+        m_entries.reserve(reserve);
+        m_messages.reserve(reserve * 64);
+    }
+
+    void report(DiagnosticCode code, Severity severity, uint32_t file_id, uint32_t start, uint32_t end, std::string_view message) {
+        if (severity == Severity::Error)
+            ++m_errors;
+        if (isFull()) {
+            ++m_dropped;
+            return;
         }
+        m_entries.push_back(Diagnostic { code, severity, file_id, start, end, (uint32_t) m_messages.size(), (uint32_t) message.size() });
+        m_messages.append(message);
+    }
 
-    const char* getValue() { return m_value; }
+    bool isFull() const { return m_entries.size() >= m_limit; }
 
-    Location getLocation() { return m_location; }
+    // Whether reports were dropped past the limit, rather than only
+    // reaching it.
+    bool isLimited() const { return m_dropped != 0; }
 
-private:
-    const char* m_value;
-    Location m_location;
-};
+    bool empty() const { return m_entries.empty(); }
 
-// Statements
-class Statement {
-public:
-    Statement() = default;
+    size_t size() const { return m_entries.size(); }
 
-    Statement(Location location)
-        : m_location(location) {}
+    const Diagnostic& at(size_t index) const { return m_entries[index]; }
 
-    const char* m_class_name = "Statement";
+    std::string_view getMessage(const Diagnostic& diagnostic) const {
+        return std::string_view(m_messages.data() + diagnostic.message_offset, diagnostic.message_length);
+    }
 
-    const char* getClassName() { return m_class_name; }
+    // Errors reported, including the ones past the limit.
+    size_t getErrorCount() const { return m_errors; }
 
-    Location getLocation() { return m_location; }
+    void clear() {
+        m_entries.clear();
+        m_messages.clear();
+        m_errors = 0;
+        m_dropped = 0;
+    }
+
+    // Renders every record in report order. Positions are resolved through
+    // SourceFile, so the files have to still be registered.
+    void render(std::string* out, Format format) const {
+        if (format == Format::Json) {
+            render_json(out);
+            return;
+        }
+        for (const Diagnostic& diagnostic : m_entries)
+            render_text(out, diagnostic);
+        if (isLimited())
+            print_diagnostic(out, "stopped after %zu diagnostics\n", m_entries.size());
+    }
+
+    // Hands every record on to `sink`, or prints them when it is null.
+    void forward(DiagnosticSink* sink) const;
 
 private:
-    Location m_location;
+    void render_text(std::string* out, const Diagnostic& diagnostic) const {
+        std::string_view message = getMessage(diagnostic);
+        SourceFile* file = SourceFile::get(diagnostic.file_id);
+        if (file == nullptr) {
+            print_diagnostic(out, "%u: %s: %.*s [%s]\n", diagnostic.start, SeverityName(diagnostic.severity),
+                             (int) message.size(), message.data(), DiagnosticCodeName(diagnostic.code));
+            return;
+        }
+        LineColumn position = file->resolve(diagnostic.start);
+        print_diagnostic(out, "%s:%i:%i: %s: %.*s [%s]\n", file->getPath(), position.row, position.col,
+                         SeverityName(diagnostic.severity), (int) message.size(), message.data(),
+                         DiagnosticCodeName(diagnostic.code));
+
+        // The offending line, cut down to a window around the start so
+        // minified sources stay readable.
+        const SourceBuffer& source = file->getBuffer();
+        const char* text = source.getData();
+        size_t length = source.getLength();
+        size_t start = std::min<size_t>(diagnostic.start, length);
+        size_t from = std::max<size_t>(position.bol, start > 40 ? start - 40 : 0);
+        size_t to = start;
+        while (to < length && to - from < 100 && text[to] != '\n' && text[to] != '\r')
+            ++to;
+        std::string marker;
+        for (size_t i = from; i < start; ++i)
+            marker.push_back(text[i] == '\t' ? '\t' : ' ');
+        marker.push_back('^');
+        size_t end = std::min<size_t>(diagnostic.end, to);
+        for (size_t i = start + 1; i < end; ++i)
+            marker.push_back('~');
+        print_diagnostic(out, "    %.*s\n    %s\n", (int) (to - from), text + from, marker.c_str());
+    }
+
+    // {"errors":N,"limited":bool,"diagnostics":[{...}]} on one line; rows
+    // and columns are zero-based like everywhere else in the tool.
+    void render_json(std::string* out) const {
+        print_diagnostic(out, "{\"errors\":%zu,\"limited\":%s,\"diagnostics\":[", m_errors, isLimited() ? "true" : "false");
+        for (size_t i = 0; i < m_entries.size(); ++i) {
+            const Diagnostic& diagnostic = m_entries[i];
+            SourceFile* file = SourceFile::get(diagnostic.file_id);
+            LineColumn position = file ? file->resolve(diagnostic.start) : LineColumn { 0, (int) diagnostic.start, 0 };
+            out->append(i ? ",{\"file\":" : "{\"file\":");
+            append_json_string(out, file ? file->getPath() : "");
+            print_diagnostic(out, ",\"code\":\"%s\",\"severity\":\"%s\",\"start\":%u,\"end\":%u,\"line\":%i,\"column\":%i,\"message\":",
+                             DiagnosticCodeName(diagnostic.code), SeverityName(diagnostic.severity),
+                             diagnostic.start, diagnostic.end, position.row, position.col);
+            append_json_string(out, getMessage(diagnostic));
+            out->push_back('}');
+        }
+        out->append("]}\n");
+    }
+
+    size_t m_limit;
+    size_t m_errors;
+    size_t m_dropped;
+    std::vector<Diagnostic> m_entries;
+    std::string m_messages;
 };
 
-class EmptyStatement : public Statement {
-public:
-    EmptyStatement(Location location)
-        : m_location(location) {
-        m_class_name = "EmptyStatement";
+// Records one diagnostic in `sink`, or prints it right away when there is
+// no sink to collect it.
+void report_diagnostic(DiagnosticSink* sink, DiagnosticCode code, Severity severity, uint32_t file_id, size_t start, size_t end,
+                       std::string_view message) {
+    if (sink != nullptr) {
+        sink->report(code, severity, file_id, (uint32_t) start, (uint32_t) end, message);
+        return;
     }
+    DiagnosticSink single(1);
+    single.report(code, severity, file_id, (uint32_t) start, (uint32_t) end, message);
+    std::string text;
+    single.render(&text, DiagnosticSink::Format::Text);
+    fputs(text.c_str(), stderr);
+}
 
-private:
-    Location m_location;
+void DiagnosticSink::forward(DiagnosticSink* sink) const {
+    for (const Diagnostic& diagnostic : m_entries)
+        report_diagnostic(sink, diagnostic.code, diagnostic.severity, diagnostic.file_id, diagnostic.start, diagnostic.end, getMessage(diagnostic));
+}
+
+// What parsing one file (or, summed with add, a whole batch) produced and
+// where its time went. The Lexer and Parser fill in their own phases when
+// given one; reading and serializing are timed by whoever does them. A
+// streaming parse (--stream, every file of a batch run and every parse
+// cache miss) lexes inside its parse phase, so its lex time is part of
+// parse_ns and lex_ns stays zero: timing each token on its own would cost
+// more than lexing it. Everything stays zero when stats are compiled out.
+struct ParseStats {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t tokens = 0;
+    uint64_t nodes = 0;
+    uint64_t allocations = 0;    // AST arena blocks, or flat AST column buffers
+    uint64_t arena_bytes = 0;
+    uint64_t diagnostics = 0;
+    uint64_t read_ns = 0;
+    uint64_t lex_ns = 0;
+    uint64_t parse_ns = 0;
+    uint64_t serialize_ns = 0;
+
+    void add(const ParseStats& other) {
+        files += other.files;
+        bytes += other.bytes;
+        tokens += other.tokens;
+        nodes += other.nodes;
+        allocations += other.allocations;
+        arena_bytes += other.arena_bytes;
+        diagnostics += other.diagnostics;
+        read_ns += other.read_ns;
+        lex_ns += other.lex_ns;
+        parse_ns += other.parse_ns;
+        serialize_ns += other.serialize_ns;
+    }
+
+    // One JSON object on one line; times are in milliseconds.
+    void render_json(std::string* out) const {
+        print_diagnostic(out, "{\"files\":%llu,\"bytes\":%llu,\"tokens\":%llu,\"nodes\":%llu,\"allocations\":%llu,"
+                              "\"arena_bytes\":%llu,\"diagnostics\":%llu,\"read_ms\":%.3f,\"lex_ms\":%.3f,"
+                              "\"parse_ms\":%.3f,\"serialize_ms\":%.3f}\n",
+                         (unsigned long long) files, (unsigned long long) bytes, (unsigned long long) tokens,
+                         (unsigned long long) nodes, (unsigned long long) allocations, (unsigned long long) arena_bytes,
+                         (unsigned long long) diagnostics, read_ns / 1e6, lex_ns / 1e6, parse_ns / 1e6, serialize_ns / 1e6);
+    }
 };
 
-class DebuggerStatement : public Statement {
+#ifdef JS_PARSER_STATS
+// Records what every thread spends its time on as Chrome trace-event
+// spans, for Perfetto or chrome://tracing. Each thread appends to a buffer
+// of its own, registered under the lock the first time it records, so a
+// span costs two clock reads and a push_back. The buffers are only read
+// by write(), after every thread that filled them has been joined.
+class Tracer {
 public:
-    DebuggerStatement(Location location)
-        : m_location(location) {
-        m_class_name = "DebuggerStatement";
+    using Clock = std::chrono::steady_clock;
+
+    Tracer() : m_id(++s_ids), m_epoch(Clock::now()) {}
+
+    ~Tracer() { stop(); }
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // The tracer spans go to, or null when tracing is off.
+    static Tracer* getActive() { return s_active.load(std::memory_order_relaxed); }
+
+    // Call before starting any thread that should be traced.
+    void start() {
+        m_epoch = Clock::now();
+        s_active.store(this, std::memory_order_relaxed);
+        name_thread("main");
     }
-    
+
+    void stop() {
+        Tracer* self = this;
+        s_active.compare_exchange_strong(self, nullptr);
+    }
+
+    // Labels the calling thread in the viewer.
+    static void name_thread(std::string name) {
+        if (Tracer* tracer = getActive())
+            tracer->buffer()->name = std::move(name);
+    }
+
+    // Copies a file path into the calling thread's buffer once, for the
+    // spans of that file to refer to. 0 stands for no path.
+    uint32_t intern_path(std::string_view path) {
+        if (path.empty())
+            return 0;
+        Buffer* buffer = this->buffer();
+        if (buffer->paths.empty() || buffer->paths.back() != path)
+            buffer->paths.emplace_back(path);
+        return (uint32_t) buffer->paths.size();
+    }
+
+    // `path` comes from intern_path on the same thread.
+    void record(const char* name, uint32_t path, Clock::time_point begin, Clock::time_point end) {
+        buffer()->events.push_back(Event { name, path, begin, end });
+    }
+
+    // Writes every span as one "X" event, in microseconds since start().
+    bool write(const char* path) const {
+        FILE* out = fopen(path, "wb");
+        if (out == nullptr) {
+            fprintf(stderr, "ERROR: failed to open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        bool ok = true;
+        std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        const char* separator = "";
+        for (const std::unique_ptr<Buffer>& buffer : m_buffers) {
+            print_diagnostic(&json, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                             separator, buffer->tid);
+            append_json_string(&json, buffer->name.empty() ? std::format("thread {}", buffer->tid) : buffer->name);
+            json.append("}}");
+            separator = ",\n";
+            for (const Event& event : buffer->events) {
+                print_diagnostic(&json, ",\n{\"name\":\"%s\",\"cat\":\"parser\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                                 event.name, buffer->tid, microseconds(m_epoch, event.begin), microseconds(event.begin, event.end));
+                if (event.path != 0) {
+                    json.append(",\"args\":{\"path\":");
+                    append_json_string(&json, buffer->paths[event.path - 1]);
+                    json.push_back('}');
+                }
+                json.push_back('}');
+                if (json.size() >= (1 << 16)) {
+                    ok = fwrite(json.data(), 1, json.size(), out) == json.size() && ok;
+                    json.clear();
+                }
+            }
+        }
+        json.append("\n]}\n");
+        ok = fwrite(json.data(), 1, json.size(), out) == json.size() && ok;
+        if (fclose(out) != 0)
+            ok = false;
+        if (!ok)
+            fprintf(stderr, "ERROR: failed to write '%s': %s\n", path, strerror(errno));
+        return ok;
+    }
+
 private:
-    Location m_location;
+    struct Event {
+        const char* name;
+        uint32_t path;
+        Clock::time_point begin;
+        Clock::time_point end;
+    };
+
+    struct Buffer {
+        uint32_t tid;
+        std::string name;
+        std::vector<Event> events;
+        std::vector<std::string> paths;
+    };
+
+    static double microseconds(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration<double, std::micro>(to - from).count();
+    }
+
+    // The calling thread's buffer. Tracers are told apart by id rather
+    // than address so a new one never inherits a stale buffer.
+    Buffer* buffer() {
+        thread_local uint64_t t_owner = 0;
+        thread_local Buffer* t_buffer = nullptr;
+        if (t_owner != m_id) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_buffers.push_back(std::make_unique<Buffer>());
+            t_buffer = m_buffers.back().get();
+            t_buffer->tid = (uint32_t) m_buffers.size();
+            t_buffer->events.reserve(1024);
+            t_owner = m_id;
+        }
+        return t_buffer;
+    }
+
+    static inline std::atomic<Tracer*> s_active { nullptr };
+    static inline std::atomic<uint64_t> s_ids { 0 };
+
+    uint64_t m_id;
+    Clock::time_point m_epoch;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
 };
 
-class IfStatement : public Statement {
+// The span name a ParseStats phase shows up under in a trace.
+const char* PhaseName(uint64_t ParseStats::* phase) {
+    if (phase == &ParseStats::read_ns)
+        return "read";
+    if (phase == &ParseStats::lex_ns)
+        return "lex";
+    if (phase == &ParseStats::parse_ns)
+        return "parse";
+    return "serialize";
+}
+
+// Adds the lifetime of the scope to a ParseStats phase, when there is one,
+// and records it as a span of that phase when tracing.
+class PhaseTimer {
 public:
-    IfStatement(Expression* test, Statement* body, Location location)
-        : m_test(test),
-          m_body(body),
-          m_location(location) {
-        m_class_name = "IfStatement";
+    PhaseTimer(ParseStats* stats, uint64_t ParseStats::* phase)
+        : m_stats(stats),
+          m_phase(phase),
+          m_tracer(Tracer::getActive()),
+          m_start(stats || m_tracer ? Tracer::Clock::now() : Tracer::Clock::time_point()) {}
+
+    ~PhaseTimer() {
+        if (m_stats == nullptr && m_tracer == nullptr)
+            return;
+        Tracer::Clock::time_point end = Tracer::Clock::now();
+        if (m_stats != nullptr)
+            m_stats->*m_phase += std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count();
+        if (m_tracer != nullptr)
+            m_tracer->record(PhaseName(m_phase), 0, m_start, end);
     }
 
-    ~IfStatement() { 
-        free(m_body);
-    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
 
 private:
-    Expression* m_test;
-    Statement* m_body;
-    Location m_location;
+    ParseStats* m_stats;
+    uint64_t ParseStats::* m_phase;
+    Tracer* m_tracer;
+    Tracer::Clock::time_point m_start;
+};
+
+// Records the lifetime of the scope as one span, labelled with the file it
+// worked on, when tracing.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, std::string_view path = {})
+        : m_tracer(Tracer::getActive()),
+          m_name(name),
+          m_path(m_tracer ? m_tracer->intern_path(path) : 0),
+          m_start(m_tracer ? Tracer::Clock::now() : Tracer::Clock::time_point()) {}
+
+    ~TraceSpan() {
+        if (m_tracer != nullptr)
+            m_tracer->record(m_name, m_path, m_start, Tracer::Clock::now());
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    Tracer* m_tracer;
+    const char* m_name;
+    uint32_t m_path;
+    Tracer::Clock::time_point m_start;
+};
+#endif
+
+// Runs body(0) .. body(count - 1) on `count` threads, the first one on the
+// calling thread, and waits for all of them.
+template <typename Body>
+void parallel_for(size_t count, Body body) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; ++i)
+        threads.emplace_back(body, i);
+    if (count > 0)
+        body(0);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// A file opened read-only for lexing. Regular files are memory-mapped so
+// only the pages the lexer actually touches are ever read; the mapping is
+// laid out so the SourceBuffer padding comes for free (zero-filled tail of
+// the last page plus an anonymous zero page when needed). Pipes, stdin
+// ("-") and anything that cannot be mapped fall back to one buffered read.
+class MappedFile {
+public:
+    MappedFile()
+        : m_path(nullptr),
+          m_mapping(nullptr),
+          m_mapping_size(0),
+          m_mapped(false) {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const char* path) {
+        close();
+        m_path = path;
+        if (strcmp(path, "-") == 0)
+            return read_stream(stdin);
+        if (map(path))
+            return true;
+        FILE* file = fopen(path, "rb");
+        if (file == nullptr) {
+            fprintf(stderr, "ERROR: failed to open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        bool ok = read_stream(file);
+        fclose(file);
+        return ok;
+    }
+
+    void close() {
+        if (m_mapping != nullptr) {
+#ifdef _WIN32
+            UnmapViewOfFile(m_mapping);
+#else
+            munmap(m_mapping, m_mapping_size);
+#endif
+        }
+        m_mapping = nullptr;
+        m_mapping_size = 0;
+        m_mapped = false;
+        m_buffer = SourceBuffer();
+    }
+
+    const char* getPath() const { return m_path; }
+
+    const SourceBuffer& getBuffer() const { return m_buffer; }
+
+    bool isMapped() const { return m_mapped; }
+
+private:
+    bool map(const char* path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            CloseHandle(file);
+            return false;
+        }
+        // Views cannot extend past the end of the file, so only map when the
+        // zero-filled remainder of the last page already covers the padding.
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        size_t length = (size_t) size.QuadPart;
+        size_t slack = (info.dwPageSize - length % info.dwPageSize) % info.dwPageSize;
+        if (slack < SourceBuffer::PADDING) {
+            CloseHandle(file);
+            return false;
+        }
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr)
+            return false;
+        void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (view == nullptr)
+            return false;
+        m_mapping = view;
+        m_mapping_size = length;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size_t length = (size_t) st.st_size;
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t total = (length + SourceBuffer::PADDING + page - 1) / page * page;
+
+        // Reserve the whole range as anonymous zero pages, then map the file
+        // over the front of it. Whatever is left over is the padding.
+        void* region = mmap(nullptr, total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(region, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        ::close(fd);
+        if (view == MAP_FAILED) {
+            munmap(region, total);
+            return false;
+        }
+        madvise(region, length, MADV_SEQUENTIAL);
+        m_mapping = region;
+        m_mapping_size = total;
+#endif
+        m_mapped = true;
+        m_buffer = SourceBuffer::borrow_padded((const char*) m_mapping, length);
+        return true;
+    }
+
+    bool read_stream(FILE* stream) {
+#ifdef _WIN32
+        _setmode(_fileno(stream), _O_BINARY);
+#endif
+        size_t capacity = 1 << 16;
+        size_t length = 0;
+        char* data = (char*) malloc(capacity);
+        while (data != nullptr) {
+            size_t wanted = capacity - length - SourceBuffer::PADDING;
+            size_t got = fread(data + length, 1, wanted, stream);
+            length += got;
+            if (got < wanted)
+                break;
+            capacity *= 2;
+            char* grown = (char*) realloc(data, capacity);
+            if (grown == nullptr)
+                free(data);
+            data = grown;
+        }
+        if (data == nullptr) {
+            fprintf(stderr, "ERROR: failed to allocate buffer for '%s'\n", m_path);
+            return false;
+        }
+        if (ferror(stream)) {
+            fprintf(stderr, "ERROR: failed to read '%s': %s\n", m_path, strerror(errno));
+            free(data);
+            return false;
+        }
+        memset(data + length, 0, SourceBuffer::PADDING);
+        m_buffer = SourceBuffer::adopt(data, length);
+        return true;
+    }
+
+    const char* m_path;
+    void* m_mapping;
+    size_t m_mapping_size;
+    bool m_mapped;
+    SourceBuffer m_buffer;
+};
+
+// Opens `path` into `file` and counts it as the read phase of `stats`
+// (when set). A mapping is only read as it is touched, so for mapped
+// files most of the I/O shows up in the lexing phase instead.
+bool open_source(MappedFile* file, const char* path, ParseStats* stats) {
+    JS_STAT(PhaseTimer timer(stats, &ParseStats::read_ns);)
+    if (!file->open(path))
+        return false;
+    if (stats != nullptr) {
+        stats->files += 1;
+        stats->bytes += file->getBuffer().getLength();
+    }
+    return true;
+}
+
+// Bump-pointer allocator every AST node (and interned string) comes from.
+// Objects must be trivially destructible since nothing is destroyed one at
+// a time: release() hands all blocks back at once.
+class AstArena {
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    AstArena()
+        : m_blocks(nullptr),
+          m_cursor(nullptr),
+          m_end(nullptr),
+          m_reserved(0),
+          m_used(0),
+          m_block_count(0),
+          m_node_count(0) {}
+
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    AstArena(AstArena&& other)
+        : m_blocks(std::exchange(other.m_blocks, nullptr)),
+          m_cursor(std::exchange(other.m_cursor, nullptr)),
+          m_end(std::exchange(other.m_end, nullptr)),
+          m_reserved(std::exchange(other.m_reserved, 0)),
+          m_used(std::exchange(other.m_used, 0)),
+          m_block_count(std::exchange(other.m_block_count, 0)),
+          m_node_count(std::exchange(other.m_node_count, 0)) {}
+
+    AstArena& operator=(AstArena&& other) {
+        if (this != &other) {
+            release();
+            m_blocks = std::exchange(other.m_blocks, nullptr);
+            m_cursor = std::exchange(other.m_cursor, nullptr);
+            m_end = std::exchange(other.m_end, nullptr);
+            m_reserved = std::exchange(other.m_reserved, 0);
+            m_used = std::exchange(other.m_used, 0);
+            m_block_count = std::exchange(other.m_block_count, 0);
+            m_node_count = std::exchange(other.m_node_count, 0);
+        }
+        return *this;
+    }
+
+    ~AstArena() {
+        release();
+    }
+
+    void* allocate(size_t size, size_t align) {
+        uintptr_t aligned = ((uintptr_t) m_cursor + align - 1) & ~(uintptr_t) (align - 1);
+        if (m_cursor == nullptr || aligned + size > (uintptr_t) m_end) {
+            if (!grow(size + align))
+                return nullptr;
+            aligned = ((uintptr_t) m_cursor + align - 1) & ~(uintptr_t) (align - 1);
+        }
+        m_used += aligned + size - (uintptr_t) m_cursor;
+        m_cursor = (char*) (aligned + size);
+        return (void*) aligned;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        void* memory = allocate(sizeof(T), alignof(T));
+        JS_STAT(++m_node_count;)
+        return memory ? new (memory) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    template <typename T>
+    T* make_array(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "arena nodes are never destroyed");
+        return (T*) allocate(sizeof(T) * count, alignof(T));
+    }
+
+    void release() {
+        while (m_blocks != nullptr)
+            free(std::exchange(m_blocks, m_blocks->next));
+        m_cursor = nullptr;
+        m_end = nullptr;
+        m_reserved = 0;
+        m_used = 0;
+        m_block_count = 0;
+        m_node_count = 0;
+    }
+
+    // Takes over `other`'s blocks, e.g. nodes parsed later into a tree
+    // that already owns this arena. Allocation continues in our block.
+    void absorb(AstArena&& other) {
+        if (other.m_blocks == nullptr)
+            return;
+        if (m_blocks == nullptr) {
+            *this = std::move(other);
+            return;
+        }
+        Block* tail = other.m_blocks;
+        while (tail->next != nullptr)
+            tail = tail->next;
+        tail->next = m_blocks->next;
+        m_blocks->next = other.m_blocks;
+        m_reserved += std::exchange(other.m_reserved, 0);
+        m_used += std::exchange(other.m_used, 0);
+        m_block_count += std::exchange(other.m_block_count, 0);
+        m_node_count += std::exchange(other.m_node_count, 0);
+        other.m_blocks = nullptr;
+        other.m_cursor = nullptr;
+        other.m_end = nullptr;
+    }
+
+    size_t getReserved() const { return m_reserved; }
+
+    // Bytes handed out, including alignment padding.
+    size_t getUsed() const { return m_used; }
+
+    // Blocks taken from malloc.
+    size_t getBlockCount() const { return m_block_count; }
+
+    // Objects built with make, which are all AST nodes; only counted when
+    // stats are compiled in.
+    size_t getNodeCount() const { return m_node_count; }
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    bool grow(size_t minimum) {
+        size_t size = minimum + sizeof(Block) > BLOCK_SIZE ? minimum + sizeof(Block) : BLOCK_SIZE;
+        Block* block = (Block*) malloc(size);
+        if (block == nullptr) {
+            fprintf(stderr, "ERROR: failed to allocate %zu byte AST block\n", size);
+            return false;
+        }
+        block->next = m_blocks;
+        m_blocks = block;
+        m_cursor = (char*) (block + 1);
+        m_end = (char*) block + size;
+        m_reserved += size;
+        ++m_block_count;
+        return true;
+    }
+
+    Block* m_blocks;
+    char* m_cursor;
+    char* m_end;
+    size_t m_reserved;
+    size_t m_used;
+    size_t m_block_count;
+    size_t m_node_count;
+};
+
+using Atom = uint32_t;
+
+// Maps each distinct identifier/string spelling to a 32-bit atom so that
+// name equality is an integer compare and every spelling is stored once.
+// A table is normally owned by one parse; a shared one (e.g. across batch
+// workers) splits its map into independently locked shards.
+class AtomTable {
+public:
+    static constexpr Atom NONE = 0;
+
+    AtomTable(bool shared = false)
+        : m_shared(shared) {}
+
+    AtomTable(const AtomTable&) = delete;
+    AtomTable& operator=(const AtomTable&) = delete;
+
+    Atom intern(std::string_view text) {
+        uint64_t hash = hash_bytes(text.data(), text.size());
+        uint32_t shard_index = m_shared ? (uint32_t) (hash >> (64 - SHARD_BITS)) : 0;
+        Shard& shard = m_shards[shard_index];
+        if (!m_shared)
+            return shard.intern(text, hash, shard_index);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.intern(text, hash, shard_index);
+    }
+
+    std::string_view getText(Atom atom) {
+        if (atom == NONE)
+            return std::string_view();
+        Shard& shard = m_shards[atom & SHARD_MASK];
+        if (!m_shared)
+            return shard.texts[(atom >> SHARD_BITS) - 1];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.texts[(atom >> SHARD_BITS) - 1];
+    }
+
+    // 1-based position of `atom` in interning order, for side tables keyed
+    // by atom. Only meaningful for unshared tables.
+    static size_t ordinal(Atom atom) { return atom >> SHARD_BITS; }
+
+    static Atom from_ordinal(size_t ordinal) { return (Atom) ordinal << SHARD_BITS; }
+
+    size_t size() {
+        size_t count = 0;
+        for (Shard& shard : m_shards) {
+            if (m_shared)
+                shard.mutex.lock();
+            count += shard.texts.size();
+            if (m_shared)
+                shard.mutex.unlock();
+        }
+        return count;
+    }
+
+private:
+    static constexpr uint32_t SHARD_BITS = 4;
+    static constexpr uint32_t SHARD_MASK = (1u << SHARD_BITS) - 1;
+
+    struct Slot {
+        uint32_t hash;
+        Atom atom;
+    };
+
+    // Open-addressed (hash, atom) slots kept at most half full; the text
+    // itself lives in the arena and is only compared on a hash match.
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Slot> slots;
+        std::vector<std::string_view> texts;
+        AstArena storage;
+
+        Atom intern(std::string_view text, uint64_t hash, uint32_t shard_index) {
+            if ((texts.size() + 1) * 2 > slots.size())
+                rehash(slots.empty() ? 256 : slots.size() * 2);
+            uint32_t short_hash = (uint32_t) hash;
+            size_t mask = slots.size() - 1;
+            for (size_t i = short_hash & mask;; i = (i + 1) & mask) {
+                Slot& slot = slots[i];
+                if (slot.atom == NONE) {
+                    char* copy = (char*) storage.allocate(text.size() ? text.size() : 1, 1);
+                    if (copy == nullptr)
+                        return NONE;
+                    memcpy(copy, text.data(), text.size());
+                    texts.push_back(std::string_view(copy, text.size()));
+                    slot.hash = short_hash;
+                    slot.atom = ((Atom) texts.size() << SHARD_BITS) | shard_index;
+                    return slot.atom;
+                }
+                if (slot.hash == short_hash && texts[(slot.atom >> SHARD_BITS) - 1] == text)
+                    return slot.atom;
+            }
+        }
+
+        void rehash(size_t capacity) {
+            std::vector<Slot> old = std::move(slots);
+            slots.assign(capacity, Slot { 0, NONE });
+            for (const Slot& slot : old) {
+                if (slot.atom == NONE)
+                    continue;
+                size_t i = slot.hash & (capacity - 1);
+                while (slots[i].atom != NONE)
+                    i = (i + 1) & (capacity - 1);
+                slots[i] = slot;
+            }
+        }
+    };
+
+    bool m_shared;
+    Shard m_shards[1u << SHARD_BITS];
+};
+
+// Token kinds live outside Lexer so the keyword table below can be built
+// at compile time before Lexer is complete; Lexer::TokenType aliases it.
+namespace tokens {
+
+enum TokenType : uint8_t {
+    Identifier,
+    String,
+    Number,
+    Regex,
+    Template,
+
+    Plus,
+    Dash,
+    Slash,
+    Asterisk,
+    Pipe,
+    Carot,
+    Ampersand,
+    Percent,
+    Exclamation,
+    QuestionMark,
+    Equal,
+
+    Colon,
+    Semicolon,
+    Period,
+    Comma,
+    Hashtag,
+
+    OpenParen,
+    CloseParen,
+    OpenBracket,
+    CloseBracket,
+    OpenSquareBracket,
+    CloseSquareBracket,
+    OpenAngleBracket,
+    CloseAngleBracket,
+
+    Tilde,
+    Ellipsis,
+    EqualEqual,
+    EqualEqualEqual,
+    ExclamationEqual,
+    ExclamationEqualEqual,
+    LessEqual,
+    GreaterEqual,
+    ShiftLeft,
+    ShiftRight,
+    UnsignedShiftRight,
+    PlusPlus,
+    DashDash,
+    AsteriskAsterisk,
+    PlusEqual,
+    DashEqual,
+    AsteriskEqual,
+    SlashEqual,
+    PercentEqual,
+    AsteriskAsteriskEqual,
+    ShiftLeftEqual,
+    ShiftRightEqual,
+    UnsignedShiftRightEqual,
+    AmpersandEqual,
+    PipeEqual,
+    CarotEqual,
+    AmpersandAmpersand,
+    PipePipe,
+    QuestionQuestion,
+    AmpersandAmpersandEqual,
+    PipePipeEqual,
+    QuestionQuestionEqual,
+    QuestionPeriod,
+    Arrow,
+
+    // Keywords, kept contiguous so Lexer::isKeyword is a range check.
+    KwThis,
+    KwNew,
+    KwFunction,
+    KwReturn,
+    KwContinue,
+    KwBreak,
+    KwConst,
+    KwVar,
+    KwClass,
+    KwEnum,
+    KwIf,
+    KwWhile,
+    KwDo,
+    KwElse,
+    KwCatch,
+    KwDebugger,
+    KwFor,
+    KwTrue,
+    KwFalse,
+    KwNull,
+    KwSwitch,
+    KwCase,
+    KwDefault,
+    KwTry,
+    KwFinally,
+    KwThrow,
+    KwImport,
+    KwExport,
+    KwExtends,
+    KwSuper,
+    KwTypeof,
+    KwInstanceof,
+    KwIn,
+    KwDelete,
+    KwVoid,
+    KwWith,
+
+    // Contextual and strict-mode-only words, last so Lexer::isContextual
+    // is a range check too. A script may use them as names.
+    KwAsync,
+    KwAwait,
+    KwYield,
+    KwLet,
+    KwStatic,
+    KwImplements,
+    KwInterface,
+    KwPackage,
+    KwPrivate,
+    KwProtected,
+    KwPublic,
+
+    // What a recovering lexer emits in place of the text it could not lex.
+    Error,
+};
+
+} // namespace tokens
+
+using tokens::TokenType;
+
+namespace keywords {
+
+struct Keyword {
+    const char* text;
+    TokenType type;
+};
+
+constexpr Keyword LIST[] = {
+    { "this", TokenType::KwThis },
+    { "new", TokenType::KwNew },
+    { "async", TokenType::KwAsync },
+    { "function", TokenType::KwFunction },
+    { "return", TokenType::KwReturn },
+    { "yield", TokenType::KwYield },
+    { "continue", TokenType::KwContinue },
+    { "break", TokenType::KwBreak },
+    { "let", TokenType::KwLet },
+    { "const", TokenType::KwConst },
+    { "var", TokenType::KwVar },
+    { "private", TokenType::KwPrivate },
+    { "public", TokenType::KwPublic },
+    { "protected", TokenType::KwProtected },
+    { "interface", TokenType::KwInterface },
+    { "class", TokenType::KwClass },
+    { "enum", TokenType::KwEnum },
+    { "if", TokenType::KwIf },
+    { "while", TokenType::KwWhile },
+    { "do", TokenType::KwDo },
+    { "else", TokenType::KwElse },
+    { "catch", TokenType::KwCatch },
+    { "debugger", TokenType::KwDebugger },
+    { "for", TokenType::KwFor },
+    { "true", TokenType::KwTrue },
+    { "false", TokenType::KwFalse },
+    { "null", TokenType::KwNull },
+    { "switch", TokenType::KwSwitch },
+    { "case", TokenType::KwCase },
+    { "default", TokenType::KwDefault },
+    { "try", TokenType::KwTry },
+    { "finally", TokenType::KwFinally },
+    { "throw", TokenType::KwThrow },
+    { "import", TokenType::KwImport },
+    { "export", TokenType::KwExport },
+    { "extends", TokenType::KwExtends },
+    { "super", TokenType::KwSuper },
+    { "typeof", TokenType::KwTypeof },
+    { "instanceof", TokenType::KwInstanceof },
+    { "in", TokenType::KwIn },
+    { "delete", TokenType::KwDelete },
+    { "void", TokenType::KwVoid },
+    { "with", TokenType::KwWith },
+    { "await", TokenType::KwAwait },
+    { "static", TokenType::KwStatic },
+    { "implements", TokenType::KwImplements },
+    { "package", TokenType::KwPackage },
+};
+
+constexpr size_t COUNT = sizeof(LIST) / sizeof(LIST[0]);
+constexpr size_t MIN_LENGTH = 2;
+constexpr size_t MAX_LENGTH = 10;
+constexpr uint32_t TABLE_BITS = 8;
+constexpr uint32_t TABLE_SIZE = 1u << TABLE_BITS;
+
+constexpr size_t length_of(const char* text) {
+    size_t length = 0;
+    while (text[length] != 0)
+        ++length;
+    return length;
+}
+
+// Packs length, first, second and last character; "private" and
+// "package" share length, first and last, so one more byte is needed.
+constexpr uint32_t key_of(const char* word, size_t length) {
+    return ((uint32_t) (unsigned char) word[0] << 24) | 
+           ((uint32_t) (unsigned char) word[1] << 16) | 
+           ((uint32_t) (unsigned char) word[length - 1] << 8) | 
+           (uint32_t) length;
+}
+
+constexpr uint32_t slot_of(uint32_t key, uint32_t seed) {
+    return (key * seed) >> (32 - TABLE_BITS);
+}
+
+struct Keys {
+    uint32_t values[COUNT];
+};
+
+constexpr Keys build_keys() {
+    Keys keys = {};
+    for (size_t i = 0; i < COUNT; ++i)
+        keys.values[i] = key_of(LIST[i].text, length_of(LIST[i].text));
+    return keys;
+}
+
+constexpr Keys KEYS = build_keys();
+
+constexpr bool is_perfect(uint32_t seed) {
+    uint64_t used[TABLE_SIZE / 64] = {};
+    for (size_t i = 0; i < COUNT; ++i) {
+        uint32_t slot = slot_of(KEYS.values[i], seed);
+        uint64_t bit = (uint64_t) 1 << (slot % 64);
+        if (used[slot / 64] & bit)
+            return false;
+        used[slot / 64] |= bit;
+    }
+    return true;
+}
+
+// First odd multiplier that sends every keyword to its own slot.
+constexpr uint32_t find_seed() {
+    for (uint32_t seed = 1; seed < (1u << 20); seed += 2) {
+        if (is_perfect(seed))
+            return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t SEED = find_seed();
+static_assert(SEED != 0, "no perfect hash seed for the keyword table");
+
+struct Slot {
+    char text[MAX_LENGTH];
+    uint8_t length;
+    TokenType type;
+};
+
+struct Table {
+    Slot slots[TABLE_SIZE];
+};
+
+constexpr Table build_table() {
+    Table table = {};
+    for (size_t i = 0; i < COUNT; ++i) {
+        size_t length = length_of(LIST[i].text);
+        Slot& slot = table.slots[slot_of(key_of(LIST[i].text, length), SEED)];
+        for (size_t j = 0; j < length; ++j)
+            slot.text[j] = LIST[i].text[j];
+        slot.length = (uint8_t) length;
+        slot.type = LIST[i].type;
+    }
+    return table;
+}
+
+constexpr Table TABLE = build_table();
+
+// Keyword kind for `word`, or Identifier. One multiply picks the only
+// candidate slot and a single compare confirms it.
+inline TokenType classify(const char* word, size_t length) {
+    if (length < MIN_LENGTH || length > MAX_LENGTH)
+        return TokenType::Identifier;
+    const Slot& slot = TABLE.slots[slot_of(key_of(word, length), SEED)];
+    if (slot.length != length || memcmp(slot.text, word, length) != 0)
+        return TokenType::Identifier;
+    return slot.type;
+}
+
+} // namespace keywords
+
+// JavaScript's punctuator set compiled into a DFA over the bytes that can
+// appear in one. The lexer walks it for as long as there is a transition
+// and emits the last accepting state, which gives maximal munch:
+// ">>>=" is one token, "..." is one token, ".." is two.
+namespace punctuators {
+
+struct Punctuator {
+    const char* text;
+    TokenType type;
+};
+
+constexpr Punctuator LIST[] = {
+    { "+", TokenType::Plus },
+    { "-", TokenType::Dash },
+    { "/", TokenType::Slash },
+    { "*", TokenType::Asterisk },
+    { "|", TokenType::Pipe },
+    { "^", TokenType::Carot },
+    { "&", TokenType::Ampersand },
+    { "%", TokenType::Percent },
+    { "!", TokenType::Exclamation },
+    { "?", TokenType::QuestionMark },
+    { "=", TokenType::Equal },
+    { ":", TokenType::Colon },
+    { ";", TokenType::Semicolon },
+    { ".", TokenType::Period },
+    { ",", TokenType::Comma },
+    { "#", TokenType::Hashtag },
+    { "(", TokenType::OpenParen },
+    { ")", TokenType::CloseParen },
+    { "{", TokenType::OpenBracket },
+    { "}", TokenType::CloseBracket },
+    { "[", TokenType::OpenSquareBracket },
+    { "]", TokenType::CloseSquareBracket },
+    { "<", TokenType::OpenAngleBracket },
+    { ">", TokenType::CloseAngleBracket },
+    { "~", TokenType::Tilde },
+    { "...", TokenType::Ellipsis },
+    { "==", TokenType::EqualEqual },
+    { "===", TokenType::EqualEqualEqual },
+    { "!=", TokenType::ExclamationEqual },
+    { "!==", TokenType::ExclamationEqualEqual },
+    { "<=", TokenType::LessEqual },
+    { ">=", TokenType::GreaterEqual },
+    { "<<", TokenType::ShiftLeft },
+    { ">>", TokenType::ShiftRight },
+    { ">>>", TokenType::UnsignedShiftRight },
+    { "++", TokenType::PlusPlus },
+    { "--", TokenType::DashDash },
+    { "**", TokenType::AsteriskAsterisk },
+    { "+=", TokenType::PlusEqual },
+    { "-=", TokenType::DashEqual },
+    { "*=", TokenType::AsteriskEqual },
+    { "/=", TokenType::SlashEqual },
+    { "%=", TokenType::PercentEqual },
+    { "**=", TokenType::AsteriskAsteriskEqual },
+    { "<<=", TokenType::ShiftLeftEqual },
+    { ">>=", TokenType::ShiftRightEqual },
+    { ">>>=", TokenType::UnsignedShiftRightEqual },
+    { "&=", TokenType::AmpersandEqual },
+    { "|=", TokenType::PipeEqual },
+    { "^=", TokenType::CarotEqual },
+    { "&&", TokenType::AmpersandAmpersand },
+    { "||", TokenType::PipePipe },
+    { "??", TokenType::QuestionQuestion },
+    { "&&=", TokenType::AmpersandAmpersandEqual },
+    { "||=", TokenType::PipePipeEqual },
+    { "?\?=", TokenType::QuestionQuestionEqual },
+    { "?.", TokenType::QuestionPeriod },
+    { "=>", TokenType::Arrow },
+};
+
+constexpr size_t COUNT = sizeof(LIST) / sizeof(LIST[0]);
+constexpr uint8_t NO_CHAR = 0xFF;
+constexpr uint8_t NO_STATE = 0;
+constexpr uint8_t ROOT = 1;
+constexpr size_t MAX_CHARS = 32;
+constexpr size_t MAX_STATES = 96;
+
+struct Dfa {
+    uint8_t char_index[256];
+    uint8_t transitions[MAX_STATES][MAX_CHARS];
+    bool accepting[MAX_STATES];
+    TokenType accepts[MAX_STATES];
+    // Set for bytes that start a punctuator but never continue into a
+    // longer one, so the lexer can emit them without entering the DFA.
+    bool single[256];
+    size_t char_count;
+    size_t state_count;
+};
+
+constexpr Dfa build_dfa() {
+    Dfa dfa = {};
+    for (int ch = 0; ch < 256; ++ch)
+        dfa.char_index[ch] = NO_CHAR;
+    dfa.state_count = ROOT + 1;
+
+    for (size_t i = 0; i < COUNT; ++i) {
+        uint8_t state = ROOT;
+        for (const char* p = LIST[i].text; *p != 0; ++p) {
+            unsigned char ch = (unsigned char) *p;
+            if (dfa.char_index[ch] == NO_CHAR)
+                dfa.char_index[ch] = (uint8_t) dfa.char_count++;
+            uint8_t& next = dfa.transitions[state][dfa.char_index[ch]];
+            if (next == NO_STATE)
+                next = (uint8_t) dfa.state_count++;
+            state = next;
+        }
+        dfa.accepting[state] = true;
+        dfa.accepts[state] = LIST[i].type;
+    }
+
+    for (int ch = 0; ch < 256; ++ch) {
+        if (dfa.char_index[ch] == NO_CHAR)
+            continue;
+        uint8_t state = dfa.transitions[ROOT][dfa.char_index[ch]];
+        bool leaf = true;
+        for (size_t c = 0; c < dfa.char_count; ++c)
+            leaf = leaf && dfa.transitions[state][c] == NO_STATE;
+        dfa.single[ch] = leaf;
+    }
+    return dfa;
+}
+
+constexpr Dfa DFA = build_dfa();
+static_assert(DFA.char_count <= MAX_CHARS && DFA.state_count <= MAX_STATES, "punctuator DFA tables too small");
+
+// Longest punctuator starting at p. The caller guarantees *p starts one;
+// the zero padding ends the walk at the end of the input.
+inline TokenType match(const char* p, size_t* length) {
+    uint8_t state = ROOT;
+    TokenType accepted = TokenType::Identifier;
+    size_t accepted_length = 0;
+    for (size_t i = 0;; ++i) {
+        uint8_t index = DFA.char_index[(unsigned char) p[i]];
+        if (index == NO_CHAR)
+            break;
+        state = DFA.transitions[state][index];
+        if (state == NO_STATE)
+            break;
+        if (DFA.accepting[state]) {
+            accepted = DFA.accepts[state];
+            accepted_length = i + 1;
+        }
+    }
+    // "a?.5:b" is a conditional, not optional chaining.
+    if (accepted == TokenType::QuestionPeriod && p[2] >= '0' && p[2] <= '9') {
+        accepted = TokenType::QuestionMark;
+        accepted_length = 1;
+    }
+    *length = accepted_length;
+    return accepted;
+}
+
+} // namespace punctuators
+
+namespace chars {
+
+// What the lexer does when a token starts with a given byte.
+enum CharClass : uint8_t {
+    Invalid,
+    Whitespace,
+    IdentifierStart,
+    Digit,
+    Quote,
+    Backtick,
+    Slash,
+    Punctuator,
+};
+
+enum CharFlags : uint8_t {
+    IDENTIFIER_PART = 1 << 0,
+    DIGIT = 1 << 1,
+};
+
+struct CharInfo {
+    CharClass cls;
+    TokenType token;
+    uint8_t flags;
+};
+
+struct Table {
+    CharInfo info[256];
+};
+
+constexpr Table build_table() {
+    Table table = {};
+    for (int ch = 0; ch < 256; ++ch)
+        table.info[ch] = CharInfo { Invalid, TokenType::Identifier, 0 };
+
+    for (char ch : { ' ', '\t', '\n', '\v', '\f', '\r' })
+        table.info[(unsigned char) ch].cls = Whitespace;
+    for (int ch = 'a'; ch <= 'z'; ++ch) {
+        table.info[ch] = CharInfo { IdentifierStart, TokenType::Identifier, IDENTIFIER_PART };
+        table.info[ch - 'a' + 'A'] = CharInfo { IdentifierStart, TokenType::Identifier, IDENTIFIER_PART };
+    }
+    table.info['_'] = CharInfo { IdentifierStart, TokenType::Identifier, IDENTIFIER_PART };
+    table.info['$'] = CharInfo { IdentifierStart, TokenType::Identifier, IDENTIFIER_PART };
+    for (int ch = '0'; ch <= '9'; ++ch)
+        table.info[ch] = CharInfo { Digit, TokenType::Number, IDENTIFIER_PART | DIGIT };
+    for (char ch : { '\'', '"' })
+        table.info[(unsigned char) ch] = CharInfo { Quote, TokenType::String, 0 };
+    table.info['`'] = CharInfo { Backtick, TokenType::Template, 0 };
+
+    for (const punctuators::Punctuator& punctuator : punctuators::LIST) {
+        if (punctuator.text[1] == 0)
+            table.info[(unsigned char) punctuator.text[0]] = CharInfo { Punctuator, punctuator.type, 0 };
+    }
+    table.info['/'] = CharInfo { Slash, TokenType::Slash, 0 };
+    return table;
+}
+
+constexpr Table TABLE = build_table();
+
+inline const CharInfo& info(char ch) {
+    return TABLE.info[(unsigned char) ch];
+}
+
+} // namespace chars
+
+class Lexer {
+public:
+    using TokenType = tokens::TokenType;
+
+    static const char* TokenTypeName(TokenType type) {
+        switch (type) {
+            case TokenType::Identifier: return "Identifier";
+            case TokenType::String: return "String";
+            case TokenType::Number: return "Number";
+            case TokenType::Regex: return "Regex";
+            case TokenType::Template: return "Template";
+            case TokenType::Plus: return "Plus";
+            case TokenType::Dash: return "Dash";
+            case TokenType::Slash: return "Slash";
+            case TokenType::Asterisk: return "Asterisk";
+            case TokenType::Pipe: return "Pipe";
+            case TokenType::Carot: return "Carot";
+            case TokenType::Ampersand: return "Ampersand";
+            case TokenType::Percent: return "Percent";
+            case TokenType::Exclamation: return "Exclamation";
+            case TokenType::QuestionMark: return "QuestionMark";
+            case TokenType::Equal: return "Equal";
+            case TokenType::Colon: return "Colon";
+            case TokenType::Semicolon: return "Semicolon";
+            case TokenType::Period: return "Period";
+            case TokenType::Comma: return "Comma";
+            case TokenType::Hashtag: return "Hashtag";
+            case TokenType::OpenParen: return "OpenParen";
+            case TokenType::CloseParen: return "CloseParen";
+            case TokenType::OpenBracket: return "OpenBracket";
+            case TokenType::CloseBracket: return "CloseBracket";
+            case TokenType::OpenSquareBracket: return "OpenSquareBracket";
+            case TokenType::CloseSquareBracket: return "CloseSquareBracket";
+            case TokenType::OpenAngleBracket: return "OpenAngleBracket";
+            case TokenType::CloseAngleBracket: return "CloseAngleBracket";            
+            case TokenType::Tilde: return "Tilde";
+            case TokenType::Ellipsis: return "Ellipsis";
+            case TokenType::EqualEqual: return "EqualEqual";
+            case TokenType::EqualEqualEqual: return "EqualEqualEqual";
+            case TokenType::ExclamationEqual: return "ExclamationEqual";
+            case TokenType::ExclamationEqualEqual: return "ExclamationEqualEqual";
+            case TokenType::LessEqual: return "LessEqual";
+            case TokenType::GreaterEqual: return "GreaterEqual";
+            case TokenType::ShiftLeft: return "ShiftLeft";
+            case TokenType::ShiftRight: return "ShiftRight";
+            case TokenType::UnsignedShiftRight: return "UnsignedShiftRight";
+            case TokenType::PlusPlus: return "PlusPlus";
+            case TokenType::DashDash: return "DashDash";
+            case TokenType::AsteriskAsterisk: return "AsteriskAsterisk";
+            case TokenType::PlusEqual: return "PlusEqual";
+            case TokenType::DashEqual: return "DashEqual";
+            case TokenType::AsteriskEqual: return "AsteriskEqual";
+            case TokenType::SlashEqual: return "SlashEqual";
+            case TokenType::PercentEqual: return "PercentEqual";
+            case TokenType::AsteriskAsteriskEqual: return "AsteriskAsteriskEqual";
+            case TokenType::ShiftLeftEqual: return "ShiftLeftEqual";
+            case TokenType::ShiftRightEqual: return "ShiftRightEqual";
+            case TokenType::UnsignedShiftRightEqual: return "UnsignedShiftRightEqual";
+            case TokenType::AmpersandEqual: return "AmpersandEqual";
+            case TokenType::PipeEqual: return "PipeEqual";
+            case TokenType::CarotEqual: return "CarotEqual";
+            case TokenType::AmpersandAmpersand: return "AmpersandAmpersand";
+            case TokenType::PipePipe: return "PipePipe";
+            case TokenType::QuestionQuestion: return "QuestionQuestion";
+            case TokenType::AmpersandAmpersandEqual: return "AmpersandAmpersandEqual";
+            case TokenType::PipePipeEqual: return "PipePipeEqual";
+            case TokenType::QuestionQuestionEqual: return "QuestionQuestionEqual";
+            case TokenType::QuestionPeriod: return "QuestionPeriod";
+            case TokenType::Arrow: return "Arrow";
+            case TokenType::KwThis: return "KwThis";
+            case TokenType::KwNew: return "KwNew";
+            case TokenType::KwAsync: return "KwAsync";
+            case TokenType::KwFunction: return "KwFunction";
+            case TokenType::KwReturn: return "KwReturn";
+            case TokenType::KwYield: return "KwYield";
+            case TokenType::KwContinue: return "KwContinue";
+            case TokenType::KwBreak: return "KwBreak";
+            case TokenType::KwLet: return "KwLet";
+            case TokenType::KwConst: return "KwConst";
+            case TokenType::KwVar: return "KwVar";
+            case TokenType::KwPrivate: return "KwPrivate";
+            case TokenType::KwPublic: return "KwPublic";
+            case TokenType::KwProtected: return "KwProtected";
+            case TokenType::KwInterface: return "KwInterface";
+            case TokenType::KwClass: return "KwClass";
+            case TokenType::KwEnum: return "KwEnum";
+            case TokenType::KwIf: return "KwIf";
+            case TokenType::KwWhile: return "KwWhile";
+            case TokenType::KwDo: return "KwDo";
+            case TokenType::KwElse: return "KwElse";
+            case TokenType::KwCatch: return "KwCatch";
+            case TokenType::KwDebugger: return "KwDebugger";
+            case TokenType::KwFor: return "KwFor";
+            case TokenType::KwTrue: return "KwTrue";
+            case TokenType::KwFalse: return "KwFalse";
+            case TokenType::KwNull: return "KwNull";
+            case TokenType::KwSwitch: return "KwSwitch";
+            case TokenType::KwCase: return "KwCase";
+            case TokenType::KwDefault: return "KwDefault";
+            case TokenType::KwTry: return "KwTry";
+            case TokenType::KwFinally: return "KwFinally";
+            case TokenType::KwThrow: return "KwThrow";
+            case TokenType::KwImport: return "KwImport";
+            case TokenType::KwExport: return "KwExport";
+            case TokenType::KwExtends: return "KwExtends";
+            case TokenType::KwSuper: return "KwSuper";
+            case TokenType::KwTypeof: return "KwTypeof";
+            case TokenType::KwInstanceof: return "KwInstanceof";
+            case TokenType::KwIn: return "KwIn";
+            case TokenType::KwDelete: return "KwDelete";
+            case TokenType::KwVoid: return "KwVoid";
+            case TokenType::KwWith: return "KwWith";
+            case TokenType::KwAwait: return "KwAwait";
+            case TokenType::KwStatic: return "KwStatic";
+            case TokenType::KwImplements: return "KwImplements";
+            case TokenType::KwPackage: return "KwPackage";
+            case TokenType::Error: return "Error";
+        }
+        assert(false && "unreachable");
+        return "?";
+    }
+
+    static bool isKeyword(TokenType type) {
+        return type >= TokenType::KwThis && type <= TokenType::KwPublic;
+    }
+
+    // Words such as `async` or `static` that are only keywords in some
+    // places; elsewhere they are names, and their tokens carry atoms.
+    static bool isContextual(TokenType type) {
+        return type >= TokenType::KwAsync && type <= TokenType::KwPublic;
+    }
+
+    // Tokens are views into the lexer's SourceBuffer, so lexing allocates
+    // nothing per token. The buffer must outlive every token taken from it.
+    class Token {
+    public:
+        Token(TokenType type, std::string_view slice, Location location)
+            : m_type(type),
+              m_slice(slice),
+              m_location(location) {}
+
+        TokenType getType() { return m_type; }
+
+        std::string_view getSlice() { return m_slice; }
+
+        // NUL-terminated heap copy of the slice for callers that need to
+        // keep it past the buffer. The caller frees it.
+        char* copySlice() { return strslice(m_slice.data(), 0, m_slice.size()); }
+        
+        Location getLocation() { return m_location; }
+
+    private:
+        TokenType m_type;
+        std::string_view m_slice;
+        Location m_location;
+    };
+
+    // Struct-of-arrays token storage: one byte of kind plus a 32-bit start
+    // offset, length and atom per token, thirteen bytes in total. Locations
+    // are built from the start offset and the stream's file id when asked
+    // for. Identifier and string tokens carry the atom of their spelling.
+    class TokenStream {
+    public:
+        TokenStream()
+            : m_file_id(0) {}
+
+        void clear() {
+            m_kinds.clear();
+            m_starts.clear();
+            m_lengths.clear();
+            m_atoms.clear();
+        }
+
+        void reset(uint32_t file_id, SourceBuffer source, std::shared_ptr<AtomTable> atom_table) {
+            clear();
+            m_file_id = file_id;
+            m_source = source;
+            m_atom_table = std::move(atom_table);
+        }
+
+        void push(TokenType type, uint32_t start, uint32_t length, Atom atom) {
+            m_kinds.push_back(type);
+            m_starts.push_back(start);
+            m_lengths.push_back(length);
+            m_atoms.push_back(atom);
+        }
+
+        // resize + set let several threads fill disjoint ranges.
+        void resize(size_t count) {
+            m_kinds.resize(count);
+            m_starts.resize(count);
+            m_lengths.resize(count);
+            m_atoms.resize(count);
+        }
+
+        void set(size_t index, TokenType type, uint32_t start, uint32_t length, Atom atom) {
+            m_kinds[index] = (uint8_t) type;
+            m_starts[index] = start;
+            m_lengths[index] = length;
+            m_atoms[index] = atom;
+        }
+
+        // Replaces tokens [first, last) with `tokens`, lexed from edited
+        // source that this stream then refers to, and moves every later
+        // token by `delta` bytes.
+        void splice(size_t first, size_t last, const TokenStream& tokens, int64_t delta) {
+            // Typing inside a token usually swaps one token for one, so
+            // overwrite in place when the count is unchanged.
+            auto replace = [&](auto& column, const auto& with) {
+                if (with.size() == last - first) {
+                    std::copy(with.begin(), with.end(), column.begin() + first);
+                    return;
+                }
+                column.erase(column.begin() + first, column.begin() + last);
+                column.insert(column.begin() + first, with.begin(), with.end());
+            };
+            replace(m_kinds, tokens.m_kinds);
+            replace(m_starts, tokens.m_starts);
+            replace(m_lengths, tokens.m_lengths);
+            replace(m_atoms, tokens.m_atoms);
+            for (size_t i = first + tokens.size(); i < m_starts.size(); ++i)
+                m_starts[i] = (uint32_t) (m_starts[i] + delta);
+            m_source = tokens.m_source;
+        }
+
+        size_t size() const { return m_kinds.size(); }
+
+        bool empty() const { return m_kinds.empty(); }
+
+        TokenType getType(size_t index) const { return (TokenType) m_kinds[index]; }
+
+        uint32_t getStart(size_t index) const { return m_starts[index]; }
+
+        uint32_t getLength(size_t index) const { return m_lengths[index]; }
+
+        uint32_t getEnd(size_t index) const { return m_starts[index] + m_lengths[index]; }
+
+        Atom getAtom(size_t index) const { return m_atoms[index]; }
+
+        AtomTable* getAtomTable() const { return m_atom_table.get(); }
+
+        const std::shared_ptr<AtomTable>& shareAtomTable() const { return m_atom_table; }
+
+        uint32_t getFileId() const { return m_file_id; }
+
+        std::string_view getSlice(size_t index) const {
+            return std::string_view(m_source.getData() + m_starts[index], m_lengths[index]);
+        }
+
+        // Past-the-end indices resolve to the end of the input so callers
+        // can report "unexpected EOF" without special casing.
+        Location getLocation(size_t index) const {
+            uint32_t offset = index < size() ? m_starts[index] : (uint32_t) m_source.getLength();
+            return Location(m_file_id, offset);
+        }
+
+        Token at(size_t index) const {
+            return Token(getType(index), getSlice(index), getLocation(index));
+        }
+
+        const SourceBuffer& getSource() const { return m_source; }
+
+        size_t memoryUsage() const {
+            return m_kinds.capacity() * sizeof(uint8_t) + 
+                   m_starts.capacity() * sizeof(uint32_t) + 
+                   m_lengths.capacity() * sizeof(uint32_t) + 
+                   m_atoms.capacity() * sizeof(Atom);
+        }
+
+    private:
+        uint32_t m_file_id;
+        SourceBuffer m_source;
+        std::vector<uint8_t> m_kinds;
+        std::vector<uint32_t> m_starts;
+        std::vector<uint32_t> m_lengths;
+        std::vector<Atom> m_atoms;
+        std::shared_ptr<AtomTable> m_atom_table;
+    };
+
+    // Atoms go into `atoms` when given (e.g. a table shared across files),
+    // otherwise into a new table. Token streams and trees keep a share of
+    // it, so names stay readable after the lexer is gone.
+    Lexer(const SourceFile* file, std::shared_ptr<AtomTable> atoms = nullptr)
+        : m_shared_atoms(atoms ? std::move(atoms) : std::make_shared<AtomTable>()),
+          m_file(file),
+          m_atoms(m_shared_atoms.get()),
+          m_source(file->getBuffer()),
+          m_input(m_source.getData()),
+          m_length(m_source.getLength()),
+          m_cursor(0),
+          m_failed(false),
+          m_diagnostics(nullptr),
+          m_regex(RegexState::Allowed),
+          m_intern(true),
+          m_recover(true),
+          m_scan(scan::kernels()) {}
+
+    // Registers the source itself; Locations from this lexer are only
+    // resolvable while it is alive.
+    Lexer(const char* file_path, SourceBuffer source)
+        : m_owned_file(new SourceFile(file_path, source)),
+          m_shared_atoms(std::make_shared<AtomTable>()),
+          m_file(m_owned_file.get()),
+          m_atoms(m_shared_atoms.get()),
+          m_source(source),
+          m_input(m_source.getData()),
+          m_length(m_source.getLength()),
+          m_cursor(0),
+          m_failed(false),
+          m_diagnostics(nullptr),
+          m_regex(RegexState::Allowed),
+          m_intern(true),
+          m_recover(true),
+          m_scan(scan::kernels()) {}
+
+    Lexer(const char* file_path, const char* input)
+        : Lexer(file_path, SourceBuffer(input)) {}
+
+    void report(DiagnosticCode code, std::string_view message, size_t start, size_t end) {
+        JS_STAT(if (m_stats != nullptr) ++m_stats->diagnostics;)
+        report_diagnostic(m_diagnostics, code, Severity::Error, m_file->getId(), start, end, message);
+    }
+
+    bool is_eof() {
+        return m_cursor >= m_length;
+    }
+
+    // Both read into the zero padding at EOF instead of bounds checking.
+    char current() {
+        return m_input[m_cursor];
+    }
+
+    char peek() {
+        return m_input[m_cursor + 1];
+    }
+
+    Location getLocation() {
+        return Location(m_file->getId(), (uint32_t) m_cursor);
+    }
+
+    std::string_view slice(size_t start, size_t end) {
+        return std::string_view(m_input + start, end - start);
+    }
+
+    char consume() {
+        if (is_eof())
+            return '\0';
+        return m_input[m_cursor++];
+    }
+
+    bool consume_expect(const char* word) {
+        if (is_eof() || word == nullptr)
+            return false;
+        size_t length = strlen(word);
+        bool same = m_length - m_cursor >= length && memcmp(m_input + m_cursor, word, length) == 0;
+        if (same) 
+            m_cursor += length;
+        return same;
+    }
+
+    bool consume_expect(char ch) {
+        if (is_eof() || ch == 0)
+            return false;
+        bool same = current() == ch;
+        if (same) 
+            consume();
+        return same;
+    }
+
+    template <typename Condition>
+    void consume_while(Condition condition) {
+        while (!is_eof() && condition(current()))
+            consume();
+    }
+
+    void trim_left() {
+        m_cursor = m_scan.skip_whitespace(m_input + m_cursor) - m_input;
+    }
+
+    // One token as produced by `next`: kind, span and, for identifiers and
+    // strings, the atom of the spelling.
+    struct RawToken {
+        TokenType type;
+        uint32_t start;
+        uint32_t length;
+        Atom atom;
+    };
+
+    // Two-phase API: lexes the whole input into `tokens`. Returns false
+    // after an error, but `tokens` still covers the whole input, with an
+    // Error token for each part that did not lex, so the parser can report
+    // what else is wrong in the same pass.
+    bool parse(TokenStream* tokens) {
+        JS_STAT(PhaseTimer timer(m_stats, &ParseStats::lex_ns);)
+        lex_all(tokens);
+        return !m_failed;
+    }
+
+    // Lexes the whole input on up to `threads` threads into the same tokens
+    // and atoms `parse` produces. The input is cut into chunks and each is
+    // lexed speculatively from its first byte, as if a token started there
+    // with a regex allowed. Between tokens the lexer state is only (offset,
+    // RegexState), so once a chunk emits a token exactly where the
+    // previous chunk's true stream crosses into it, in the same regex
+    // state, the rest of the chunk is right. Chunks are checked in order;
+    // one that started inside a string, comment, template or regex is
+    // lexed again from the true crossing point until it lines up.
+    bool parse_parallel(TokenStream* tokens, unsigned threads) {
+        static constexpr size_t MIN_CHUNK = 1 << 20;
+        size_t count = std::min<size_t>(threads, m_length / MIN_CHUNK);
+        if (count < 2 || m_length > UINT32_MAX)
+            return parse(tokens);
+
+        JS_STAT(PhaseTimer timer(m_stats, &ParseStats::lex_ns);)
+        std::vector<Chunk> chunks(count);
+        for (size_t i = 0; i + 1 < count; ++i)
+            chunks[i].end = chunk_boundary(m_length * (i + 1) / count);
+        chunks[count - 1].end = m_length;
+        parallel_for(count, [&](size_t i) {
+            JS_STAT(if (i > 0) Tracer::name_thread(std::format("lexer {}", i));)
+            JS_STAT(TraceSpan span("lex chunk");)
+            Chunk& chunk = chunks[i];
+            chunk.lexer = std::make_unique<Lexer>(m_file);
+            chunk.lexer->setDiagnostics(&chunk.diagnostics);
+            chunk.lexer->m_recover = false;
+            speculate(&chunk, i > 0 ? chunks[i - 1].end : 0);
+        });
+
+        size_t used = 0, total = 0;
+        for (; used < count; ++used) {
+            Chunk& chunk = chunks[used];
+            if (used > 0) {
+                Chunk& previous = chunks[used - 1];
+                if (!previous.has_handoff)
+                    break;
+                verify(&chunk, previous.handoff.start, previous.handoff_regex);
+            }
+            resolve_atoms(&chunk);
+            chunk.offset = total;
+            total += chunk.relexed.size() + chunk.tokens.size() - chunk.first;
+            // The crossing point was verified, so this error is real. Chunks
+            // stop at their first error; lexing on past it, and past any
+            // more, is left to one serial pass. The atoms interned so far
+            // were interned in serial order, so they keep their values.
+            if (chunk.failed) {
+                lex_all(tokens);
+                return false;
+            }
+        }
+
+        tokens->reset(m_file->getId(), m_source, m_shared_atoms);
+        tokens->resize(total);
+        parallel_for(used, [&](size_t i) {
+            Chunk& chunk = chunks[i];
+            size_t index = chunk.offset;
+            for (const RawToken& token : chunk.relexed)
+                tokens->set(index++, token.type, token.start, token.length, token.atom);
+            for (size_t j = chunk.first; j < chunk.tokens.size(); ++j) {
+                const RawToken& token = chunk.tokens[j];
+                Atom atom = token.atom;
+                if (j >= chunk.remap_from && atom != AtomTable::NONE)
+                    atom = chunk.atoms[AtomTable::ordinal(atom)];
+                tokens->set(index++, token.type, token.start, token.length, atom);
+            }
+        });
+        JS_STAT(if (m_stats != nullptr) m_stats->tokens += tokens->size();)
+        return !m_failed;
+    }
+
+    // Streaming API: lexes the next token into `out`. Returns false at the
+    // end of the input. After an error, reported once, the text up to the
+    // end of its line comes back as an Error token and lexing goes on from
+    // there; `hasFailed` tells whether that happened.
+    bool next(RawToken* out) {
+        if (m_failed && !m_recover)
+            return false;
+        if (m_length > UINT32_MAX) {
+            if (!m_failed)
+                report(DiagnosticCode::InputTooLarge, "input larger than 4 GiB is not supported", 0, 0);
+            m_failed = true;
+            return false;
+        }
+        return lex(out);
+    }
+
+    bool hasFailed() { return m_failed; }
+
+    // Collects reports into `sink` instead of printing them.
+    void setDiagnostics(DiagnosticSink* sink) { m_diagnostics = sink; }
+
+    DiagnosticSink* getDiagnostics() { return m_diagnostics; }
+
+    // Adds lexing time, tokens and diagnostics to `stats`. Without stats
+    // compiled in this does nothing.
+    void setStats(ParseStats* stats) {
+        JS_STAT(m_stats = stats;)
+        (void) stats;
+    }
+
+    ParseStats* getStats() {
+        JS_STAT(return m_stats;)
+        return nullptr;
+    }
+
+    // What a `/` at a token boundary means, which is all the state the
+    // lexer carries from one token to the next: a regex may start there, it
+    // divides, or it follows a `.` or `?.`, which makes the next word a
+    // property name even when it is a keyword.
+    enum class RegexState : uint8_t {
+        Allowed,
+        Divide,
+        AfterDot,
+    };
+
+    // Restarts lexing at `offset`, which must be a token boundary; whether
+    // a `/` there starts a regex depends on the tokens before it (see
+    // regex_state_at).
+    void seek(size_t offset, RegexState regex = RegexState::Allowed) {
+        m_cursor = offset;
+        m_regex = regex;
+    }
+
+    RegexState getRegexState() { return m_regex; }
+
+    // A `/` starts a regular expression unless the previous token ended an
+    // operand, in which case it divides. A `}` or `)` always counts as
+    // ending one: telling a block's `}` from an object literal's, or the `)`
+    // of `if (x)` from that of `(x)`, would take the parser's context, and
+    // the state between tokens has to stay this small for parallel and
+    // incremental lexing. So a regex that starts a statement right after
+    // either, as in `}\n/re/.test(x)` or `if (x) /re/.test(y)`, lexes as
+    // division; the parser reports it (see parse_statement).
+    static bool regex_may_follow(TokenType type) {
+        switch (type) {
+            case TokenType::Identifier:
+            case TokenType::String:
+            case TokenType::Number:
+            case TokenType::Regex:
+            case TokenType::Template:
+            case TokenType::CloseParen:
+            case TokenType::CloseSquareBracket:
+            case TokenType::CloseBracket:
+            case TokenType::PlusPlus:
+            case TokenType::DashDash:
+            case TokenType::KwThis:
+            case TokenType::KwSuper:
+            case TokenType::KwTrue:
+            case TokenType::KwFalse:
+            case TokenType::KwNull:
+                return false;
+            // Names, unless `await` or `yield` is an operator here, which
+            // the lexer cannot tell; a regex after those is the likelier.
+            case TokenType::KwAwait:
+            case TokenType::KwYield:
+                return true;
+            default:
+                return !isContextual(type);
+        }
+    }
+
+    // The state after `type`, given the state before it. A keyword right
+    // after `.` or `?.` is a property name, as in `e.default / 2`, so it
+    // ends an operand like an identifier does.
+    static RegexState regex_state_after(RegexState state, TokenType type) {
+        if (type == TokenType::Period || type == TokenType::QuestionPeriod)
+            return RegexState::AfterDot;
+        if (state == RegexState::AfterDot && (type == TokenType::Identifier || isKeyword(type)))
+            return RegexState::Divide;
+        return regex_may_follow(type) ? RegexState::Allowed : RegexState::Divide;
+    }
+
+    // The state before token `index` of a stream, which only depends on
+    // the two tokens before it; `type_at(i)` reads the stream.
+    template <typename TypeAt>
+    static RegexState regex_state_at(size_t index, TypeAt&& type_at) {
+        if (index == 0)
+            return RegexState::Allowed;
+        TokenType before = index >= 2 ? type_at(index - 2) : TokenType::Semicolon;
+        RegexState state = before == TokenType::Period || before == TokenType::QuestionPeriod ? RegexState::AfterDot : RegexState::Allowed;
+        return regex_state_after(state, type_at(index - 1));
+    }
+
+    const SourceFile* getFile() { return m_file; }
+
+    AtomTable* getAtomTable() { return m_atoms; }
+
+    const std::shared_ptr<AtomTable>& shareAtomTable() { return m_shared_atoms; }
+
+    const SourceBuffer& getSource() { return m_source; }
+
+private:
+    // Speculative chunks usually line up within a few tokens, so they only
+    // start interning after this many; the merge interns the ones before
+    // it itself, which keeps atom values in serial order.
+    static constexpr size_t SYNC_WINDOW = 256;
+
+    // One slice of a parallel lex. `tokens` are the speculative tokens
+    // starting before `end`, valid from `first` on; `relexed` are the true
+    // tokens before that when the guess was wrong. `handoff` is the first
+    // token at or past `end`, which the next chunk has to agree on. Atoms
+    // in `tokens` come from the chunk lexer's private table until
+    // resolve_atoms maps them (`atoms`, from `remap_from` on).
+    struct Chunk {
+        size_t end = 0;
+        std::unique_ptr<Lexer> lexer;
+        DiagnosticSink diagnostics;
+        std::vector<RawToken> tokens;
+        std::vector<RawToken> relexed;
+        RawToken handoff {};
+        RegexState handoff_regex = RegexState::Allowed;
+        bool has_handoff = false;
+        bool failed = false;
+        size_t first = 0;
+        size_t remap_from = 0;
+        size_t offset = 0;
+        std::vector<Atom> atoms;
+    };
+
+    // Chunks start after a newline when there is one close by: strings,
+    // regexes and line comments cannot span lines, so there the guess is
+    // usually right.
+    size_t chunk_boundary(size_t offset) {
+        size_t window = std::min<size_t>(64 << 10, m_length - offset);
+        const char* newline = (const char*) memchr(m_input + offset, '\n', window);
+        return newline ? newline + 1 - m_input : offset;
+    }
+
+    static void speculate(Chunk* chunk, size_t begin) {
+        Lexer* lexer = chunk->lexer.get();
+        lexer->m_cursor = begin;
+        lexer->m_intern = false;
+        RawToken token;
+        for (;;) {
+            RegexState regex = lexer->m_regex;
+            if (!lexer->next(&token))
+                break;
+            if (token.start >= chunk->end) {
+                chunk->handoff = token;
+                chunk->handoff_regex = regex;
+                chunk->has_handoff = true;
+                break;
+            }
+            chunk->tokens.push_back(token);
+            if (chunk->tokens.size() == SYNC_WINDOW)
+                lexer->m_intern = true;
+        }
+        chunk->failed = lexer->m_failed;
+    }
+
+    static RegexState regex_before(const Chunk& chunk, size_t index) {
+        return regex_state_at(index, [&](size_t i) { return chunk.tokens[i].type; });
+    }
+
+    // Lines the chunk up with the true stream, which enters it at `start`
+    // in the given regex state. When no speculative token matches there,
+    // lexes from `start` until one does or the chunk ends.
+    static void verify(Chunk* chunk, uint32_t start, RegexState regex) {
+        auto it = std::lower_bound(chunk->tokens.begin(), chunk->tokens.end(), start,
+                                   [](const RawToken& token, uint32_t offset) { return token.start < offset; });
+        size_t index = it - chunk->tokens.begin();
+        if (it != chunk->tokens.end() && it->start == start && regex_before(*chunk, index) == regex) {
+            chunk->first = index;
+            return;
+        }
+
+        Lexer* lexer = chunk->lexer.get();
+        DiagnosticSink speculative;
+        std::swap(speculative, chunk->diagnostics);
+        lexer->m_cursor = start;
+        lexer->m_regex = regex;
+        lexer->m_failed = false;
+        lexer->m_intern = false;
+        RawToken token;
+        for (;;) {
+            RegexState before = lexer->m_regex;
+            bool more = lexer->next(&token);
+            if (!more || token.start >= chunk->end) {
+                chunk->has_handoff = more;
+                chunk->handoff = token;
+                chunk->handoff_regex = before;
+                chunk->failed = lexer->m_failed;
+                chunk->first = chunk->tokens.size();
+                return;
+            }
+            while (index < chunk->tokens.size() && chunk->tokens[index].start < token.start)
+                ++index;
+            if (index < chunk->tokens.size() && chunk->tokens[index].start == token.start && regex_before(*chunk, index) == before) {
+                chunk->first = index;
+                chunk->diagnostics = std::move(speculative);
+                return;
+            }
+            chunk->relexed.push_back(token);
+        }
+    }
+
+    static bool has_atom(TokenType type) {
+        return type == TokenType::Identifier || type == TokenType::String || isContextual(type);
+    }
+
+    // Interns the chunk's spellings into the shared table in order of first
+    // use. Local atoms are numbered in order of first use too, so when the
+    // chunk lined up inside the window it is enough to intern the window
+    // tokens and then each local atom once. Otherwise the tokens are walked.
+    void resolve_atoms(Chunk* chunk) {
+        for (RawToken& token : chunk->relexed) {
+            if (has_atom(token.type))
+                token.atom = m_atoms->intern(slice(token.start, token.start + token.length));
+        }
+        AtomTable* local = chunk->lexer->m_atoms;
+        chunk->atoms.assign(local->size() + 1, AtomTable::NONE);
+        size_t window = std::min(chunk->tokens.size(), SYNC_WINDOW);
+        size_t end = chunk->first <= window ? window : chunk->tokens.size();
+        for (size_t i = chunk->first; i < end; ++i) {
+            RawToken& token = chunk->tokens[i];
+            if (!has_atom(token.type))
+                continue;
+            if (token.atom == AtomTable::NONE) {
+                token.atom = m_atoms->intern(slice(token.start, token.start + token.length));
+                continue;
+            }
+            Atom& shared = chunk->atoms[AtomTable::ordinal(token.atom)];
+            if (shared == AtomTable::NONE)
+                shared = m_atoms->intern(local->getText(token.atom));
+            token.atom = shared;
+        }
+        chunk->remap_from = end;
+        if (end == chunk->tokens.size())
+            return;
+        for (size_t ordinal = 1; ordinal < chunk->atoms.size(); ++ordinal)
+            chunk->atoms[ordinal] = m_atoms->intern(local->getText(AtomTable::from_ordinal(ordinal)));
+    }
+
+    bool token(RawToken* out, TokenType type, size_t start, Atom atom = AtomTable::NONE) {
+        *out = RawToken { type, (uint32_t) start, (uint32_t) (m_cursor - start), atom };
+        m_regex = regex_state_after(m_regex, type);
+        return true;
+    }
+
+    void lex_all(TokenStream* tokens) {
+        tokens->reset(m_file->getId(), m_source, m_shared_atoms);
+        RawToken token;
+        while (next(&token))
+            tokens->push(token.type, token.start, token.length, token.atom);
+        JS_STAT(if (m_stats != nullptr) m_stats->tokens += tokens->size();)
+    }
+
+    // Reports [start, cursor) and, when recovering, turns [start, end of
+    // its line) into an Error token; templates and block comments that do
+    // not end run to the end of the input, so theirs does too.
+    bool fail(RawToken* out, DiagnosticCode code, std::string_view message, size_t start, bool to_end = false) {
+        report(code, message, start, std::max(m_cursor, start + 1));
+        m_failed = true;
+        if (!m_recover)
+            return false;
+        const char* newline = to_end ? nullptr : (const char*) memchr(m_input + start, '\n', m_length - start);
+        m_cursor = newline ? newline - m_input : m_length;
+        return token(out, TokenType::Error, start);
+    }
+
+    // `/body/flags`; a `/` inside a class does not end the body.
+    bool lex_regex(RawToken* out, size_t start) {
+        const char* p = m_input + m_cursor + 1;
+        const char* end = m_input + m_length;
+        bool in_class = false;
+        for (; p < end && *p != '\n'; ++p) {
+            if (*p == '\\')
+                ++p;
+            else if (*p == '[')
+                in_class = true;
+            else if (*p == ']')
+                in_class = false;
+            else if (*p == '/' && !in_class)
+                break;
+        }
+        if (p >= end || *p != '/')
+            return fail(out, DiagnosticCode::UnterminatedRegex, "unterminated regular expression", start);
+        m_cursor = p + 1 - m_input;
+        consume_while([](char ch) { return (chars::info(ch).flags & chars::IDENTIFIER_PART) != 0; });
+        return token(out, TokenType::Regex, start);
+    }
+
+    // A whole template literal is one token. Substitutions are skipped by
+    // tracking, per open `${`, how many braces are open inside it; nested
+    // templates push another level.
+    bool lex_template(RawToken* out, size_t start) {
+        static constexpr uint32_t TEXT = UINT32_MAX;
+        const char* p = m_input + m_cursor + 1;
+        const char* end = m_input + m_length;
+        m_template_stack.assign(1, TEXT);
+        while (!m_template_stack.empty()) {
+            if (p >= end)
+                return fail(out, DiagnosticCode::UnterminatedTemplate, "unterminated template literal", start, true);
+            uint32_t& top = m_template_stack.back();
+            char ch = *p++;
+            if (top == TEXT) {
+                if (ch == '\\')
+                    ++p;
+                else if (ch == '`')
+                    m_template_stack.pop_back();
+                else if (ch == '$' && *p == '{') {
+                    ++p;
+                    m_template_stack.push_back(0);
+                }
+            } else if (ch == '{') {
+                ++top;
+            } else if (ch == '}') {
+                if (top-- == 0)
+                    m_template_stack.pop_back();
+            } else if (ch == '`') {
+                m_template_stack.push_back(TEXT);
+            } else if (ch == '\'' || ch == '"') {
+                while (p < end && *p != ch && *p != '\n')
+                    p += *p == '\\' ? 2 : 1;
+                ++p;
+            }
+        }
+        m_cursor = p - m_input;
+        return token(out, TokenType::Template, start);
+    }
+
+    bool token_atom(RawToken* out, TokenType type, size_t start) {
+        return token(out, type, start, m_intern ? m_atoms->intern(slice(start, m_cursor)) : AtomTable::NONE);
+    }
+
+    // Skips whitespace and comments, then lexes one token. Returns false at
+    // the end of the input or after reporting an error.
+    bool lex(RawToken* out) {
+        while (!is_eof()) {
+            char ch = current();
+            const chars::CharInfo& info = chars::info(ch);
+            size_t start = m_cursor;
+
+            switch (info.cls) {
+                case chars::Whitespace:
+                    trim_left();
+                    continue;
+
+                case chars::IdentifierStart: {
+                    m_cursor = m_scan.skip_identifier(m_input + m_cursor) - m_input;
+                    TokenType type = keywords::classify(m_input + start, m_cursor - start);
+                    if (type == TokenType::Identifier || isContextual(type))
+                        return token_atom(out, type, start);
+                    return token(out, type, start);
+                }
+
+                case chars::Digit:
+                    consume_while([](char ch) { return (chars::info(ch).flags & chars::DIGIT) != 0; });
+                    return token(out, TokenType::Number, start);
+
+                case chars::Quote: {
+                    char quote = consume();
+                    const char* end = m_input + m_length;
+                    const char* p = m_input + m_cursor;
+                    // Only an escaped line break, `\r\n` included, may
+                    // continue a string on the next line.
+                    for (;;) {
+                        p = m_scan.find_string_special(p, quote);
+                        if (p >= end || *p == quote || *p == '\n' || *p == '\r')
+                            break;
+                        if (*p != '\\')
+                            p += 1;
+                        else
+                            p += p[1] == '\r' && p[2] == '\n' ? 3 : 2;
+                    }
+                    m_cursor = p < end ? p - m_input : m_length;
+
+                    // expecting closing quote, before the end of the line
+                    if (m_cursor >= m_length || *p != quote)
+                        return fail(out, DiagnosticCode::UnterminatedString, "expected closing quote on string", start);
+                    consume();
+
+                    return token_atom(out, TokenType::String, start);
+                }
+
+                case chars::Backtick:
+                    return lex_template(out, start);
+
+                case chars::Slash:
+                    // Comments
+                    if (peek() == '/') {
+                        const char* end = m_input + m_length;
+                        const char* p = m_scan.find_line_end(m_input + m_cursor + 2);
+                        while (*p == 0 && p < end)
+                            p = m_scan.find_line_end(p + 1);
+                        m_cursor = p - m_input;
+                        continue;
+                    }
+                    if (peek() == '*') {
+                        const char* end = m_input + m_length;
+                        const char* p = m_input + m_cursor + 2;
+                        while ((p = (const char*) memchr(p, '*', end - p)) != nullptr && p[1] != '/')
+                            ++p;
+                        if (p == nullptr)
+                            return fail(out, DiagnosticCode::UnterminatedComment, "unterminated block comment", start, true);
+                        m_cursor = p + 2 - m_input;
+                        continue;
+                    }
+                    if (m_regex != RegexState::Divide)
+                        return lex_regex(out, start);
+                    [[fallthrough]];
+
+                case chars::Punctuator: {
+                    if (punctuators::DFA.single[(unsigned char) ch] || 
+                        punctuators::DFA.char_index[(unsigned char) peek()] == punctuators::NO_CHAR) {
+                        consume();
+                        return token(out, info.token, start);
+                    }
+                    size_t length;
+                    TokenType type = punctuators::match(m_input + m_cursor, &length);
+                    m_cursor += length;
+                    return token(out, type, start);
+                }
+
+                case chars::Invalid:
+                    break;
+            }
+
+            return fail(out, DiagnosticCode::UnexpectedCharacter,
+                        std::format("Unexpected char whilst lexing... ('{}', {})", ch, (int) (unsigned char) ch), start);
+        }
+
+        return false;
+    }
+
+    std::unique_ptr<SourceFile> m_owned_file;
+    std::shared_ptr<AtomTable> m_shared_atoms;
+    const SourceFile* m_file;
+    AtomTable* m_atoms;
+    SourceBuffer m_source;
+    const char* m_input;
+    size_t m_length;
+
+    size_t m_cursor;
+    bool m_failed;
+    DiagnosticSink* m_diagnostics;
+    JS_STAT(ParseStats* m_stats = nullptr;)
+    RegexState m_regex;
+    bool m_intern;
+    bool m_recover;
+    std::vector<uint32_t> m_template_stack;
+    const scan::Kernels& m_scan;
+};
+
+// Every node records what it is in a one-byte tag, so walks dispatch with
+// a switch (see AstVisitor) instead of virtual calls or name compares.
+enum class NodeKind : uint8_t {
+    Identifier,
+    Literal,
+    ArrayExpression,
+    UnaryExpression,
+    UpdateExpression,
+    BinaryExpression,
+    LogicalExpression,
+    AssignmentExpression,
+    ConditionalExpression,
+    MemberExpression,
+    CallExpression,
+    FunctionExpression,
+    SequenceExpression,
+
+    EmptyStatement,
+    DebuggerStatement,
+    IfStatement,
+    WhileStatement,
+    ExpressionStatement,
+    BlockStatement,
+    FunctionDeclarationStatement,
+    ReturnStatement,
+};
+
+constexpr size_t NODE_KIND_COUNT = (size_t) NodeKind::ReturnStatement + 1;
+
+const char* NodeKindName(NodeKind kind) {
+    switch (kind) {
+        case NodeKind::Identifier: return "Identifier";
+        case NodeKind::Literal: return "Literal";
+        case NodeKind::ArrayExpression: return "ArrayExpression";
+        case NodeKind::UnaryExpression: return "UnaryExpression";
+        case NodeKind::UpdateExpression: return "UpdateExpression";
+        case NodeKind::BinaryExpression: return "BinaryExpression";
+        case NodeKind::LogicalExpression: return "LogicalExpression";
+        case NodeKind::AssignmentExpression: return "AssignmentExpression";
+        case NodeKind::ConditionalExpression: return "ConditionalExpression";
+        case NodeKind::MemberExpression: return "MemberExpression";
+        case NodeKind::CallExpression: return "CallExpression";
+        case NodeKind::FunctionExpression: return "FunctionExpression";
+        case NodeKind::SequenceExpression: return "SequenceExpression";
+        case NodeKind::EmptyStatement: return "EmptyStatement";
+        case NodeKind::DebuggerStatement: return "DebuggerStatement";
+        case NodeKind::IfStatement: return "IfStatement";
+        case NodeKind::WhileStatement: return "WhileStatement";
+        case NodeKind::ExpressionStatement: return "ExpressionStatement";
+        case NodeKind::BlockStatement: return "BlockStatement";
+        case NodeKind::FunctionDeclarationStatement: return "FunctionDeclarationStatement";
+        case NodeKind::ReturnStatement: return "ReturnStatement";
+    }
+    assert(false && "unreachable");
+    return "?";
+}
+
+class Node {
+public:
+    Node(NodeKind kind, Location location)
+        : m_kind(kind),
+          m_location(location) {}
+
+    NodeKind getKind() { return m_kind; }
+
+    const char* getClassName() { return NodeKindName(m_kind); }
+
+    Location getLocation() { return m_location; }
+
+    void setLocation(Location location) { m_location = location; }
+
+private:
+    NodeKind m_kind;
+    Location m_location;
+};
+
+// Expressions
+class Expression : public Node {
+public:
+    Expression(NodeKind kind, Location location)
+        : Node(kind, location) {}
+};
+
+class Identifier : public Expression {
+public:
+    Identifier(Atom name, Location location)
+        : Expression(NodeKind::Identifier, location),
+          m_name(name) {}
+
+    Atom getName() { return m_name; }
+
+private:
+    Atom m_name;
+};
+
+class Literal : public Expression {
+public:
+    // String literals also carry the atom of their spelling.
+    Literal(std::string_view value, Atom atom, Location location)
+        : Expression(NodeKind::Literal, location),
+          m_value(value),
+          m_atom(atom) {}
+
+    std::string_view getValue() { return m_value; }
+
+    // The value is a view into the source; edits move it (see AstRebaser).
+    void setValue(std::string_view value) { m_value = value; }
+
+    Atom getAtom() { return m_atom; }
+
+private:
+    std::string_view m_value;
+    Atom m_atom;
+};
+
+class ArrayExpression : public Expression {
+public:
+    // `elements` is an arena array of `count` expressions.
+    ArrayExpression(Expression** elements, size_t count, Location location)
+        : Expression(NodeKind::ArrayExpression, location),
+          m_elements(elements),
+          m_count(count) {}
+
+    size_t getCount() { return m_count; }
+
+    Expression* getElement(size_t index) { return m_elements[index]; }
+
+private:
+    Expression** m_elements;
+    size_t m_count;
+};
+
+// Operators are kept as the token type that spelled them.
+class UnaryExpression : public Expression {
+public:
+    UnaryExpression(TokenType op, Expression* argument, Location location)
+        : Expression(NodeKind::UnaryExpression, location),
+          m_operator(op),
+          m_argument(argument) {}
+
+    TokenType getOperator() { return m_operator; }
+
+    Expression* getArgument() { return m_argument; }
+
+private:
+    TokenType m_operator;
+    Expression* m_argument;
+};
+
+class UpdateExpression : public Expression {
+public:
+    UpdateExpression(TokenType op, bool prefix, Expression* argument, Location location)
+        : Expression(NodeKind::UpdateExpression, location),
+          m_operator(op),
+          m_prefix(prefix),
+          m_argument(argument) {}
+
+    TokenType getOperator() { return m_operator; }
+
+    bool isPrefix() { return m_prefix; }
+
+    Expression* getArgument() { return m_argument; }
+
+private:
+    TokenType m_operator;
+    bool m_prefix;
+    Expression* m_argument;
+};
+
+// Shared shape of binary, logical and assignment expressions.
+class OperatorExpression : public Expression {
+public:
+    OperatorExpression(NodeKind kind, TokenType op, Expression* left, Expression* right, Location location)
+        : Expression(kind, location),
+          m_operator(op),
+          m_left(left),
+          m_right(right) {}
+
+    TokenType getOperator() { return m_operator; }
+
+    Expression* getLeft() { return m_left; }
+
+    Expression* getRight() { return m_right; }
+
+private:
+    TokenType m_operator;
+    Expression* m_left;
+    Expression* m_right;
+};
+
+class BinaryExpression : public OperatorExpression {
+public:
+    BinaryExpression(TokenType op, Expression* left, Expression* right, Location location)
+        : OperatorExpression(NodeKind::BinaryExpression, op, left, right, location) {}
+};
+
+class LogicalExpression : public OperatorExpression {
+public:
+    LogicalExpression(TokenType op, Expression* left, Expression* right, Location location)
+        : OperatorExpression(NodeKind::LogicalExpression, op, left, right, location) {}
+};
+
+class AssignmentExpression : public OperatorExpression {
+public:
+    AssignmentExpression(TokenType op, Expression* left, Expression* right, Location location)
+        : OperatorExpression(NodeKind::AssignmentExpression, op, left, right, location) {}
+};
+
+class ConditionalExpression : public Expression {
+public:
+    ConditionalExpression(Expression* test, Expression* consequent, Expression* alternate, Location location)
+        : Expression(NodeKind::ConditionalExpression, location),
+          m_test(test),
+          m_consequent(consequent),
+          m_alternate(alternate) {}
+
+    Expression* getTest() { return m_test; }
+
+    Expression* getConsequent() { return m_consequent; }
+
+    Expression* getAlternate() { return m_alternate; }
+
+private:
+    Expression* m_test;
+    Expression* m_consequent;
+    Expression* m_alternate;
+};
+
+// `a, b, c`: the operands in order, evaluated left to right.
+class SequenceExpression : public Expression {
+public:
+    // `expressions` is an arena array of `count` expressions, at least two.
+    SequenceExpression(Expression** expressions, size_t count, Location location)
+        : Expression(NodeKind::SequenceExpression, location),
+          m_expressions(expressions),
+          m_count(count) {}
+
+    size_t getCount() { return m_count; }
+
+    Expression* getExpression(size_t index) { return m_expressions[index]; }
+
+private:
+    Expression** m_expressions;
+    size_t m_count;
+};
+
+class MemberExpression : public Expression {
+public:
+    // `a.b` has an Identifier property; `a[b]` is computed.
+    MemberExpression(Expression* object, Expression* property, bool computed, bool optional, Location location)
+        : Expression(NodeKind::MemberExpression, location),
+          m_object(object),
+          m_property(property),
+          m_computed(computed),
+          m_optional(optional) {}
+
+    Expression* getObject() { return m_object; }
+
+    Expression* getProperty() { return m_property; }
+
+    bool isComputed() { return m_computed; }
+
+    bool isOptional() { return m_optional; }
+
+private:
+    Expression* m_object;
+    Expression* m_property;
+    bool m_computed;
+    bool m_optional;
+};
+
+class CallExpression : public Expression {
+public:
+    // `arguments` is an arena array of `count` expressions.
+    CallExpression(Expression* callee, Expression** arguments, size_t count, bool optional, Location location)
+        : Expression(NodeKind::CallExpression, location),
+          m_callee(callee),
+          m_arguments(arguments),
+          m_count(count),
+          m_optional(optional) {}
+
+    Expression* getCallee() { return m_callee; }
+
+    size_t getCount() { return m_count; }
+
+    Expression* getArgument(size_t index) { return m_arguments[index]; }
+
+    bool isOptional() { return m_optional; }
+
+private:
+    Expression* m_callee;
+    Expression** m_arguments;
+    size_t m_count;
+    bool m_optional;
+};
+
+// Statements
+class Statement : public Node {
+public:
+    Statement(NodeKind kind, Location location)
+        : Node(kind, location) {}
+};
+
+class EmptyStatement : public Statement {
+public:
+    EmptyStatement(Location location)
+        : Statement(NodeKind::EmptyStatement, location) {}
+};
+
+class DebuggerStatement : public Statement {
+public:
+    DebuggerStatement(Location location)
+        : Statement(NodeKind::DebuggerStatement, location) {}
+};
+
+class IfStatement : public Statement {
+public:
+    IfStatement(Expression* test, Statement* body, Statement* alternate, Location location)
+        : Statement(NodeKind::IfStatement, location),
+          m_test(test),
+          m_body(body),
+          m_alternate(alternate) {}
+
+    Expression* getTest() { return m_test; }
+
+    Statement* getBody() { return m_body; }
+
+    // The `else` branch, or null.
+    Statement* getAlternate() { return m_alternate; }
+
+private:
+    Expression* m_test;
+    Statement* m_body;
+    Statement* m_alternate;
 };
 
 class WhileStatement : public Statement {
 public:
-//              public readonly test: Expression | Identifier | Literal
-    WhileStatement(Expression* test, Statement* body, Location location)
-        : m_test(test),
-          m_body(body),
-          m_location(location) {
-        m_class_name = "WhileStatement";
+//              public readonly test: Expression | Identifier | Literal
+    WhileStatement(Expression* test, Statement* body, Location location)
+        : Statement(NodeKind::WhileStatement, location),
+          m_test(test),
+          m_body(body) {}
+
+    Expression* getTest() { return m_test; }
+
+    Statement* getBody() { return m_body; }
+
+private:
+    Expression* m_test;
+    Statement* m_body;
+};
+
+class ExpressionStatement : public Statement {
+public:
+    ExpressionStatement(Expression* expression, Location location)
+        : Statement(NodeKind::ExpressionStatement, location),
+          m_expression(expression) {}
+
+    Expression* getExpression() { return m_expression; }
+
+private:    
+    Expression* m_expression;
+};
+
+class FunctionArgument {
+public:
+    FunctionArgument(Identifier id)
+        : m_id(id),
+          m_value(nullptr) {}
+
+    FunctionArgument(Identifier id, Expression* value)
+        : m_id(id),
+          m_value(value) {}
+
+    Identifier* getId() { return &m_id; }
+
+    // The default value, or null.
+    Expression* getValue() { return m_value; }
+
+private:
+    Identifier m_id;
+    Expression* m_value;
+};
+
+class BlockStatement : public Statement {
+public:
+    BlockStatement(Location location)
+        : Statement(NodeKind::BlockStatement, location),
+          m_body(nullptr),
+          m_count(0) {}
+
+    // `body` is an arena array of `count` statements.
+    BlockStatement(Statement** body, size_t count, Location location)
+        : Statement(NodeKind::BlockStatement, location),
+          m_body(body),
+          m_count(count) {}
+
+    size_t getCount() { return m_count; }
+
+    Statement* getStatement(size_t index) { return m_body[index]; }
+
+private:
+    Statement** m_body;
+    size_t m_count;
+};
+
+class FunctionDeclarationStatement : public Statement {
+public:
+    // A lazily parsed function has no body yet, only the source span of
+    // its braces; see Parser::parse_lazy_body.
+    FunctionDeclarationStatement(Identifier id, bool async, bool generator, FunctionArgument* args, size_t arg_count, BlockStatement* body, uint32_t body_start, uint32_t body_end, Location location)
+        : Statement(NodeKind::FunctionDeclarationStatement, location),
+          m_id(id),
+          m_async(async),
+          m_generator(generator),
+          m_args(args),
+          m_arg_count(arg_count),
+          m_body(body),
+          m_body_start(body_start),
+          m_body_end(body_end) {}
+
+    // Anonymous function expressions have the NONE atom as their name.
+    Identifier* getId() { return &m_id; }
+
+    bool isAsync() { return m_async; }
+
+    bool isGenerator() { return m_generator; }
+
+    size_t getArgCount() { return m_arg_count; }
+
+    FunctionArgument* getArg(size_t index) { return &m_args[index]; }
+
+    // Null while the function is lazy.
+    BlockStatement* getBody() { return m_body; }
+
+    bool isLazy() { return m_body == nullptr; }
+
+    void setBody(BlockStatement* body) { m_body = body; }
+
+    // Source offsets of the body's `{` and one past its `}`.
+    uint32_t getBodyStart() { return m_body_start; }
+
+    uint32_t getBodyEnd() { return m_body_end; }
+
+    void setBodyRange(uint32_t start, uint32_t end) {
+        m_body_start = start;
+        m_body_end = end;
+    }
+
+private:
+    Identifier m_id;
+    bool m_async;
+    bool m_generator;
+    FunctionArgument* m_args;
+    size_t m_arg_count;
+    BlockStatement* m_body;
+    uint32_t m_body_start;
+    uint32_t m_body_end;
+};
+
+// Function expressions share the declaration node for everything but
+// their position in the tree.
+class FunctionExpression : public Expression {
+public:
+    FunctionExpression(FunctionDeclarationStatement* function, Location location)
+        : Expression(NodeKind::FunctionExpression, location),
+          m_function(function) {}
+
+    FunctionDeclarationStatement* getFunction() { return m_function; }
+
+private:
+    FunctionDeclarationStatement* m_function;
+};
+
+// Variables
+class ReturnStatement : public Statement {
+public:
+    ReturnStatement(Expression* argument, Location location)
+        : Statement(NodeKind::ReturnStatement, location),
+          m_argument(argument) {}
+
+    // Null for a bare `return;`.
+    Expression* getArgument() { return m_argument; }
+
+private:
+    Expression* m_argument;
+};
+
+// Program
+// Owns the arena its nodes were allocated from; deleting the program (or
+// calling release()) frees the whole tree in one go.
+class Program  {
+public:
+    Program(std::vector<Statement*> statements, AstArena arena, std::shared_ptr<AtomTable> atoms)
+        : m_statements(std::move(statements)),
+          m_arena(std::move(arena)),
+          m_atoms(std::move(atoms)) {}
+
+    const std::vector<Statement*>& statements() { return m_statements; }
+
+    AstArena& getArena() { return m_arena; }
+
+    // Names in the tree are atoms from this table, which the program
+    // shares with the lexer that made it.
+    AtomTable* getAtoms() { return m_atoms.get(); }
+
+    const std::shared_ptr<AtomTable>& shareAtoms() { return m_atoms; }
+
+    void release() {
+        m_statements.clear();
+        m_arena.release();
+    }
+
+private:
+    std::vector<Statement*> m_statements;
+    AstArena m_arena;
+    std::shared_ptr<AtomTable> m_atoms;
+};
+
+// Static-dispatch tree walker. Derived overrides the visit* hooks it cares
+// about; dispatch is a switch on the node tag, so there are no virtual
+// calls and no string compares. The default hooks schedule children, so a
+// derived visitor only has to handle the nodes it is interested in.
+//
+// Scheduled children wait on an explicit work stack rather than the native
+// one, so a 200k-term `a + a + ...` spine costs heap, not stack. Hooks run
+// in pre-order; a node's children follow in the order they were scheduled,
+// after its own hook has returned.
+template <typename Derived>
+class AstVisitor {
+public:
+    void visit(Node* node) {
+        size_t base = m_work.size();
+        m_work.push_back(node);
+        while (m_work.size() > base) {
+            Node* next = m_work.back();
+            m_work.pop_back();
+            size_t mark = m_work.size();
+            dispatch(next);
+            std::reverse(m_work.begin() + mark, m_work.end());
+        }
+    }
+
+    void visitProgram(Program* program) {
+        for (Statement* statement : program->statements())
+            visit(statement);
+    }
+
+    // Called for every node before its own hook.
+    void visitNode(Node*) {}
+
+    void visitIdentifier(Identifier*) {}
+
+    void visitLiteral(Literal*) {}
+
+    void visitArrayExpression(ArrayExpression* node) {
+        for (size_t i = 0; i < node->getCount(); ++i)
+            visit_child(node->getElement(i));
+    }
+
+    void visitUnaryExpression(UnaryExpression* node) {
+        visit_child(node->getArgument());
+    }
+
+    void visitUpdateExpression(UpdateExpression* node) {
+        visit_child(node->getArgument());
+    }
+
+    void visitBinaryExpression(BinaryExpression* node) {
+        visit_child(node->getLeft());
+        visit_child(node->getRight());
+    }
+
+    void visitLogicalExpression(LogicalExpression* node) {
+        visit_child(node->getLeft());
+        visit_child(node->getRight());
+    }
+
+    void visitAssignmentExpression(AssignmentExpression* node) {
+        visit_child(node->getLeft());
+        visit_child(node->getRight());
+    }
+
+    void visitConditionalExpression(ConditionalExpression* node) {
+        visit_child(node->getTest());
+        visit_child(node->getConsequent());
+        visit_child(node->getAlternate());
+    }
+
+    void visitMemberExpression(MemberExpression* node) {
+        visit_child(node->getObject());
+        visit_child(node->getProperty());
+    }
+
+    void visitCallExpression(CallExpression* node) {
+        visit_child(node->getCallee());
+        for (size_t i = 0; i < node->getCount(); ++i)
+            visit_child(node->getArgument(i));
+    }
+
+    void visitFunctionExpression(FunctionExpression* node) {
+        visit_child(node->getFunction());
+    }
+
+    void visitSequenceExpression(SequenceExpression* node) {
+        for (size_t i = 0; i < node->getCount(); ++i)
+            visit_child(node->getExpression(i));
+    }
+
+    void visitEmptyStatement(EmptyStatement*) {}
+
+    void visitDebuggerStatement(DebuggerStatement*) {}
+
+    void visitIfStatement(IfStatement* node) {
+        visit_child(node->getTest());
+        visit_child(node->getBody());
+        visit_child(node->getAlternate());
+    }
+
+    void visitWhileStatement(WhileStatement* node) {
+        visit_child(node->getTest());
+        visit_child(node->getBody());
+    }
+
+    void visitExpressionStatement(ExpressionStatement* node) {
+        visit_child(node->getExpression());
+    }
+
+    void visitBlockStatement(BlockStatement* node) {
+        for (size_t i = 0; i < node->getCount(); ++i)
+            visit_child(node->getStatement(i));
+    }
+
+    void visitFunctionDeclarationStatement(FunctionDeclarationStatement* node) {
+        visit_child(node->getId());
+        for (size_t i = 0; i < node->getArgCount(); ++i) {
+            visit_child(node->getArg(i)->getId());
+            visit_child(node->getArg(i)->getValue());
+        }
+        visit_child(node->getBody());
+    }
+
+    void visitReturnStatement(ReturnStatement* node) {
+        visit_child(node->getArgument());
+    }
+
+protected:
+    // Schedules `node`, when there is one, to be visited once the current
+    // hook returns.
+    void visit_child(Node* node) {
+        if (node != nullptr)
+            m_work.push_back(node);
+    }
+
+private:
+    void dispatch(Node* node) {
+        derived().visitNode(node);
+        switch (node->getKind()) {
+            case NodeKind::Identifier: derived().visitIdentifier(static_cast<Identifier*>(node)); return;
+            case NodeKind::Literal: derived().visitLiteral(static_cast<Literal*>(node)); return;
+            case NodeKind::ArrayExpression: derived().visitArrayExpression(static_cast<ArrayExpression*>(node)); return;
+            case NodeKind::UnaryExpression: derived().visitUnaryExpression(static_cast<UnaryExpression*>(node)); return;
+            case NodeKind::UpdateExpression: derived().visitUpdateExpression(static_cast<UpdateExpression*>(node)); return;
+            case NodeKind::BinaryExpression: derived().visitBinaryExpression(static_cast<BinaryExpression*>(node)); return;
+            case NodeKind::LogicalExpression: derived().visitLogicalExpression(static_cast<LogicalExpression*>(node)); return;
+            case NodeKind::AssignmentExpression: derived().visitAssignmentExpression(static_cast<AssignmentExpression*>(node)); return;
+            case NodeKind::ConditionalExpression: derived().visitConditionalExpression(static_cast<ConditionalExpression*>(node)); return;
+            case NodeKind::MemberExpression: derived().visitMemberExpression(static_cast<MemberExpression*>(node)); return;
+            case NodeKind::CallExpression: derived().visitCallExpression(static_cast<CallExpression*>(node)); return;
+            case NodeKind::FunctionExpression: derived().visitFunctionExpression(static_cast<FunctionExpression*>(node)); return;
+            case NodeKind::SequenceExpression: derived().visitSequenceExpression(static_cast<SequenceExpression*>(node)); return;
+            case NodeKind::EmptyStatement: derived().visitEmptyStatement(static_cast<EmptyStatement*>(node)); return;
+            case NodeKind::DebuggerStatement: derived().visitDebuggerStatement(static_cast<DebuggerStatement*>(node)); return;
+            case NodeKind::IfStatement: derived().visitIfStatement(static_cast<IfStatement*>(node)); return;
+            case NodeKind::WhileStatement: derived().visitWhileStatement(static_cast<WhileStatement*>(node)); return;
+            case NodeKind::ExpressionStatement: derived().visitExpressionStatement(static_cast<ExpressionStatement*>(node)); return;
+            case NodeKind::BlockStatement: derived().visitBlockStatement(static_cast<BlockStatement*>(node)); return;
+            case NodeKind::FunctionDeclarationStatement: derived().visitFunctionDeclarationStatement(static_cast<FunctionDeclarationStatement*>(node)); return;
+            case NodeKind::ReturnStatement: derived().visitReturnStatement(static_cast<ReturnStatement*>(node)); return;
+        }
+        assert(false && "unreachable");
+    }
+
+    Derived& derived() { return *static_cast<Derived*>(this); }
+
+    std::vector<Node*> m_work;
+};
+
+// Flat AST
+//
+// An alternative to the pointer tree for passes that walk every node. Nodes
+// sit in pre-order in parallel arrays and refer to each other by 32-bit
+// index: a node's first child is the next index and its next sibling is
+// `getEnd(index)`, so a pre-order walk is a linear scan. There are no
+// pointers, so the arrays can be copied or written out with memcpy.
+//
+// The parser builds one directly (see FlatBuilder): it appends each node
+// once its children are in, which is post-order, and reorders the arrays
+// into pre-order at the end. No pointer tree is built on the way.
+class FlatAst {
+public:
+    using Index = uint32_t;
+
+    static constexpr Index NONE = UINT32_MAX;
+
+    enum Flags : uint8_t {
+        FLAG_ASYNC       = 1 << 0,
+        FLAG_GENERATOR   = 1 << 1,
+        // A function argument identifier whose default value follows it.
+        FLAG_HAS_DEFAULT = 1 << 2,
+        FLAG_PREFIX      = 1 << 3,
+        FLAG_COMPUTED    = 1 << 4,
+        FLAG_OPTIONAL    = 1 << 5,
+        // A function whose body was skipped by a lazy parse.
+        FLAG_LAZY        = 1 << 6,
+    };
+
+    // Per-kind payload for literals; the spelling is source[offset, offset + length).
+    struct LiteralData {
+        uint32_t length;
+        Atom atom;
+    };
+
+    FlatAst()
+        : m_file_id(0) {}
+
+    // Identifier names are atoms in `atoms` and literal spellings point
+    // into `source`; the tree keeps both alive, like Program and
+    // TokenStream do, rather than finding them again by file id.
+    void reset(uint32_t file_id, SourceBuffer source, std::shared_ptr<AtomTable> atoms) {
+        m_kinds.clear();
+        m_flags.clear();
+        m_offsets.clear();
+        m_ends.clear();
+        m_data.clear();
+        m_literals.clear();
+        m_roots = 0;
+        JS_STAT(m_allocations = 0;)
+        m_file_id = file_id;
+        m_source = source;
+        m_atoms = std::move(atoms);
+    }
+
+    // Appends a node whose children are appended next; `close` it once
+    // they are all in.
+    Index open(NodeKind kind, uint32_t offset, uint32_t data = 0, uint8_t flags = 0) {
+        Index index = (Index) m_kinds.size();
+        // The five node columns grow together.
+        JS_STAT(m_allocations += index == m_kinds.capacity() ? 5 : 0;)
+        m_kinds.push_back(kind);
+        m_flags.push_back(flags);
+        m_offsets.push_back(offset);
+        m_ends.push_back(NONE);
+        m_data.push_back(data);
+        return index;
+    }
+
+    void close(Index index) {
+        m_ends[index] = (Index) m_kinds.size();
+    }
+
+    Index leaf(NodeKind kind, uint32_t offset, uint32_t data = 0, uint8_t flags = 0) {
+        Index index = open(kind, offset, data, flags);
+        close(index);
+        return index;
+    }
+
+    Index literal(uint32_t offset, uint32_t length, Atom atom) {
+        Index index = leaf(NodeKind::Literal, offset, (uint32_t) m_literals.size());
+        JS_STAT(m_allocations += m_literals.size() == m_literals.capacity();)
+        m_literals.push_back(LiteralData { length, atom });
+        return index;
+    }
+
+    // Post-order building: `append` a node after its children, giving the
+    // index its first child's subtree starts at (NONE for a leaf), then
+    // `finish_postorder` once everything is in. Until then getEnd answers
+    // with that start instead.
+    Index append(NodeKind kind, uint32_t offset, Index first, uint32_t data = 0, uint8_t flags = 0) {
+        Index index = open(kind, offset, data, flags);
+        m_ends[index] = first == NONE ? index : first;
+        return index;
+    }
+
+    Index append_literal(uint32_t offset, uint32_t length, Atom atom) {
+        Index index = append(NodeKind::Literal, offset, NONE, (uint32_t) m_literals.size());
+        JS_STAT(m_allocations += m_literals.size() == m_literals.capacity();)
+        m_literals.push_back(LiteralData { length, atom });
+        return index;
+    }
+
+    void setFlags(Index index, uint8_t flags) { m_flags[index] = flags; }
+
+    // Where appending stood, to drop a statement that failed half way.
+    struct Mark {
+        size_t nodes;
+        size_t literals;
+    };
+
+    Mark mark() { return Mark { m_kinds.size(), m_literals.size() }; }
+
+    void truncate(Mark mark) {
+        m_kinds.resize(mark.nodes);
+        m_flags.resize(mark.nodes);
+        m_offsets.resize(mark.nodes);
+        m_ends.resize(mark.nodes);
+        m_data.resize(mark.nodes);
+        m_literals.resize(mark.literals);
+    }
+
+    // A subtree spans [first, index] in post-order. In pre-order the node
+    // moves to the front of its span, and the span itself moves right by
+    // one slot per ancestor, which a backward scan keeps on a stack.
+    // Literal payloads keep their order, as leaves do.
+    void finish_postorder() {
+        std::vector<Index> ends(m_kinds.size());
+        std::vector<Index> ancestors;
+        for (size_t i = m_kinds.size(); i-- > 0;) {
+            Index first = m_ends[i];
+            while (!ancestors.empty() && ancestors.back() > i)
+                ancestors.pop_back();
+            Index target = first + (Index) ancestors.size();
+            ends[target] = (Index) (i + ancestors.size() + 1);
+            ancestors.push_back(first);
+            m_ends[i] = target;
+        }
+        permute(&m_kinds);
+        permute(&m_flags);
+        permute(&m_offsets);
+        permute(&m_data);
+        m_ends = std::move(ends);
+        JS_STAT(m_allocations += 5;)
+    }
+
+    // Top-level statements are the siblings starting at index 0.
+    void setRootCount(size_t count) { m_roots = count; }
+
+    size_t getRootCount() { return m_roots; }
+
+    size_t size() { return m_kinds.size(); }
+
+    bool empty() { return m_kinds.empty(); }
+
+    NodeKind getKind(Index index) { return m_kinds[index]; }
+
+    uint8_t getFlags(Index index) { return m_flags[index]; }
+
+    Index getEnd(Index index) { return m_ends[index]; }
+
+    Index getFirstChild(Index index) { return index + 1 < m_ends[index] ? index + 1 : NONE; }
+
+    Index getNextSibling(Index index, Index parent_end) {
+        return m_ends[index] < parent_end ? m_ends[index] : NONE;
+    }
+
+    size_t getChildCount(Index index) {
+        size_t count = 0;
+        for (Index child = index + 1; child < m_ends[index]; child = m_ends[child])
+            count++;
+        return count;
+    }
+
+    Location getLocation(Index index) { return Location(m_file_id, m_offsets[index]); }
+
+    // Identifier name.
+    Atom getName(Index index) {
+        assert(m_kinds[index] == NodeKind::Identifier);
+        return m_data[index];
+    }
+
+    std::string_view getNameText(Index index) { return m_atoms->getText(getName(index)); }
+
+    // Function argument count, or the operator's TokenType.
+    uint32_t getData(Index index) { return m_data[index]; }
+
+    uint32_t getOffset(Index index) { return m_offsets[index]; }
+
+    LiteralData& getLiteral(Index index) {
+        assert(m_kinds[index] == NodeKind::Literal);
+        return m_literals[m_data[index]];
+    }
+
+    std::string_view getLiteralValue(Index index) {
+        return std::string_view(m_source.getData() + m_offsets[index], getLiteral(index).length);
+    }
+
+    LineColumn resolve(Index index) { return getLocation(index).resolve(); }
+
+    uint32_t getFileId() { return m_file_id; }
+
+    const SourceBuffer& getSource() { return m_source; }
+
+    AtomTable* getAtoms() { return m_atoms.get(); }
+
+    size_t memoryUsage() {
+        return m_kinds.size() * (sizeof(NodeKind) + sizeof(uint8_t) + 3 * sizeof(uint32_t))
+             + m_literals.size() * sizeof(LiteralData);
+    }
+
+#ifdef JS_PARSER_STATS
+    // Column buffers allocated since the last reset, reserved room reused
+    // across resets aside.
+    size_t getAllocationCount() { return m_allocations; }
+#endif
+
+private:
+    // Moves each entry to the slot finish_postorder left in m_ends.
+    template <typename T>
+    void permute(std::vector<T>* column) {
+        std::vector<T> moved(column->size());
+        for (size_t i = 0; i < column->size(); ++i)
+            moved[m_ends[i]] = (*column)[i];
+        *column = std::move(moved);
+    }
+
+    std::vector<NodeKind> m_kinds;
+    std::vector<uint8_t> m_flags;
+    std::vector<uint32_t> m_offsets;
+    std::vector<Index> m_ends;
+    std::vector<uint32_t> m_data;
+    std::vector<LiteralData> m_literals;
+    size_t m_roots = 0;
+    JS_STAT(size_t m_allocations = 0;)
+    uint32_t m_file_id;
+    SourceBuffer m_source;
+    std::shared_ptr<AtomTable> m_atoms;
+};
+
+// Lowers an existing pointer tree into a FlatAst in pre-order; parsing
+// straight to a FlatAst goes through FlatBuilder instead, and bench --check
+// holds the two to the same output. Each hook emits its node and schedules
+// the children on an explicit work list instead of recursing, so
+// arbitrarily deep trees lower in constant native stack.
+class FlatAstLowering : public AstVisitor<FlatAstLowering> {
+public:
+    FlatAstLowering(FlatAst* out)
+        : m_out(out),
+          m_mark(0),
+          m_flags(0) {}
+
+    void visitProgram(Program* program) { lower(program->statements()); }
+
+    // Top-level statements without a Program, e.g. a Document's.
+    void lower(const std::vector<Statement*>& statements) {
+        for (size_t i = statements.size(); i-- > 0;)
+            m_work.push_back(Work { statements[i], 0, 0 });
+        while (!m_work.empty()) {
+            Work work = m_work.back();
+            m_work.pop_back();
+            if (work.node == nullptr) {
+                m_out->close(work.index);
+                continue;
+            }
+            m_flags = work.flags;
+            visit(work.node);
+        }
+        m_out->setRootCount(statements.size());
+    }
+
+    void visitIdentifier(Identifier* node) {
+        m_out->leaf(NodeKind::Identifier, node->getLocation().getCursor(), node->getName(), m_flags);
+    }
+
+    void visitLiteral(Literal* node) {
+        m_out->literal(node->getLocation().getCursor(), (uint32_t) node->getValue().size(), node->getAtom());
+    }
+
+    void visitArrayExpression(ArrayExpression* node) {
+        open(node);
+        for (size_t i = 0; i < node->getCount(); ++i)
+            schedule(node->getElement(i));
+        finish();
+    }
+
+    void visitUnaryExpression(UnaryExpression* node) {
+        open(node, node->getOperator());
+        schedule(node->getArgument());
+        finish();
+    }
+
+    void visitUpdateExpression(UpdateExpression* node) {
+        open(node, node->getOperator(), node->isPrefix() ? FlatAst::FLAG_PREFIX : 0);
+        schedule(node->getArgument());
+        finish();
+    }
+
+    void visitBinaryExpression(BinaryExpression* node) { visit_operator(node); }
+
+    void visitLogicalExpression(LogicalExpression* node) { visit_operator(node); }
+
+    void visitAssignmentExpression(AssignmentExpression* node) { visit_operator(node); }
+
+    void visitConditionalExpression(ConditionalExpression* node) {
+        open(node);
+        schedule(node->getTest());
+        schedule(node->getConsequent());
+        schedule(node->getAlternate());
+        finish();
+    }
+
+    void visitMemberExpression(MemberExpression* node) {
+        open(node, 0, (node->isComputed() ? FlatAst::FLAG_COMPUTED : 0) | (node->isOptional() ? FlatAst::FLAG_OPTIONAL : 0));
+        schedule(node->getObject());
+        schedule(node->getProperty());
+        finish();
+    }
+
+    // Children: the callee, then the arguments.
+    void visitCallExpression(CallExpression* node) {
+        open(node, 0, node->isOptional() ? FlatAst::FLAG_OPTIONAL : 0);
+        schedule(node->getCallee());
+        for (size_t i = 0; i < node->getCount(); ++i)
+            schedule(node->getArgument(i));
+        finish();
+    }
+
+    void visitEmptyStatement(EmptyStatement* node) {
+        m_out->leaf(NodeKind::EmptyStatement, node->getLocation().getCursor());
+    }
+
+    void visitDebuggerStatement(DebuggerStatement* node) {
+        m_out->leaf(NodeKind::DebuggerStatement, node->getLocation().getCursor());
+    }
+
+    void visitIfStatement(IfStatement* node) {
+        open(node);
+        schedule(node->getTest());
+        schedule(node->getBody());
+        schedule(node->getAlternate());
+        finish();
+    }
+
+    void visitWhileStatement(WhileStatement* node) {
+        open(node);
+        schedule(node->getTest());
+        schedule(node->getBody());
+        finish();
+    }
+
+    void visitExpressionStatement(ExpressionStatement* node) {
+        open(node);
+        schedule(node->getExpression());
+        finish();
+    }
+
+    void visitBlockStatement(BlockStatement* node) {
+        open(node);
+        for (size_t i = 0; i < node->getCount(); ++i)
+            schedule(node->getStatement(i));
+        finish();
+    }
+
+    void visitFunctionExpression(FunctionExpression* node) {
+        open(node);
+        schedule(node->getFunction());
+        finish();
+    }
+
+    void visitSequenceExpression(SequenceExpression* node) {
+        open(node);
+        for (size_t i = 0; i < node->getCount(); ++i)
+            schedule(node->getExpression(i));
+        finish();
+    }
+
+    // Children: the name, one identifier per argument (each followed by its
+    // default value when FLAG_HAS_DEFAULT is set), then the body unless
+    // FLAG_LAZY is set.
+    void visitFunctionDeclarationStatement(FunctionDeclarationStatement* node) {
+        uint8_t flags = (node->isAsync() ? FlatAst::FLAG_ASYNC : 0) | (node->isGenerator() ? FlatAst::FLAG_GENERATOR : 0) | (node->isLazy() ? FlatAst::FLAG_LAZY : 0);
+        open(node, (uint32_t) node->getArgCount(), flags);
+        schedule(node->getId());
+        for (size_t i = 0; i < node->getArgCount(); ++i) {
+            FunctionArgument* arg = node->getArg(i);
+            schedule(arg->getId(), arg->getValue() ? FlatAst::FLAG_HAS_DEFAULT : 0);
+            schedule(arg->getValue());
+        }
+        schedule(node->getBody());
+        finish();
+    }
+
+    void visitReturnStatement(ReturnStatement* node) {
+        open(node);
+        schedule(node->getArgument());
+        finish();
+    }
+
+private:
+    // A null node closes `index` once everything scheduled above it is done.
+    struct Work {
+        Node* node;
+        FlatAst::Index index;
+        uint8_t flags;
+    };
+
+    void visit_operator(OperatorExpression* node) {
+        open(node, node->getOperator());
+        schedule(node->getLeft());
+        schedule(node->getRight());
+        finish();
+    }
+
+    void open(Node* node, uint32_t data = 0, uint8_t flags = 0) {
+        FlatAst::Index index = m_out->open(node->getKind(), node->getLocation().getCursor(), data, flags);
+        m_work.push_back(Work { nullptr, index, 0 });
+        m_mark = m_work.size();
+    }
+
+    void schedule(Node* child, uint8_t flags = 0) {
+        if (child != nullptr)
+            m_work.push_back(Work { child, 0, flags });
+    }
+
+    // Children were scheduled in source order; the work list pops from the back.
+    void finish() {
+        std::reverse(m_work.begin() + m_mark, m_work.end());
+    }
+
+    FlatAst* m_out;
+    std::vector<Work> m_work;
+    size_t m_mark;
+    uint8_t m_flags;
+};
+
+// AST images
+//
+// A FlatAst written to disk in a form that can be mapped back and walked in
+// place. The file is a fixed header followed by arrays at 4-byte aligned
+// offsets recorded in the header. Names and literal spellings are stored
+// once each in a string table. Nodes hold string indices rather than
+// process-local atoms, and line starts are saved so that locations resolve
+// without the source. Everything is in host byte order. NodeKind and
+// operator TokenType values are part of the format, so bump VERSION when
+// either enum or the layout changes.
+class AstImage {
+public:
+    static constexpr uint32_t VERSION = 4;
+
+    enum Section : uint32_t {
+        SECTION_OFFSETS,
+        SECTION_ENDS,
+        SECTION_DATA,
+        SECTION_STRING_OFFSETS,
+        SECTION_LINE_STARTS,
+        SECTION_KINDS,
+        SECTION_FLAGS,
+        SECTION_STRING_BYTES,
+        SECTION_COUNT,
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t source_hash;
+        uint32_t source_length;
+        uint32_t file_size;
+        uint32_t node_count;
+        uint32_t root_count;
+        uint32_t string_count;
+        uint32_t string_bytes;
+        uint32_t line_count;
+        uint32_t reserved;
+        uint32_t sections[SECTION_COUNT];
+    };
+
+    static constexpr char MAGIC[4] = { 'J', 'S', 'A', 'I' };
+
+    AstImage()
+        : m_header(nullptr),
+          m_base(nullptr) {}
+
+    // Identifies the source bytes an image was made from.
+    static uint64_t hash_source(const SourceBuffer& source) {
+        return hash_bytes(source.getData(), source.getLength());
+    }
+
+    // Produces `ast` sequentially through `emit(bytes, length)`: every
+    // section size is known once the string table has been collected, so
+    // the header goes first. `source_hash` is hash_source of its source.
+    template <typename Emit>
+    static bool serialize(FlatAst* ast, uint64_t source_hash, Emit&& emit) {
+        size_t count = ast->size();
+        std::vector<uint32_t> data(count);
+        std::vector<uint32_t> string_offsets = { 0 };
+        std::string string_bytes;
+        std::unordered_map<std::string_view, uint32_t> strings;
+        auto intern = [&](std::string_view text) {
+            auto [it, inserted] = strings.try_emplace(text, (uint32_t) strings.size());
+            if (inserted) {
+                string_bytes.append(text);
+                string_offsets.push_back((uint32_t) string_bytes.size());
+            }
+            return it->second;
+        };
+        for (FlatAst::Index i = 0; i < count; ++i) {
+            switch (ast->getKind(i)) {
+                case NodeKind::Identifier: data[i] = intern(ast->getNameText(i)); break;
+                case NodeKind::Literal: data[i] = intern(ast->getLiteralValue(i)); break;
+                default: data[i] = ast->getData(i); break;
+            }
+        }
+
+        const SourceBuffer& source = ast->getSource();
+        std::vector<uint32_t> lines;
+        find_line_starts(source, &lines);
+
+        Header header = {};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.source_hash = source_hash;
+        header.source_length = (uint32_t) source.getLength();
+        header.node_count = (uint32_t) count;
+        header.root_count = (uint32_t) ast->getRootCount();
+        header.string_count = (uint32_t) strings.size();
+        header.string_bytes = (uint32_t) string_bytes.size();
+        header.line_count = (uint32_t) lines.size();
+
+        size_t sizes[SECTION_COUNT] = {};
+        sizes[SECTION_OFFSETS] = count * sizeof(uint32_t);
+        sizes[SECTION_ENDS] = count * sizeof(uint32_t);
+        sizes[SECTION_DATA] = count * sizeof(uint32_t);
+        sizes[SECTION_STRING_OFFSETS] = string_offsets.size() * sizeof(uint32_t);
+        sizes[SECTION_LINE_STARTS] = lines.size() * sizeof(uint32_t);
+        sizes[SECTION_KINDS] = count;
+        sizes[SECTION_FLAGS] = count;
+        sizes[SECTION_STRING_BYTES] = string_bytes.size();
+
+        uint64_t cursor = sizeof(Header);
+        for (uint32_t section = 0; section < SECTION_COUNT; ++section) {
+            cursor = (cursor + 3) & ~(uint64_t) 3;
+            header.sections[section] = (uint32_t) cursor;
+            cursor += sizes[section];
+        }
+        if (cursor > UINT32_MAX) {
+            fprintf(stderr, "ERROR: AST image would exceed 4 GiB\n");
+            return false;
+        }
+        header.file_size = (uint32_t) cursor;
+
+        std::vector<uint32_t> offsets(count), ends(count);
+        std::vector<uint8_t> kinds(count), flags(count);
+        for (FlatAst::Index i = 0; i < count; ++i) {
+            offsets[i] = ast->getOffset(i);
+            ends[i] = ast->getEnd(i);
+            kinds[i] = (uint8_t) ast->getKind(i);
+            flags[i] = ast->getFlags(i);
+        }
+
+        const void* payloads[SECTION_COUNT] = {};
+        payloads[SECTION_OFFSETS] = offsets.data();
+        payloads[SECTION_ENDS] = ends.data();
+        payloads[SECTION_DATA] = data.data();
+        payloads[SECTION_STRING_OFFSETS] = string_offsets.data();
+        payloads[SECTION_LINE_STARTS] = lines.data();
+        payloads[SECTION_KINDS] = kinds.data();
+        payloads[SECTION_FLAGS] = flags.data();
+        payloads[SECTION_STRING_BYTES] = string_bytes.data();
+
+        static const char zeros[4] = {};
+        bool ok = emit(&header, sizeof(header));
+        uint64_t written = sizeof(Header);
+        for (uint32_t section = 0; ok && section < SECTION_COUNT; ++section) {
+            size_t padding = header.sections[section] - written;
+            ok = emit(zeros, padding) && emit(payloads[section], sizes[section]);
+            written = header.sections[section] + sizes[section];
+        }
+        return ok;
+    }
+
+    static bool write(FILE* out, FlatAst* ast) {
+        bool ok = serialize(ast, hash_source(ast->getSource()),
+                            [out](const void* bytes, size_t length) { return fwrite(bytes, 1, length, out) == length; });
+        if (!ok && ferror(out))
+            fprintf(stderr, "ERROR: failed to write AST image: %s\n", strerror(errno));
+        return ok;
+    }
+
+    static bool write(const char* path, FlatAst* ast) {
+        FILE* out = fopen(path, "wb");
+        if (out == nullptr) {
+            fprintf(stderr, "ERROR: failed to open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        bool ok = write(out, ast);
+        if (fclose(out) != 0 && ok) {
+            fprintf(stderr, "ERROR: failed to write '%s': %s\n", path, strerror(errno));
+            ok = false;
+        }
+        return ok;
+    }
+
+    // Writes the image this object holds, mapped or in memory, to `path`.
+    bool save(const char* path) {
+        FILE* out = fopen(path, "wb");
+        if (out == nullptr) {
+            fprintf(stderr, "ERROR: failed to open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        bool ok = fwrite(m_base, 1, m_header->file_size, out) == m_header->file_size;
+        if (fclose(out) != 0)
+            ok = false;
+        if (!ok)
+            fprintf(stderr, "ERROR: failed to write '%s': %s\n", path, strerror(errno));
+        return ok;
+    }
+
+    // Serializes `ast` into a buffer owned by this image, so a freshly
+    // parsed tree reads back the same way as a mapped one.
+    bool load(FlatAst* ast, uint64_t source_hash) {
+        m_header = nullptr;
+        m_memory.clear();
+        auto append = [this](const void* bytes, size_t length) {
+            m_memory.insert(m_memory.end(), (const char*) bytes, (const char*) bytes + length);
+            return true;
+        };
+        if (!serialize(ast, source_hash, append))
+            return false;
+        m_base = m_memory.data();
+        return validate(m_memory.size());
+    }
+
+    // Maps `path` and checks that the header and every section lie inside
+    // the file, that line starts are sorted from 0 and that subtrees nest;
+    // nothing is copied.
+    bool open(const char* path, bool quiet = false) {
+        m_header = nullptr;
+        m_memory.clear();
+        if (!m_file.open(path))
+            return false;
+        const SourceBuffer& buffer = m_file.getBuffer();
+        m_base = buffer.getData();
+        if (!validate(buffer.getLength())) {
+            if (!quiet)
+                fprintf(stderr, "ERROR: '%s' is not a valid version %u AST image\n", path, VERSION);
+            m_header = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    const Header* getHeader() { return m_header; }
+
+    size_t size() { return m_header->node_count; }
+
+    size_t getRootCount() { return m_header->root_count; }
+
+    NodeKind getKind(FlatAst::Index index) { return (NodeKind) section<uint8_t>(SECTION_KINDS)[index]; }
+
+    uint8_t getFlags(FlatAst::Index index) { return section<uint8_t>(SECTION_FLAGS)[index]; }
+
+    FlatAst::Index getEnd(FlatAst::Index index) { return section<uint32_t>(SECTION_ENDS)[index]; }
+
+    FlatAst::Index getFirstChild(FlatAst::Index index) { return index + 1 < getEnd(index) ? index + 1 : FlatAst::NONE; }
+
+    uint32_t getOffset(FlatAst::Index index) { return section<uint32_t>(SECTION_OFFSETS)[index]; }
+
+    uint32_t getData(FlatAst::Index index) { return section<uint32_t>(SECTION_DATA)[index]; }
+
+    std::string_view getString(uint32_t string) {
+        const uint32_t* offsets = section<uint32_t>(SECTION_STRING_OFFSETS);
+        return std::string_view(section<char>(SECTION_STRING_BYTES) + offsets[string], offsets[string + 1] - offsets[string]);
+    }
+
+    std::string_view getNameText(FlatAst::Index index) { return getString(getData(index)); }
+
+    std::string_view getLiteralValue(FlatAst::Index index) { return getString(getData(index)); }
+
+    LineColumn resolve(FlatAst::Index index) {
+        const uint32_t* lines = section<uint32_t>(SECTION_LINE_STARTS);
+        uint32_t offset = getOffset(index);
+        const uint32_t* line = std::upper_bound(lines, lines + m_header->line_count, offset) - 1;
+        return LineColumn { (int) (line - lines), (int) (offset - *line), (int) *line };
+    }
+
+private:
+    template <typename T>
+    const T* section(Section id) { return (const T*) (m_base + m_header->sections[id]); }
+
+    bool validate(size_t length) {
+        if (length < sizeof(Header))
+            return false;
+        const Header* header = (const Header*) m_base;
+        if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->file_size > length)
+            return false;
+        if (header->line_count == 0 || header->string_count == UINT32_MAX)
+            return false;
+
+        uint64_t counts[SECTION_COUNT] = {};
+        counts[SECTION_OFFSETS] = header->node_count * 4ull;
+        counts[SECTION_ENDS] = header->node_count * 4ull;
+        counts[SECTION_DATA] = header->node_count * 4ull;
+        counts[SECTION_STRING_OFFSETS] = (header->string_count + 1ull) * 4;
+        counts[SECTION_LINE_STARTS] = header->line_count * 4ull;
+        counts[SECTION_KINDS] = header->node_count;
+        counts[SECTION_FLAGS] = header->node_count;
+        counts[SECTION_STRING_BYTES] = header->string_bytes;
+        for (uint32_t section = 0; section < SECTION_COUNT; ++section) {
+            if (header->sections[section] % 4 != 0 || header->sections[section] < sizeof(Header))
+                return false;
+            if (header->sections[section] + counts[section] > header->file_size)
+                return false;
+        }
+
+        m_header = header;
+        const uint32_t* strings = section<uint32_t>(SECTION_STRING_OFFSETS);
+        for (uint32_t i = 0; i < header->string_count; ++i)
+            if (strings[i] > strings[i + 1] || strings[i + 1] > header->string_bytes)
+                return false;
+
+        // resolve looks rows up by binary search from line 0.
+        const uint32_t* lines = section<uint32_t>(SECTION_LINE_STARTS);
+        if (lines[0] != 0)
+            return false;
+        for (uint32_t i = 1; i < header->line_count; ++i)
+            if (lines[i] < lines[i - 1] || lines[i] > header->source_length)
+                return false;
+
+        // Subtrees nest: each one ends within its parent, the innermost
+        // subtree still open when it starts.
+        std::vector<uint32_t> open;
+        for (FlatAst::Index i = 0; i < header->node_count; ++i) {
+            NodeKind kind = getKind(i);
+            if (getEnd(i) <= i || getEnd(i) > header->node_count || (size_t) kind >= NODE_KIND_COUNT)
+                return false;
+            if ((kind == NodeKind::Identifier || kind == NodeKind::Literal) && getData(i) >= header->string_count)
+                return false;
+            while (!open.empty() && open.back() <= i)
+                open.pop_back();
+            if (!open.empty() && getEnd(i) > open.back())
+                return false;
+            open.push_back(getEnd(i));
+        }
+        return true;
+    }
+
+    MappedFile m_file;
+    std::vector<char> m_memory;
+    const Header* m_header;
+    const char* m_base;
+};
+
+// Operator table for the expression parser. Precedences follow the
+// ECMAScript grammar, lowest first; prefix operators bind tighter than
+// any binary operator.
+namespace operators {
+
+enum Class : uint8_t {
+    None,
+    Binary,
+    Logical,
+    Assignment,
+};
+
+struct Info {
+    uint8_t precedence;
+    Class cls;
+    bool right;
+};
+
+constexpr uint8_t SEQUENCE = 1;
+constexpr uint8_t CONDITIONAL = 2;
+constexpr uint8_t COALESCE = 3;
+constexpr uint8_t PREFIX = 16;
+
+struct Entry {
+    TokenType type;
+    Info info;
+};
+
+constexpr Entry LIST[] = {
+    { TokenType::Equal, { 2, Assignment, true } },
+    { TokenType::PlusEqual, { 2, Assignment, true } },
+    { TokenType::DashEqual, { 2, Assignment, true } },
+    { TokenType::AsteriskEqual, { 2, Assignment, true } },
+    { TokenType::SlashEqual, { 2, Assignment, true } },
+    { TokenType::PercentEqual, { 2, Assignment, true } },
+    { TokenType::AsteriskAsteriskEqual, { 2, Assignment, true } },
+    { TokenType::ShiftLeftEqual, { 2, Assignment, true } },
+    { TokenType::ShiftRightEqual, { 2, Assignment, true } },
+    { TokenType::UnsignedShiftRightEqual, { 2, Assignment, true } },
+    { TokenType::AmpersandEqual, { 2, Assignment, true } },
+    { TokenType::PipeEqual, { 2, Assignment, true } },
+    { TokenType::CarotEqual, { 2, Assignment, true } },
+    { TokenType::AmpersandAmpersandEqual, { 2, Assignment, true } },
+    { TokenType::PipePipeEqual, { 2, Assignment, true } },
+    { TokenType::QuestionQuestionEqual, { 2, Assignment, true } },
+    { TokenType::QuestionQuestion, { 3, Logical, false } },
+    { TokenType::PipePipe, { 4, Logical, false } },
+    { TokenType::AmpersandAmpersand, { 5, Logical, false } },
+    { TokenType::Pipe, { 6, Binary, false } },
+    { TokenType::Carot, { 7, Binary, false } },
+    { TokenType::Ampersand, { 8, Binary, false } },
+    { TokenType::EqualEqual, { 9, Binary, false } },
+    { TokenType::ExclamationEqual, { 9, Binary, false } },
+    { TokenType::EqualEqualEqual, { 9, Binary, false } },
+    { TokenType::ExclamationEqualEqual, { 9, Binary, false } },
+    { TokenType::OpenAngleBracket, { 10, Binary, false } },
+    { TokenType::CloseAngleBracket, { 10, Binary, false } },
+    { TokenType::LessEqual, { 10, Binary, false } },
+    { TokenType::GreaterEqual, { 10, Binary, false } },
+    { TokenType::KwInstanceof, { 10, Binary, false } },
+    { TokenType::KwIn, { 10, Binary, false } },
+    { TokenType::ShiftLeft, { 11, Binary, false } },
+    { TokenType::ShiftRight, { 11, Binary, false } },
+    { TokenType::UnsignedShiftRight, { 11, Binary, false } },
+    { TokenType::Plus, { 12, Binary, false } },
+    { TokenType::Dash, { 12, Binary, false } },
+    { TokenType::Asterisk, { 13, Binary, false } },
+    { TokenType::Slash, { 13, Binary, false } },
+    { TokenType::Percent, { 13, Binary, false } },
+    { TokenType::AsteriskAsterisk, { 14, Binary, true } },
+};
+
+struct Table {
+    Info infix[256];
+    bool prefix[256];
+};
+
+constexpr Table build() {
+    Table table = {};
+    for (const Entry& entry : LIST)
+        table.infix[entry.type] = entry.info;
+    for (TokenType type : { TokenType::Exclamation, TokenType::Tilde, TokenType::Plus, TokenType::Dash,
+                            TokenType::PlusPlus, TokenType::DashDash, TokenType::KwTypeof,
+                            TokenType::KwVoid, TokenType::KwDelete, TokenType::KwAwait })
+        table.prefix[type] = true;
+    return table;
+}
+
+constexpr Table TABLE = build();
+
+constexpr const Info& infix(TokenType type) { return TABLE.infix[type]; }
+
+constexpr bool is_prefix(TokenType type) { return TABLE.prefix[type]; }
+
+// The source spelling of an operator token, for printing.
+const char* text(TokenType type) {
+    for (const punctuators::Punctuator& punctuator : punctuators::LIST)
+        if (punctuator.type == type)
+            return punctuator.text;
+    for (const keywords::Keyword& keyword : keywords::LIST)
+        if (keyword.type == type)
+            return keyword.text;
+    return "?";
+}
+
+}
+
+// Bits of the options word that change what a parse produces; they are
+// part of the parse cache key.
+enum ParseOptions : uint64_t {
+    PARSE_LAZY_FUNCTIONS = 1 << 0,
+};
+
+// Tree builders
+//
+// The parser makes every node through a builder, so one grammar produces
+// either tree. It holds nodes only as the builder's handles, asks the
+// builder the little it needs to know about one (its kind and location),
+// and passes each node's children in already built.
+
+// Allocates the pointer tree in an AstArena.
+class TreeBuilder {
+public:
+    using ExpressionT = Expression*;
+    using StatementT = Statement*;
+    using IdentifierT = Identifier*;
+    using LiteralT = Literal*;
+    using BlockT = BlockStatement*;
+    using FunctionT = FunctionDeclarationStatement*;
+
+    // An argument as the parser gathers it on its stack.
+    struct Argument {
+        Identifier* id;
+        Expression* value;
+    };
+
+    // Failed statements are left in the arena; nothing refers to them.
+    struct Mark {};
+
+    Mark mark() { return Mark {}; }
+
+    void rewind(Mark) {}
+
+    NodeKind getKind(Node* node) { return node->getKind(); }
+
+    Location getLocation(Node* node) { return node->getLocation(); }
+
+    Identifier* identifier(Atom name, Location location) {
+        return m_arena.make<Identifier>(name, location);
+    }
+
+    Literal* literal(std::string_view value, Atom atom, Location location) {
+        return m_arena.make<Literal>(value, atom, location);
+    }
+
+    Expression* unary(TokenType op, Expression* argument, Location location) {
+        return m_arena.make<UnaryExpression>(op, argument, location);
+    }
+
+    Expression* update(TokenType op, bool prefix, Expression* argument, Location location) {
+        return m_arena.make<UpdateExpression>(op, prefix, argument, location);
+    }
+
+    // Binary, logical or assignment, by the operator's class.
+    Expression* infix(TokenType op, Expression* left, Expression* right, Location location) {
+        switch (operators::infix(op).cls) {
+            case operators::Assignment:
+                return m_arena.make<AssignmentExpression>(op, left, right, location);
+            case operators::Logical:
+                return m_arena.make<LogicalExpression>(op, left, right, location);
+            default:
+                return m_arena.make<BinaryExpression>(op, left, right, location);
+        }
+    }
+
+    Expression* conditional(Expression* test, Expression* consequent, Expression* alternate, Location location) {
+        return m_arena.make<ConditionalExpression>(test, consequent, alternate, location);
+    }
+
+    Expression* member(Expression* object, Expression* property, bool computed, bool optional, Location location) {
+        return m_arena.make<MemberExpression>(object, property, computed, optional, location);
+    }
+
+    Expression* call(Expression* callee, Expression* const* arguments, size_t count, bool optional, Location location) {
+        Expression** items = copy(arguments, count);
+        if (items == nullptr && count != 0)
+            return nullptr;
+        return m_arena.make<CallExpression>(callee, items, count, optional, location);
+    }
+
+    Expression* array(Expression* const* elements, size_t count, Location location) {
+        Expression** items = copy(elements, count);
+        if (items == nullptr && count != 0)
+            return nullptr;
+        return m_arena.make<ArrayExpression>(items, count, location);
+    }
+
+    Expression* function_expression(FunctionDeclarationStatement* function, Location location) {
+        return m_arena.make<FunctionExpression>(function, location);
+    }
+
+    Expression* sequence(Expression* const* expressions, size_t count, Location location) {
+        Expression** items = copy(expressions, count);
+        if (items == nullptr)
+            return nullptr;
+        return m_arena.make<SequenceExpression>(items, count, location);
+    }
+
+    FunctionDeclarationStatement* function(Identifier* id, bool async, bool generator, const Argument* arguments, size_t count,
+                                           BlockStatement* body, uint32_t body_start, uint32_t body_end, Location location) {
+        FunctionArgument* args = nullptr;
+        if (count != 0) {
+            args = m_arena.make_array<FunctionArgument>(count);
+            if (args == nullptr)
+                return nullptr;
+            for (size_t i = 0; i < count; ++i)
+                new (args + i) FunctionArgument(*arguments[i].id, arguments[i].value);
+        }
+        return m_arena.make<FunctionDeclarationStatement>(*id, async, generator, args, count, body, body_start, body_end, location);
+    }
+
+    BlockStatement* block(Statement* const* statements, size_t count, Location location) {
+        Statement** body = copy(statements, count);
+        if (body == nullptr && count != 0)
+            return nullptr;
+        return m_arena.make<BlockStatement>(body, count, location);
+    }
+
+    Statement* return_statement(Expression* argument, Location location) {
+        return m_arena.make<ReturnStatement>(argument, location);
+    }
+
+    Statement* expression_statement(Expression* expression, Location location) {
+        return m_arena.make<ExpressionStatement>(expression, location);
+    }
+
+    Statement* if_statement(Expression* test, Statement* body, Statement* alternate, Location location) {
+        return m_arena.make<IfStatement>(test, body, alternate, location);
+    }
+
+    Statement* while_statement(Expression* test, Statement* body, Location location) {
+        return m_arena.make<WhileStatement>(test, body, location);
+    }
+
+    Statement* debugger_statement(Location location) {
+        return m_arena.make<DebuggerStatement>(location);
+    }
+
+    Statement* empty_statement(Location location) {
+        return m_arena.make<EmptyStatement>(location);
+    }
+
+    AstArena& getArena() { return m_arena; }
+
+#ifdef JS_PARSER_STATS
+    void record_stats(ParseStats* stats) {
+        stats->nodes += m_arena.getNodeCount();
+        stats->allocations += m_arena.getBlockCount();
+        stats->arena_bytes += m_arena.getReserved();
+    }
+#endif
+
+private:
+    // Node lists are gathered on the parser's stacks and copied into the
+    // arena once their length is known.
+    template <typename T>
+    T** copy(T* const* items, size_t count) {
+        T** array = m_arena.make_array<T*>(count);
+        if (array != nullptr)
+            std::copy(items, items + count, array);
+        return array;
+    }
+
+    AstArena m_arena;
+};
+
+// Appends nodes to a FlatAst as they are reduced, which is children first;
+// parse_flat reorders the arrays into pre-order at the end. A handle is a
+// node's index. Every subtree is a contiguous run ending at its root, so a
+// parent only records where its first child's run starts, and the nodes of
+// a statement that fails can be cut off the end. Nothing else is
+// allocated, so the pointer tree never exists.
+class FlatBuilder {
+public:
+    class Handle {
+    public:
+        Handle() : m_index(FlatAst::NONE) {}
+
+        Handle(std::nullptr_t) : m_index(FlatAst::NONE) {}
+
+        explicit Handle(FlatAst::Index index) : m_index(index) {}
+
+        explicit operator bool() const { return m_index != FlatAst::NONE; }
+
+        bool operator==(std::nullptr_t) const { return m_index == FlatAst::NONE; }
+
+        FlatAst::Index getIndex() const { return m_index; }
+
+    private:
+        FlatAst::Index m_index;
+    };
+
+    using ExpressionT = Handle;
+    using StatementT = Handle;
+    using IdentifierT = Handle;
+    using LiteralT = Handle;
+    using BlockT = Handle;
+    using FunctionT = Handle;
+
+    struct Argument {
+        Handle id;
+        Handle value;
+    };
+
+    using Mark = FlatAst::Mark;
+
+    FlatBuilder()
+        : m_out(nullptr) {}
+
+    void setOutput(FlatAst* out) { m_out = out; }
+
+    Mark mark() { return m_out->mark(); }
+
+    void rewind(Mark mark) { m_out->truncate(mark); }
+
+    NodeKind getKind(Handle node) { return m_out->getKind(node.getIndex()); }
+
+    Location getLocation(Handle node) { return m_out->getLocation(node.getIndex()); }
+
+    Handle identifier(Atom name, Location location) {
+        return leaf(NodeKind::Identifier, location, name);
+    }
+
+    Handle literal(std::string_view value, Atom atom, Location location) {
+        return Handle(m_out->append_literal(location.getCursor(), (uint32_t) value.size(), atom));
+    }
+
+    Handle unary(TokenType op, Handle argument, Location location) {
+        return parent(NodeKind::UnaryExpression, location, argument, op);
+    }
+
+    Handle update(TokenType op, bool prefix, Handle argument, Location location) {
+        return parent(NodeKind::UpdateExpression, location, argument, op, prefix ? FlatAst::FLAG_PREFIX : 0);
+    }
+
+    Handle infix(TokenType op, Handle left, Handle, Location location) {
+        switch (operators::infix(op).cls) {
+            case operators::Assignment:
+                return parent(NodeKind::AssignmentExpression, location, left, op);
+            case operators::Logical:
+                return parent(NodeKind::LogicalExpression, location, left, op);
+            default:
+                return parent(NodeKind::BinaryExpression, location, left, op);
+        }
+    }
+
+    Handle conditional(Handle test, Handle, Handle, Location location) {
+        return parent(NodeKind::ConditionalExpression, location, test);
+    }
+
+    Handle member(Handle object, Handle, bool computed, bool optional, Location location) {
+        return parent(NodeKind::MemberExpression, location, object, 0,
+                      (computed ? FlatAst::FLAG_COMPUTED : 0) | (optional ? FlatAst::FLAG_OPTIONAL : 0));
+    }
+
+    Handle call(Handle callee, const Handle*, size_t, bool optional, Location location) {
+        return parent(NodeKind::CallExpression, location, callee, 0, optional ? FlatAst::FLAG_OPTIONAL : 0);
+    }
+
+    Handle array(const Handle* elements, size_t count, Location location) {
+        return parent(NodeKind::ArrayExpression, location, count ? elements[0] : nullptr);
+    }
+
+    Handle function_expression(Handle function, Location location) {
+        return parent(NodeKind::FunctionExpression, location, function);
+    }
+
+    Handle sequence(const Handle* expressions, size_t, Location location) {
+        return parent(NodeKind::SequenceExpression, location, expressions[0]);
+    }
+
+    // The identifiers are already in; a default value just flags one.
+    Handle function(Handle id, bool async, bool generator, const Argument* arguments, size_t count, Handle body, uint32_t, uint32_t,
+                    Location location) {
+        for (size_t i = 0; i < count; ++i) {
+            FlatAst::Index index = arguments[i].id.getIndex();
+            if (arguments[i].value)
+                m_out->setFlags(index, m_out->getFlags(index) | FlatAst::FLAG_HAS_DEFAULT);
+        }
+        uint8_t flags = (async ? FlatAst::FLAG_ASYNC : 0) | (generator ? FlatAst::FLAG_GENERATOR : 0) | (body ? 0 : FlatAst::FLAG_LAZY);
+        return parent(NodeKind::FunctionDeclarationStatement, location, id, (uint32_t) count, flags);
+    }
+
+    Handle block(const Handle* statements, size_t count, Location location) {
+        return parent(NodeKind::BlockStatement, location, count ? statements[0] : nullptr);
+    }
+
+    Handle return_statement(Handle argument, Location location) {
+        return parent(NodeKind::ReturnStatement, location, argument);
+    }
+
+    Handle expression_statement(Handle expression, Location location) {
+        return parent(NodeKind::ExpressionStatement, location, expression);
+    }
+
+    Handle if_statement(Handle test, Handle, Handle, Location location) {
+        return parent(NodeKind::IfStatement, location, test);
+    }
+
+    Handle while_statement(Handle test, Handle, Location location) {
+        return parent(NodeKind::WhileStatement, location, test);
+    }
+
+    Handle debugger_statement(Location location) {
+        return leaf(NodeKind::DebuggerStatement, location);
+    }
+
+    Handle empty_statement(Location location) {
+        return leaf(NodeKind::EmptyStatement, location);
+    }
+
+#ifdef JS_PARSER_STATS
+    void record_stats(ParseStats* stats) {
+        stats->nodes += m_out->size();
+        stats->allocations += m_out->getAllocationCount();
+        stats->arena_bytes += m_out->memoryUsage();
+    }
+#endif
+
+private:
+    Handle leaf(NodeKind kind, Location location, uint32_t data = 0) {
+        return Handle(m_out->append(kind, location.getCursor(), FlatAst::NONE, data));
+    }
+
+    // `first` is the first child present, or null when there is none.
+    Handle parent(NodeKind kind, Location location, Handle first, uint32_t data = 0, uint8_t flags = 0) {
+        FlatAst::Index start = first ? m_out->getEnd(first.getIndex()) : FlatAst::NONE;
+        return Handle(m_out->append(kind, location.getCursor(), start, data, flags));
+    }
+
+    FlatAst* m_out;
+};
+
+// Parser
+//
+// Recursive descent over statements and operator precedence over
+// expressions, building nodes through `Builder` (see the tree builders):
+// Parser makes the pointer tree and FlatParser the flat one.
+template <typename Builder>
+class BasicParser {
+public:
+    // Bump whenever the trees produced for the same input change; cached
+    // parse results are keyed on it.
+    static constexpr uint32_t VERSION = 6;
+
+    using ExpressionT = typename Builder::ExpressionT;
+    using StatementT = typename Builder::StatementT;
+    using IdentifierT = typename Builder::IdentifierT;
+    using LiteralT = typename Builder::LiteralT;
+    using BlockT = typename Builder::BlockT;
+    using FunctionT = typename Builder::FunctionT;
+
+private:
+    // Binary, logical and assignment operators all come from the
+    // operators table.
+    bool isBinaryType(Lexer::TokenType type) {
+        return operators::infix(type).precedence != 0;
+    }
+
+public:
+    // Tokens reach the parser through a small ring, filled on demand either
+    // from a lexed TokenStream or straight from a Lexer. Streaming from the
+    // lexer keeps token memory constant and hands each token over while it
+    // is still in cache.
+    static constexpr size_t LOOKAHEAD = 16;
+
+    BasicParser(Lexer::TokenStream* tokens)
+        : m_tokens(tokens),
+          m_lexer(nullptr),
+          m_input(tokens->getSource().getData()),
+          m_file_id(tokens->getFileId()),
+          m_atom_table(tokens->shareAtomTable()),
+          m_fetched(0),
+          m_exhausted(false),
+          m_end { TokenType::Semicolon, (uint32_t) tokens->getSource().getLength(), 0, AtomTable::NONE },
+          m_lazy(false),
+          m_diagnostics(nullptr),
+          m_errors(0),
+          m_previous(0),
+          m_cursor(0) {}
+
+    BasicParser(Lexer* lexer)
+        : m_tokens(nullptr),
+          m_lexer(lexer),
+          m_input(lexer->getSource().getData()),
+          m_file_id(lexer->getFile()->getId()),
+          m_atom_table(lexer->shareAtomTable()),
+          m_fetched(0),
+          m_exhausted(false),
+          m_end { TokenType::Semicolon, (uint32_t) lexer->getSource().getLength(), 0, AtomTable::NONE },
+          m_lazy(false),
+          m_diagnostics(lexer->getDiagnostics()),
+          m_errors(0),
+          m_previous(0),
+          m_cursor(0) {
+        setStats(lexer->getStats());
+    }
+
+    // Lazy parses skip function bodies; see parse_lazy_body.
+    void setLazy(bool lazy) { m_lazy = lazy; }
+
+    void setOptions(uint64_t options) { m_lazy = (options & PARSE_LAZY_FUNCTIONS) != 0; }
+
+    // Collects reports into `sink` instead of printing them.
+    void setDiagnostics(DiagnosticSink* sink) { m_diagnostics = sink; }
+
+    // Adds parse time, nodes, arena (or flat array) use and diagnostics to
+    // `stats`; a streaming parser adds the tokens too. A parser on a Lexer
+    // starts out with the lexer's stats.
+    void setStats(ParseStats* stats) {
+        JS_STAT(m_stats = stats;)
+        (void) stats;
+    }
+
+    ~BasicParser() {}
+
+    // Errors are counted here as well as in the sink: a statement that
+    // recovered from an error inside it still comes back non-null. Errors
+    // met at an Error token follow from what the lexer already reported.
+    void report(DiagnosticCode code, std::string_view message, uint32_t start, uint32_t end) {
+        ++m_errors;
+        if (token(m_cursor).type == Lexer::TokenType::Error)
+            return;
+        JS_STAT(if (m_stats != nullptr) ++m_stats->diagnostics;)
+        report_diagnostic(m_diagnostics, code, Severity::Error, m_file_id, start, end, message);
+    }
+
+    void report(DiagnosticCode code, std::string_view message, Location location) {
+        report(code, message, location.getCursor(), location.getCursor());
+    }
+
+    // Points at the whole current token.
+    void report(DiagnosticCode code, std::string_view message) {
+        const Lexer::RawToken& raw = token(m_cursor);
+        report(code, message, raw.start, raw.start + raw.length);
+    }
+
+    size_t getErrorCount() { return m_errors; }
+
+    // Once the sink is full there is no point in recovering any further,
+    // nor once nesting went too deep.
+    bool isCapped() { return m_too_deep || (m_diagnostics != nullptr && m_diagnostics->isFull()); }
+
+    bool is_eof() {
+        return m_cursor >= m_fetched && !fill(m_cursor);
+    }
+
+    // Lookahead reads the ring in place rather than materializing Token
+    // values.
+    Lexer::TokenType currentType() {
+        return token(m_cursor).type;
+    }
+
+    std::string_view currentSlice() {
+        return tokenSlice(m_cursor);
+    }
+
+    Location currentLocation() {
+        return tokenLocation(m_cursor);
+    }
+
+    Lexer::TokenType peekType() {
+        if (m_cursor + 1 >= m_fetched && !fill(m_cursor + 1)) {
+            report(DiagnosticCode::UnexpectedEnd, "EOF hit which is unexpected", currentLocation());
+            return currentType();
+        }
+        return token(m_cursor + 1).type;
+    }
+
+    // Indices are absolute token numbers; only the last LOOKAHEAD fetched
+    // tokens are still available. Past the end of input the token is an
+    // empty one at the end of the source.
+    const Lexer::RawToken& token(size_t index) {
+        if (index >= m_fetched && !fill(index))
+            return m_end;
+        assert(index + LOOKAHEAD > m_fetched && "token already left the lookahead ring");
+        return m_ring[index & (LOOKAHEAD - 1)];
+    }
+
+    std::string_view tokenSlice(size_t index) {
+        const Lexer::RawToken& raw = token(index);
+        return std::string_view(m_input + raw.start, raw.length);
+    }
+
+    Location tokenLocation(size_t index) {
+        return Location(m_file_id, token(index).start);
+    }
+
+    // Whether a line break, possibly inside a comment, comes between the
+    // last token consumed and the current one. Statements may end there,
+    // and `return` and postfix `++`/`--` may not reach across it.
+    bool newline_before() {
+        return m_previous != m_cursor && newline_between(m_previous, m_cursor);
+    }
+
+    bool newline_between(size_t first, size_t second) {
+        const Lexer::RawToken& before = token(first);
+        uint32_t from = before.start + before.length;
+        uint32_t to = token(second).start;
+        for (uint32_t i = from; i < to; ++i) {
+            if (m_input[i] == '\n' || m_input[i] == '\r')
+                return true;
+        }
+        return false;
+    }
+
+    // Whether the current token may stand as a name; contextual words may
+    // (see Lexer::isContextual).
+    bool is_name() {
+        return currentType() == TokenType::Identifier || Lexer::isContextual(currentType());
+    }
+
+    // `async` starts a function only with `function` after it on the same
+    // line; otherwise it is a name, as in `async.map(a, b)`.
+    bool async_function_ahead() {
+        return currentType() == TokenType::KwAsync && token(m_cursor + 1).type == TokenType::KwFunction
+            && !newline_between(m_cursor, m_cursor + 1);
+    }
+
+    // `let` starts a declaration when a binding follows it; otherwise it
+    // is a name, as in `let = 1`.
+    bool let_declaration_ahead() {
+        TokenType next = token(m_cursor + 1).type;
+        return currentType() == TokenType::KwLet && (next == TokenType::Identifier || Lexer::isContextual(next)
+                                                     || next == TokenType::OpenSquareBracket || next == TokenType::OpenBracket);
+    }
+
+    // A statement ends at `;`, or without one before `}`, the end of input
+    // or a line break; anything else on the same line is an error.
+    bool consume_semicolon() {
+        if (try_consume(Lexer::TokenType::Semicolon, nullptr))
+            return true;
+        if (is_eof() || currentType() == Lexer::TokenType::CloseBracket || newline_before())
+            return true;
+        report(DiagnosticCode::ExpectedToken, std::format("Expected ';' before '{}'", currentSlice()));
+        return false;
+    }
+
+    bool try_consume(Lexer::TokenType type, const char* data) {
+        if (is_eof())
+            return false;
+
+        if (currentType() != type || (data != nullptr && currentSlice() != data)) 
+            return false;
+    
+        m_previous = m_cursor++;
+        return true;
+    }
+
+    bool consume(Lexer::Token* out, Lexer::TokenType type, const char* data) {    
+        if (is_eof())
+            return false;
+
+        if (currentType() != type) 
+            return false;
+
+        if (data != nullptr && currentSlice() != data) 
+            return false;
+
+        if (out != nullptr)
+            *out = Lexer::Token(currentType(), currentSlice(), currentLocation());
+        m_previous = m_cursor++;
+        return true;
+    }
+
+    bool consume(Lexer::TokenType type) {    
+        return consume(nullptr, type, nullptr);
+    }
+
+    bool consume(Lexer::TokenType type, const char* data) {    
+        return consume(nullptr, type, data);
+    }
+
+    // `async? function *? name? (args) { body }`. Declarations need a
+    // name; expressions may leave it out.
+    FunctionT parse_function(bool require_name) {
+        if (!enter_nesting())
+            return nullptr;
+        Nesting nesting { this };
+        Location location = currentLocation();
+        bool async = try_consume(Lexer::TokenType::KwAsync, nullptr);
+        if (!consume(Lexer::TokenType::KwFunction)) {
+            report(DiagnosticCode::ExpectedToken, "Expected 'function'");
+            return nullptr;
+        }
+        bool generator = try_consume(Lexer::TokenType::Asterisk, nullptr);
+
+        IdentifierT id;
+        if (require_name || (!is_eof() && is_name()))
+            id = parse_identifier();
+        else
+            id = m_builder.identifier(AtomTable::NONE, currentLocation());
+        if (id == nullptr)
+            return nullptr;
+
+        // Arguments wait on m_arguments, those of functions nested in
+        // default values or the body above them.
+        size_t base = m_arguments.size();
+        if (!parse_function_args_list()) {
+            m_arguments.resize(base);
+            return nullptr;
+        }
+
+        uint32_t body_start = 0, body_end = 0;
+        BlockT body = nullptr;
+        size_t body_token = m_cursor;
+        bool skipped = false;
+        if (m_lazy && !skip_function_body(&body_start, &body_end, &skipped) && skipped) {
+            m_arguments.resize(base);
+            return nullptr;
+        }
+        if (!skipped) {
+            // Brackets that did not balance are parsed after all, to report
+            // what is wrong with them.
+            if (m_lazy)
+                rewind(body_token, body_start);
+            body_start = token(m_cursor).start;
+            bool outer_async = m_in_async, outer_generator = m_in_generator;
+            m_in_async = async;
+            m_in_generator = generator;
+            body = parse_block_statement();
+            m_in_async = outer_async;
+            m_in_generator = outer_generator;
+            if (body == nullptr) {
+                m_arguments.resize(base);
+                return nullptr;
+            }
+            body_end = token(m_previous).start + 1;
+        }
+        FunctionT function = m_builder.function(id, async, generator, m_arguments.data() + base, m_arguments.size() - base, body,
+                                                body_start, body_end, location);
+        m_arguments.resize(base);
+        return function;
+    }
+
+    FunctionT parse_function_statement()  {
+        return parse_function(true);
+    }
+
+    // `(a, b = 1, c,)`, onto m_arguments.
+    bool parse_function_args_list() {
+        if (!consume(Lexer::TokenType::OpenParen)) {
+            report(DiagnosticCode::ExpectedToken, "Expected '(' before function arguments");
+            return false;
+        }
+        while (!is_eof() && currentType() != Lexer::TokenType::CloseParen) {
+            IdentifierT id = parse_identifier();
+            if (id == nullptr)
+                return false;
+            ExpressionT value = nullptr;
+            if (try_consume(Lexer::TokenType::Equal, nullptr)) {
+                value = parse_expression(false);
+                if (value == nullptr)
+                    return false;
+            }
+            m_arguments.push_back(typename Builder::Argument { id, value });
+            if (!try_consume(Lexer::TokenType::Comma, nullptr))
+                break;
+        }
+        if (!consume(Lexer::TokenType::CloseParen)) {
+            report(DiagnosticCode::ExpectedToken, "Expected ')' after function arguments");
+            return false;
+        }
+        return true;
+    }
+
+    // Pre-parser for lazy functions: finds the end of the body by bracket
+    // matching alone and builds nothing. Strings, templates and regular
+    // expressions are single tokens, so brackets inside them never get
+    // here. Only the source span of the body is kept. `skipped` is set
+    // unless the brackets did not balance, which leaves the body to an
+    // eager parse: it says what went wrong, often a regex the lexer took
+    // for division (see Lexer::regex_may_follow), whose brackets counted.
+    // Bodies the lexer failed in are reported here instead, since lexing
+    // them again would report those errors twice.
+    bool skip_function_body(uint32_t* start, uint32_t* end, bool* skipped) {
+        *skipped = true;
+        if (is_eof() || currentType() != Lexer::TokenType::OpenBracket) {
+            report(DiagnosticCode::ExpectedToken, "Expected '{' before function body");
+            return false;
+        }
+        *start = token(m_cursor).start;
+        size_t errors = m_errors;
+        m_brackets.clear();
+        do {
+            if (is_eof()) {
+                if (m_errors == errors) {
+                    *skipped = false;
+                    return false;
+                }
+                report(DiagnosticCode::UnexpectedEnd, "Unterminated function body", Location(m_file_id, *start));
+                return false;
+            }
+            Lexer::TokenType type = currentType();
+            switch (type) {
+                case Lexer::TokenType::OpenBracket:
+                    m_brackets.push_back(Lexer::TokenType::CloseBracket);
+                    break;
+                case Lexer::TokenType::OpenParen:
+                    m_brackets.push_back(Lexer::TokenType::CloseParen);
+                    break;
+                case Lexer::TokenType::OpenSquareBracket:
+                    m_brackets.push_back(Lexer::TokenType::CloseSquareBracket);
+                    break;
+                case Lexer::TokenType::CloseBracket:
+                case Lexer::TokenType::CloseParen:
+                case Lexer::TokenType::CloseSquareBracket:
+                    if (m_brackets.back() != type) {
+                        if (m_errors == errors) {
+                            *skipped = false;
+                            return false;
+                        }
+                        report(DiagnosticCode::UnbalancedBracket, std::format("Mismatched {} in function body", Lexer::TokenTypeName(type)));
+                        return false;
+                    }
+                    m_brackets.pop_back();
+                    break;
+                // Reported by the lexer, but the body must not pass.
+                case Lexer::TokenType::Error:
+                    ++m_errors;
+                    break;
+                default:
+                    break;
+            }
+            m_previous = m_cursor++;
+        } while (!m_brackets.empty());
+        *end = token(m_previous).start + 1;
+        return true;
+    }
+
+    // Parses the body a lazy parse skipped and attaches it to `function`,
+    // allocating into `program`'s arena and interning into its atom table.
+    // `file` is the source `program` was parsed from. Functions nested in
+    // the body stay lazy. Returns the existing body when there is one, and
+    // null when the body has errors; they go to `diagnostics` (or stderr).
+    static BlockStatement* parse_lazy_body(Program* program, const SourceFile* file, FunctionDeclarationStatement* function,
+                                           DiagnosticSink* diagnostics = nullptr) {
+        if (!function->isLazy())
+            return function->getBody();
+        Lexer lexer(file, program->shareAtoms());
+        lexer.setDiagnostics(diagnostics);
+        lexer.seek(function->getBodyStart());
+        BasicParser parser(&lexer);
+        parser.setLazy(true);
+        parser.m_in_async = function->isAsync();
+        parser.m_in_generator = function->isGenerator();
+        BlockStatement* body = parser.parse_block_statement();
+        if (body == nullptr || parser.getErrorCount() != 0 || lexer.hasFailed())
+            return nullptr;
+        program->getArena().absorb(std::move(parser.m_builder.getArena()));
+        function->setBody(body);
+        return body;
+    }
+
+    IdentifierT parse_identifier() {
+        if (is_eof()) {
+            report(DiagnosticCode::UnexpectedEnd, "Failed to get current token.");
+            return nullptr;
+        }
+        size_t index = m_cursor;
+        if (!is_name()) {
+            report(DiagnosticCode::ExpectedToken, std::format("Expected identifier got {}", Lexer::TokenTypeName(currentType())));
+            return nullptr;
+        }
+        m_previous = m_cursor++;
+        return m_builder.identifier(token(index).atom, tokenLocation(index));
+    }
+
+    LiteralT parse_literal() {
+        if (is_eof()) {
+            report(DiagnosticCode::UnexpectedEnd, "Failed to get current token.");
+            return nullptr;
+        }
+        size_t index = m_cursor;
+        Lexer::TokenType type = currentType();
+        switch (type) {
+            case Lexer::TokenType::Number:
+            case Lexer::TokenType::String:
+            case Lexer::TokenType::Regex:
+            case Lexer::TokenType::Template:
+            case Lexer::TokenType::KwTrue:
+            case Lexer::TokenType::KwFalse:
+            case Lexer::TokenType::KwNull:
+                consume(type);
+                return m_builder.literal(tokenSlice(index), token(index).atom, tokenLocation(index));
+            default:
+                report(DiagnosticCode::ExpectedToken, std::format("Expected either number, string, or literal keyword but got {}", Lexer::TokenTypeName(type)));
+                return nullptr;
+        }
+    }
+
+    BlockT parse_block_statement() {
+        Location location = currentLocation();
+        if (!consume(Lexer::TokenType::OpenBracket)) {
+            report(DiagnosticCode::ExpectedToken, "Expected '{'");
+            return nullptr;
+        }
+        size_t base = m_statements.size();
+        while (!is_eof() && currentType() != Lexer::TokenType::CloseBracket) {
+            typename Builder::Mark mark = m_builder.mark();
+            StatementT statement = this->parse_statement();
+            if (statement == nullptr) {
+                m_builder.rewind(mark);
+                if (isCapped()) {
+                    m_statements.resize(base);
+                    return nullptr;
+                }
+                synchronize(true);
+                continue;
+            }
+            m_statements.push_back(statement);
+        }
+        if (!consume(Lexer::TokenType::CloseBracket)) {
+            report(DiagnosticCode::UnbalancedBracket, "Expected '}' at the end of block", location);
+            m_statements.resize(base);
+            return nullptr;
+        }
+        BlockT block = m_builder.block(m_statements.data() + base, m_statements.size() - base, location);
+        m_statements.resize(base);
+        return block;
+    }
+
+    StatementT parse_return_statement() {
+        Location location = currentLocation();
+        consume(Lexer::TokenType::KwReturn);
+        ExpressionT argument = nullptr;
+        if (!is_eof() && currentType() != Lexer::TokenType::Semicolon && currentType() != Lexer::TokenType::CloseBracket
+            && !newline_before()) {
+            argument = parse_expression();
+            if (argument == nullptr)
+                return nullptr;
+        }
+        if (!consume_semicolon())
+            return nullptr;
+        return m_builder.return_statement(argument, location);
+    } 
+
+    // `(test)` after `if` or `while`.
+    ExpressionT parse_condition() {
+        if (!consume(Lexer::TokenType::OpenParen)) {
+            report(DiagnosticCode::ExpectedToken, "Expected '('");
+            return nullptr;
+        }
+        ExpressionT test = parse_expression();
+        if (test == nullptr)
+            return nullptr;
+        if (!consume(Lexer::TokenType::CloseParen)) {
+            report(DiagnosticCode::ExpectedToken, "Expected ')'");
+            return nullptr;
+        }
+        return test;
+    }
+
+    // VariableDeclarator* parse_variable_declarator() {}
+
+    // VariableDeclarationStatement* parse_variable_declaration() {}
+
+    // Expressions are parsed by operator precedence over explicit stacks:
+    // operands wait on m_operands and pending operators and open brackets
+    // on m_frames. Every token is shifted and reduced once, and nesting
+    // depth costs heap space rather than native stack. The stacks persist
+    // across calls, and each call only touches the entries above where it
+    // started. Without `sequence` a top-level comma ends the expression, as
+    // it must after a default value.
+    ExpressionT parse_expression(bool sequence = true) {
+        size_t frame_base = m_frames.size();
+        size_t operand_base = m_operands.size();
+        ExpressionT expression = parse_expression_stacks(frame_base, operand_base, sequence);
+        m_frames.resize(frame_base);
+        m_operands.resize(operand_base);
+        return expression;
+    }
+
+    // The statement starts at its first token, which for `(a, b);` comes
+    // before its expression.
+    StatementT parse_expression_statement() {
+        Location location = currentLocation();
+        ExpressionT expression = this->parse_expression();
+        if (!expression)
+            return nullptr;
+        return m_builder.expression_statement(expression, location);
+    }
+
+    StatementT parse_if_statement() {
+        Location location = currentLocation();
+        consume(Lexer::TokenType::KwIf);
+        ExpressionT test = parse_condition();
+        if (test == nullptr)
+            return nullptr;
+        StatementT body = parse_statement();
+        if (body == nullptr)
+            return nullptr;
+        StatementT alternate = nullptr;
+        if (try_consume(Lexer::TokenType::KwElse, nullptr)) {
+            alternate = parse_statement();
+            if (alternate == nullptr)
+                return nullptr;
+        }
+        return m_builder.if_statement(test, body, alternate, location);
+    }
+    
+    StatementT parse_while_statement() {
+        Location location = currentLocation();
+        consume(Lexer::TokenType::KwWhile);
+        ExpressionT test = parse_condition();
+        if (test == nullptr)
+            return nullptr;
+        StatementT body = parse_statement();
+        if (body == nullptr)
+            return nullptr;
+        return m_builder.while_statement(test, body, location);
+    }
+    
+    StatementT parse_statement() {
+        if (is_eof() || !enter_nesting())
+            return nullptr;
+        Nesting nesting { this };
+
+        auto location = currentLocation();
+        auto type = currentType();
+        auto slice = currentSlice();
+
+        // Contextual words are names unless they start their construct.
+        if (Lexer::isContextual(type) && !async_function_ahead() && !let_declaration_ahead())
+            type = Lexer::TokenType::Identifier;
+
+        switch (type) {
+            case Lexer::TokenType::KwAsync:
+            case Lexer::TokenType::KwFunction:
+                return this->parse_function_statement();
+
+            case Lexer::TokenType::KwReturn:
+                return this->parse_return_statement();
+
+            case Lexer::TokenType::KwConst:
+            case Lexer::TokenType::KwLet:
+            case Lexer::TokenType::KwVar:
+                report(DiagnosticCode::Unsupported, "Variable declarations are not supported");
+                // return this->parse_variable_declaration();
+                return nullptr;
+
+            case Lexer::TokenType::KwIf:
+                return this->parse_if_statement();
+
+            case Lexer::TokenType::KwWhile:
+                return this->parse_while_statement();
+
+            case Lexer::TokenType::KwDebugger:
+                consume(Lexer::TokenType::KwDebugger);
+                if (!consume_semicolon())
+                    return nullptr;
+                return m_builder.debugger_statement(location);
+
+            case Lexer::TokenType::KwDo:
+            case Lexer::TokenType::KwFor:
+                report(DiagnosticCode::Unsupported, std::format("'{}' loops are not supported", slice));
+                return nullptr;
+
+            case Lexer::TokenType::OpenBracket:
+                return this->parse_block_statement();
+
+            case Lexer::TokenType::Semicolon:
+                consume(Lexer::TokenType::Semicolon);
+                return m_builder.empty_statement(location);
+
+            // Only a regex lexed as division gets here (see
+            // Lexer::regex_may_follow).
+            case Lexer::TokenType::Slash:
+            case Lexer::TokenType::SlashEqual:
+                if (m_previous != m_cursor && (token(m_previous).type == Lexer::TokenType::CloseBracket
+                                               || token(m_previous).type == Lexer::TokenType::CloseParen)) {
+                    report(DiagnosticCode::Unsupported, std::format("A regular expression cannot start a statement right after '{}'; wrap it in parentheses",
+                                                                    tokenSlice(m_previous)));
+                    return nullptr;
+                }
+                break;
+
+            case Lexer::TokenType::Identifier:
+            case Lexer::TokenType::String:
+            case Lexer::TokenType::Number:
+            case Lexer::TokenType::Regex:
+            case Lexer::TokenType::Template:
+            case Lexer::TokenType::KwTrue:
+            case Lexer::TokenType::KwFalse:
+            case Lexer::TokenType::KwNull:
+            case Lexer::TokenType::Period:
+            case Lexer::TokenType::Equal:
+            case Lexer::TokenType::OpenSquareBracket:
+            case Lexer::TokenType::Plus:
+            case Lexer::TokenType::Dash:
+            case Lexer::TokenType::Percent:
+            case Lexer::TokenType::OpenParen:
+            case Lexer::TokenType::Exclamation:
+            case Lexer::TokenType::Tilde:
+            case Lexer::TokenType::PlusPlus:
+            case Lexer::TokenType::DashDash:
+            case Lexer::TokenType::KwTypeof:
+            case Lexer::TokenType::KwVoid:
+            case Lexer::TokenType::KwDelete:
+            case Lexer::TokenType::KwNew:
+            case Lexer::TokenType::KwThis:
+            case Lexer::TokenType::KwSuper: {
+                StatementT statement = this->parse_expression_statement();
+                if (statement == nullptr || !consume_semicolon())
+                    return nullptr;
+                return statement;
+            }
+
+            default:
+                break;
+        }
+
+        if (Lexer::isKeyword(type)) {
+            report(DiagnosticCode::Unsupported, std::format("'{}' statements are not supported", slice));
+            return nullptr;
+        }
+
+        report(DiagnosticCode::UnexpectedToken, std::format("Unexpected '{}' at the start of a statement", slice));
+        return nullptr;
+    }
+
+    // Incremental re-parsing (see Document) parses single statements from
+    // an arbitrary token of a TokenStream and keeps their nodes.
+    void seek_token(size_t index) {
+        assert(m_tokens != nullptr && "only a token stream can be re-read");
+        m_previous = m_cursor = m_fetched = index;
+        m_exhausted = false;
+    }
+
+    size_t getTokenIndex() { return m_cursor; }
+
+    // Skips past a statement parse_statement gave up on, as
+    // parse_statements does, so that the next one can be parsed.
+    void recover() { synchronize(false); }
+
+    // Goes back to token `index`, which starts at `offset`, relexing from
+    // it when streaming; no lexing errors may lie past it, or the lexer
+    // would report them again.
+    void rewind(size_t index, uint32_t offset) {
+        if (m_lexer != nullptr) {
+            // Only a function body's `{` is rewound to, which follows a `)`.
+            m_lexer->seek(offset, Lexer::RegexState::Divide);
+            m_previous = m_cursor = m_fetched = index;
+            m_exhausted = false;
+        } else {
+            seek_token(index);
+        }
+    }
+
+    bool isAtEnd() { return is_eof(); }
+
+    AstArena takeArena() { return std::move(m_builder.getArena()); }
+
+    // Parser only: the program is only returned when there were no errors.
+    Program* parse() {
+        JS_STAT(PhaseTimer timer(m_stats, &ParseStats::parse_ns);)
+        std::vector<StatementT> statements;
+        if (!parse_statements(&statements))
+            return nullptr;
+        return new Program(std::move(statements), std::move(m_builder.getArena()), m_atom_table);
+    }
+
+    // FlatParser only: parses straight into `out`, which is only valid
+    // when this returns true.
+    bool parse_flat(FlatAst* out) {
+        JS_STAT(PhaseTimer timer(m_stats, &ParseStats::parse_ns);)
+        out->reset(m_file_id, m_tokens != nullptr ? m_tokens->getSource() : m_lexer->getSource(), m_atom_table);
+        m_builder.setOutput(out);
+        std::vector<StatementT> statements;
+        if (!parse_statements(&statements))
+            return false;
+        out->setRootCount(statements.size());
+        out->finish_postorder();
+        return true;
+    }
+
+private:
+    // Statements and function bodies nest by native recursion, unlike
+    // expressions; past this depth the parser stops with an error rather
+    // than run out of stack (1 MiB on Windows threads).
+    static constexpr size_t MAX_NESTING = 1000;
+
+    // Counts a statement or function entered; false, once reported, when
+    // that goes past MAX_NESTING. Nesting leaves it again.
+    bool enter_nesting() {
+        if (m_depth < MAX_NESTING) {
+            ++m_depth;
+            return true;
+        }
+        if (!m_too_deep)
+            report(DiagnosticCode::NestingTooDeep, std::format("Statements and functions nested deeper than {} are not supported", MAX_NESTING));
+        m_too_deep = true;
+        return false;
+    }
+
+    struct Nesting {
+        BasicParser* parser;
+        ~Nesting() { --parser->m_depth; }
+    };
+
+    // Reports every error it can find in one pass: a statement that fails
+    // is dropped, skipped (see synchronize) and parsing goes on.
+    bool parse_statements(std::vector<StatementT>* statements) {
+        bool failed = false;
+        while (!is_eof() && !isCapped()) {
+            typename Builder::Mark mark = m_builder.mark();
+            StatementT statement = this->parse_statement();
+            if (statement == nullptr) {
+                m_builder.rewind(mark);
+                failed = true;
+                synchronize(false);
+                continue;
+            }
+            statements->push_back(statement);
+        }
+        JS_STAT(record_stats();)
+        // A capped parse left the rest unread. The lexer has reported its
+        // errors, and the Error tokens may all have been skipped without a
+        // word; a full sink may even have kept the loop from running.
+        if (failed || m_errors != 0 || isCapped() || m_lex_failed)
+            return false;
+        return m_lexer == nullptr || !m_lexer->hasFailed();
+    }
+
+#ifdef JS_PARSER_STATS
+    void record_stats() {
+        if (m_stats == nullptr)
+            return;
+        if (m_lexer != nullptr)
+            m_stats->tokens += m_fetched;
+        m_builder.record_stats(m_stats);
+    }
+#endif
+
+    // Panic-mode recovery once a statement has failed: skips to just past
+    // the next `;`, or the `}` closing a brace opened while skipping. A
+    // stray `}` ends the skip too; inside a block (`in_block`) it is left
+    // for the block, since it closes it. So does an Error token, which
+    // runs to the end of a line. Always moves on at least one token
+    // otherwise, so garbage costs linear time.
+    void synchronize(bool in_block) {
+        size_t depth = 0;
+        while (!is_eof()) {
+            Lexer::TokenType type = currentType();
+            if (type == Lexer::TokenType::CloseBracket && depth == 0 && in_block)
+                return;
+            m_previous = m_cursor++;
+            if (type == Lexer::TokenType::Error && depth == 0)
+                return;
+            if (type == Lexer::TokenType::OpenBracket)
+                ++depth;
+            else if (type == Lexer::TokenType::CloseBracket && (depth == 0 || --depth == 0))
+                return;
+            else if (type == Lexer::TokenType::Semicolon && depth == 0)
+                return;
+        }
+    }
+
+    enum class FrameKind : uint8_t {
+        Prefix,         // unary operator or prefix ++/--
+        Infix,          // binary, logical or assignment operator
+        Paren,
+        Call,           // `callee(`; the callee sits just below `base`
+        Index,          // `object[`; the object sits just below `base`
+        Array,          // `[`
+        Conditional,    // `test ?`
+        Alternate,      // `test ? consequent :`
+        Sequence,       // `a,`; the first expression sits at `base`
+    };
+
+    // Brackets and `?` have precedence 0, so operators never reduce past
+    // them; only their closing token does.
+    struct Frame {
+        FrameKind kind;
+        TokenType op;
+        uint8_t precedence;
+        bool optional;
+        uint32_t base;
+        Location location;
+    };
+
+    void push_frame(FrameKind kind, TokenType op, uint8_t precedence, Location location, bool optional = false) {
+        m_frames.push_back(Frame { kind, op, precedence, optional, (uint32_t) m_operands.size(), location });
+    }
+
+    ExpressionT pop_operand() {
+        ExpressionT operand = m_operands.back();
+        m_operands.pop_back();
+        return operand;
+    }
+
+    bool is_assignment_target(ExpressionT expression) {
+        NodeKind kind = m_builder.getKind(expression);
+        return kind == NodeKind::Identifier || kind == NodeKind::MemberExpression;
+    }
+
+    // Pops the top operator frame and replaces its operands with the node.
+    bool reduce() {
+        Frame frame = m_frames.back();
+        m_frames.pop_back();
+        ExpressionT node = nullptr;
+        switch (frame.kind) {
+            case FrameKind::Prefix: {
+                ExpressionT argument = pop_operand();
+                if (frame.op == TokenType::PlusPlus || frame.op == TokenType::DashDash) {
+                    if (!is_assignment_target(argument)) {
+                        report(DiagnosticCode::InvalidTarget, "Invalid update target", m_builder.getLocation(argument));
+                        return false;
+                    }
+                    node = m_builder.update(frame.op, true, argument, frame.location);
+                } else {
+                    node = m_builder.unary(frame.op, argument, frame.location);
+                }
+                break;
+            }
+            case FrameKind::Infix: {
+                ExpressionT right = pop_operand();
+                ExpressionT left = pop_operand();
+                if (operators::infix(frame.op).cls == operators::Assignment && !is_assignment_target(left)) {
+                    report(DiagnosticCode::InvalidTarget, "Invalid assignment target", m_builder.getLocation(left));
+                    return false;
+                }
+                node = m_builder.infix(frame.op, left, right, m_builder.getLocation(left));
+                break;
+            }
+            case FrameKind::Alternate: {
+                ExpressionT alternate = pop_operand();
+                ExpressionT consequent = pop_operand();
+                ExpressionT test = pop_operand();
+                node = m_builder.conditional(test, consequent, alternate, m_builder.getLocation(test));
+                break;
+            }
+            case FrameKind::Sequence: {
+                node = m_builder.sequence(m_operands.data() + frame.base, m_operands.size() - frame.base, frame.location);
+                m_operands.resize(frame.base);
+                break;
+            }
+            default:
+                assert(false && "brackets are closed, not reduced");
+                return false;
+        }
+        if (node == nullptr)
+            return false;
+        m_operands.push_back(node);
+        return true;
+    }
+
+    // Reduces the operators that bind at least as tightly as an incoming
+    // one (strictly tighter when it is right-associative).
+    bool reduce_above(size_t frame_base, uint8_t precedence, bool right) {
+        while (m_frames.size() > frame_base) {
+            uint8_t top = m_frames.back().precedence;
+            if (top == 0 || top < precedence || (top == precedence && right))
+                break;
+            if (!reduce())
+                return false;
+        }
+        return true;
+    }
+
+    // Reduces everything down to the innermost open bracket or `?`.
+    bool reduce_all(size_t frame_base) {
+        return reduce_above(frame_base, 1, false);
+    }
+
+    // The operands above `base` become the list; the callee of a call sits
+    // just below them.
+    bool close_call() {
+        Frame frame = m_frames.back();
+        m_frames.pop_back();
+        ExpressionT callee = m_operands[frame.base - 1];
+        ExpressionT call = m_builder.call(callee, m_operands.data() + frame.base, m_operands.size() - frame.base,
+                                          frame.optional, m_builder.getLocation(callee));
+        m_operands.resize(frame.base - 1);
+        if (call == nullptr)
+            return false;
+        m_operands.push_back(call);
+        return true;
+    }
+
+    bool close_array() {
+        Frame frame = m_frames.back();
+        m_frames.pop_back();
+        ExpressionT array = m_builder.array(m_operands.data() + frame.base, m_operands.size() - frame.base, frame.location);
+        m_operands.resize(frame.base);
+        if (array == nullptr)
+            return false;
+        m_operands.push_back(array);
+        return true;
+    }
+
+    bool close_index() {
+        Frame frame = m_frames.back();
+        m_frames.pop_back();
+        ExpressionT property = pop_operand();
+        ExpressionT object = pop_operand();
+        ExpressionT member = m_builder.member(object, property, true, frame.optional, m_builder.getLocation(object));
+        if (member == nullptr)
+            return false;
+        m_operands.push_back(member);
+        return true;
+    }
+
+    // `.name` after an operand; keywords are valid property names.
+    bool parse_property(bool optional) {
+        size_t index = m_cursor;
+        if (is_eof() || (currentType() != TokenType::Identifier && !Lexer::isKeyword(currentType()))) {
+            report(DiagnosticCode::ExpectedToken, "Expected property name");
+            return false;
+        }
+        m_previous = m_cursor++;
+        Atom name = token(index).atom;
+        if (name == AtomTable::NONE)
+            name = m_atom_table->intern(tokenSlice(index));
+        IdentifierT property = m_builder.identifier(name, tokenLocation(index));
+        if (property == nullptr)
+            return false;
+        ExpressionT object = pop_operand();
+        ExpressionT member = m_builder.member(object, property, false, optional, m_builder.getLocation(object));
+        if (member == nullptr)
+            return false;
+        m_operands.push_back(member);
+        return true;
+    }
+
+    // Whether the innermost open frame of this expression is a `kind`.
+    bool top_frame_is(size_t frame_base, FrameKind kind) {
+        return m_frames.size() > frame_base && m_frames.back().kind == kind;
+    }
+
+    // `??` may not share an unparenthesized operand with `||` or `&&`. Any
+    // such operator still pending above the nearest bracket, `?`, `,` or
+    // assignment ends up as an operand of the incoming one, or the other
+    // way round.
+    bool mixes_coalesce(size_t frame_base, TokenType op) {
+        bool coalesce = op == TokenType::QuestionQuestion;
+        if (!coalesce && op != TokenType::PipePipe && op != TokenType::AmpersandAmpersand)
+            return false;
+        for (size_t i = m_frames.size(); i > frame_base; --i) {
+            const Frame& frame = m_frames[i - 1];
+            if (frame.precedence < operators::COALESCE)
+                break;
+            if (frame.kind == FrameKind::Infix && operators::infix(frame.op).cls == operators::Logical
+                && (frame.op == TokenType::QuestionQuestion) != coalesce)
+                return true;
+        }
+        return false;
+    }
+
+    // A token that cannot start an operand: either a construct the parser
+    // does not handle yet or a plain syntax error.
+    void report_operand(TokenType type) {
+        switch (type) {
+            case TokenType::KwNew:
+            case TokenType::KwThis:
+            case TokenType::KwSuper:
+            case TokenType::KwClass:
+            case TokenType::KwYield:
+            case TokenType::KwImport:
+                report(DiagnosticCode::Unsupported, std::format("'{}' expressions are not supported", currentSlice()));
+                return;
+            case TokenType::OpenBracket:
+                report(DiagnosticCode::Unsupported, "Object literals are not supported");
+                return;
+            case TokenType::Ellipsis:
+                report(DiagnosticCode::Unsupported, "Spread elements are not supported");
+                return;
+            default:
+                report(DiagnosticCode::UnexpectedToken, std::format("Unexpected '{}' in expression", currentSlice()));
+                return;
+        }
+    }
+
+    ExpressionT parse_expression_stacks(size_t frame_base, size_t operand_base, bool sequence) {
+        bool expect_operand = true;
+        while (true) {
+            if (expect_operand) {
+                if (is_eof()) {
+                    report(DiagnosticCode::UnexpectedEnd, "Unexpected end of input in expression");
+                    return nullptr;
+                }
+                TokenType type = currentType();
+                Location location = currentLocation();
+                // `await` is an operator only in async functions, and
+                // `yield` only starts an expression in generators.
+                if (operators::is_prefix(type) && (type != TokenType::KwAwait || m_in_async)) {
+                    consume(type);
+                    push_frame(FrameKind::Prefix, type, operators::PREFIX, location);
+                    continue;
+                }
+                if (Lexer::isContextual(type) && !async_function_ahead() && (type != TokenType::KwYield || !m_in_generator))
+                    type = TokenType::Identifier;
+                switch (type) {
+                    case TokenType::Identifier: {
+                        IdentifierT identifier = parse_identifier();
+                        if (identifier == nullptr)
+                            return nullptr;
+                        m_operands.push_back(identifier);
+                        expect_operand = false;
+                        continue;
+                    }
+                    case TokenType::Number:
+                    case TokenType::String:
+                    case TokenType::Regex:
+                    case TokenType::Template:
+                    case TokenType::KwTrue:
+                    case TokenType::KwFalse:
+                    case TokenType::KwNull: {
+                        LiteralT literal = parse_literal();
+                        if (literal == nullptr)
+                            return nullptr;
+                        m_operands.push_back(literal);
+                        expect_operand = false;
+                        continue;
+                    }
+                    // Bodies recurse through the statement parser; with lazy
+                    // parsing they are only skipped.
+                    case TokenType::KwAsync:
+                    case TokenType::KwFunction: {
+                        FunctionT function = parse_function(false);
+                        ExpressionT expression = function ? m_builder.function_expression(function, location) : nullptr;
+                        if (expression == nullptr)
+                            return nullptr;
+                        m_operands.push_back(expression);
+                        expect_operand = false;
+                        continue;
+                    }
+                    case TokenType::OpenParen:
+                        consume(type);
+                        push_frame(FrameKind::Paren, type, 0, location);
+                        continue;
+                    case TokenType::OpenSquareBracket:
+                        consume(type);
+                        push_frame(FrameKind::Array, type, 0, location);
+                        continue;
+                    // An empty list, or a trailing comma after the last element.
+                    case TokenType::CloseParen:
+                        if (!top_frame_is(frame_base, FrameKind::Call))
+                            break;
+                        consume(type);
+                        if (!close_call())
+                            return nullptr;
+                        expect_operand = false;
+                        continue;
+                    case TokenType::CloseSquareBracket:
+                        if (!top_frame_is(frame_base, FrameKind::Array))
+                            break;
+                        consume(type);
+                        if (!close_array())
+                            return nullptr;
+                        expect_operand = false;
+                        continue;
+                    default:
+                        break;
+                }
+                report_operand(type);
+                return nullptr;
+            }
+
+            // After an operand: a postfix, infix or closing token, or the end.
+            if (is_eof())
+                break;
+            TokenType type = currentType();
+            Location location = currentLocation();
+            const operators::Info& info = operators::infix(type);
+            if (info.precedence != 0) {
+                if (mixes_coalesce(frame_base, type)) {
+                    report(DiagnosticCode::UnexpectedToken, "'?\?' cannot be mixed with '||' or '&&' without parentheses");
+                    return nullptr;
+                }
+                // `-a ** b` is ambiguous, so the grammar only takes an update
+                // expression on the left of `**`.
+                if (type == TokenType::AsteriskAsterisk && top_frame_is(frame_base, FrameKind::Prefix)
+                    && m_frames.back().op != TokenType::PlusPlus && m_frames.back().op != TokenType::DashDash) {
+                    report(DiagnosticCode::UnexpectedToken, "Unary expression before '**' must be parenthesized", m_frames.back().location);
+                    return nullptr;
+                }
+                consume(type);
+                if (!reduce_above(frame_base, info.precedence, info.right))
+                    return nullptr;
+                push_frame(FrameKind::Infix, type, info.precedence, location);
+                expect_operand = true;
+                continue;
+            }
+
+            bool done = false;
+            switch (type) {
+                case TokenType::Period:
+                    consume(type);
+                    if (!parse_property(false))
+                        return nullptr;
+                    break;
+                case TokenType::QuestionPeriod:
+                    consume(type);
+                    if (!is_eof() && currentType() == TokenType::OpenParen) {
+                        consume(TokenType::OpenParen);
+                        push_frame(FrameKind::Call, TokenType::OpenParen, 0, location, true);
+                        expect_operand = true;
+                    } else if (!is_eof() && currentType() == TokenType::OpenSquareBracket) {
+                        consume(TokenType::OpenSquareBracket);
+                        push_frame(FrameKind::Index, TokenType::OpenSquareBracket, 0, location, true);
+                        expect_operand = true;
+                    } else if (!parse_property(true)) {
+                        return nullptr;
+                    }
+                    break;
+                case TokenType::OpenParen:
+                    consume(type);
+                    push_frame(FrameKind::Call, type, 0, location);
+                    expect_operand = true;
+                    break;
+                case TokenType::OpenSquareBracket:
+                    consume(type);
+                    push_frame(FrameKind::Index, type, 0, location);
+                    expect_operand = true;
+                    break;
+                // On a new line they are prefix operators of the next
+                // statement instead.
+                case TokenType::PlusPlus:
+                case TokenType::DashDash: {
+                    if (newline_before()) {
+                        done = true;
+                        break;
+                    }
+                    ExpressionT argument = m_operands.back();
+                    if (!is_assignment_target(argument)) {
+                        report(DiagnosticCode::InvalidTarget, "Invalid update target", m_builder.getLocation(argument));
+                        return nullptr;
+                    }
+                    consume(type);
+                    ExpressionT update = m_builder.update(type, false, argument, m_builder.getLocation(argument));
+                    if (update == nullptr)
+                        return nullptr;
+                    m_operands.back() = update;
+                    break;
+                }
+                case TokenType::QuestionMark:
+                    consume(type);
+                    if (!reduce_above(frame_base, operators::CONDITIONAL, true))
+                        return nullptr;
+                    push_frame(FrameKind::Conditional, type, 0, location);
+                    expect_operand = true;
+                    break;
+                case TokenType::Colon:
+                    if (!reduce_all(frame_base))
+                        return nullptr;
+                    if (m_frames.size() == frame_base) {
+                        done = true;
+                        break;
+                    }
+                    if (m_frames.back().kind != FrameKind::Conditional) {
+                        report(DiagnosticCode::UnexpectedToken, "Unexpected ':' in expression");
+                        return nullptr;
+                    }
+                    consume(type);
+                    m_frames.back().kind = FrameKind::Alternate;
+                    m_frames.back().precedence = operators::CONDITIONAL;
+                    expect_operand = true;
+                    break;
+                // Separates arguments and elements; anywhere else it is the
+                // sequence operator, below assignment. Later operands join
+                // the open sequence rather than nesting.
+                case TokenType::Comma:
+                    if (!reduce_above(frame_base, operators::CONDITIONAL, false))
+                        return nullptr;
+                    if (m_frames.size() == frame_base && !sequence) {
+                        done = true;
+                        break;
+                    }
+                    if (top_frame_is(frame_base, FrameKind::Conditional)) {
+                        report(DiagnosticCode::UnexpectedToken, "Unexpected ',' in conditional expression");
+                        return nullptr;
+                    }
+                    consume(type);
+                    if (!top_frame_is(frame_base, FrameKind::Call) && !top_frame_is(frame_base, FrameKind::Array)
+                        && !top_frame_is(frame_base, FrameKind::Sequence)) {
+                        push_frame(FrameKind::Sequence, type, operators::SEQUENCE, m_builder.getLocation(m_operands.back()));
+                        m_frames.back().base--;
+                    }
+                    expect_operand = true;
+                    break;
+                case TokenType::Arrow:
+                    report(DiagnosticCode::Unsupported, "Arrow functions are not supported");
+                    return nullptr;
+                case TokenType::CloseParen:
+                    if (!reduce_all(frame_base))
+                        return nullptr;
+                    if (m_frames.size() == frame_base) {
+                        done = true;
+                        break;
+                    }
+                    consume(type);
+                    if (m_frames.back().kind == FrameKind::Paren) {
+                        m_frames.pop_back();
+                    } else if (m_frames.back().kind == FrameKind::Call) {
+                        if (!close_call())
+                            return nullptr;
+                    } else {
+                        report(DiagnosticCode::UnbalancedBracket, "Unexpected ')' in expression", location);
+                        return nullptr;
+                    }
+                    break;
+                case TokenType::CloseSquareBracket:
+                    if (!reduce_all(frame_base))
+                        return nullptr;
+                    if (m_frames.size() == frame_base) {
+                        done = true;
+                        break;
+                    }
+                    consume(type);
+                    if (m_frames.back().kind == FrameKind::Index) {
+                        if (!close_index())
+                            return nullptr;
+                    } else if (m_frames.back().kind == FrameKind::Array) {
+                        if (!close_array())
+                            return nullptr;
+                    } else {
+                        report(DiagnosticCode::UnbalancedBracket, "Unexpected ']' in expression", location);
+                        return nullptr;
+                    }
+                    break;
+                default:
+                    done = true;
+                    break;
+            }
+            if (done)
+                break;
+        }
+
+        if (!reduce_all(frame_base))
+            return nullptr;
+        if (m_frames.size() > frame_base) {
+            Frame& frame = m_frames.back();
+            if (frame.kind == FrameKind::Conditional)
+                report(DiagnosticCode::ExpectedToken, "Expected ':' in conditional expression", frame.location);
+            else if (!is_eof())
+                report(DiagnosticCode::ExpectedToken, std::format("Expected '{}' before '{}'",
+                                                                  frame.kind == FrameKind::Paren || frame.kind == FrameKind::Call ? ')' : ']',
+                                                                  currentSlice()));
+            else
+                report(DiagnosticCode::UnbalancedBracket, "Unclosed bracket in expression", frame.location);
+            return nullptr;
+        }
+        assert(m_operands.size() == operand_base + 1);
+        (void) operand_base;
+        return m_operands.back();
+    }
+
+    // Appends tokens to the ring until `index` is in it; false once the
+    // source runs out first.
+    bool fill(size_t index) {
+        while (m_fetched <= index) {
+            if (m_exhausted)
+                return false;
+            Lexer::RawToken& slot = m_ring[m_fetched & (LOOKAHEAD - 1)];
+            if (m_lexer != nullptr) {
+                if (!m_lexer->next(&slot)) {
+                    m_exhausted = true;
+                    return false;
+                }
+            } else {
+                if (m_fetched >= m_tokens->size()) {
+                    m_exhausted = true;
+                    return false;
+                }
+                slot = Lexer::RawToken { m_tokens->getType(m_fetched), m_tokens->getStart(m_fetched),
+                                         m_tokens->getLength(m_fetched), m_tokens->getAtom(m_fetched) };
+            }
+            m_lex_failed |= slot.type == Lexer::TokenType::Error;
+            m_fetched++;
+        }
+        return true;
+    }
+
+    Lexer::TokenStream* m_tokens;
+    Lexer* m_lexer;
+    const char* m_input;
+    uint32_t m_file_id;
+    std::shared_ptr<AtomTable> m_atom_table;
+    Lexer::RawToken m_ring[LOOKAHEAD];
+    size_t m_fetched;
+    bool m_exhausted;
+    bool m_lex_failed = false;
+    Lexer::RawToken m_end;
+    bool m_lazy;
+    bool m_in_async = false;
+    bool m_in_generator = false;
+    DiagnosticSink* m_diagnostics;
+    size_t m_errors;
+    size_t m_depth = 0;
+    bool m_too_deep = false;
+    JS_STAT(ParseStats* m_stats = nullptr;)
+    Builder m_builder;
+    size_t m_previous;
+    size_t m_cursor;
+    std::vector<Frame> m_frames;
+    std::vector<ExpressionT> m_operands;
+    std::vector<StatementT> m_statements;
+    std::vector<typename Builder::Argument> m_arguments;
+    std::vector<TokenType> m_brackets;
+};
+
+using Parser = BasicParser<TreeBuilder>;
+
+using FlatParser = BasicParser<FlatBuilder>;
+
+
+// Parse cache
+//
+// A directory of AST images named by a hash of the source bytes, the parser
+// and image versions, and the caller's parse options. Entries are written to
+// a private temporary file and renamed into place, so concurrent processes
+// only ever see whole images. Hits refresh the entry's modification time.
+// The directory size is read once when the cache is prepared and then kept
+// as a running total; a store that pushes it past the cap evicts the least
+// recently used entries down to three quarters of the cap, so a full cache
+// rescans the directory once per quarter of its size rather than per store.
+class ParseCache {
+public:
+    ParseCache(const char* dir, uint64_t max_bytes)
+        : m_dir(dir),
+          m_max_bytes(max_bytes),
+          m_bytes(0) {}
+
+    // Entries are named by the image's source hash mixed with everything
+    // else that shapes the tree, so the source is only hashed once.
+    static uint64_t key(uint64_t source_hash, uint64_t options) {
+        uint64_t seed = ((uint64_t) Parser::VERSION << 32 | AstImage::VERSION) ^ rotate_left(options, 17);
+        return hash_bytes(&source_hash, sizeof(source_hash), seed);
+    }
+
+    bool prepare() {
+#ifdef _WIN32
+        if (_mkdir(m_dir) != 0 && errno != EEXIST) {
+#else
+        if (mkdir(m_dir, 0777) != 0 && errno != EEXIST) {
+#endif
+            fprintf(stderr, "ERROR: failed to create cache directory '%s': %s\n", m_dir, strerror(errno));
+            return false;
+        }
+        m_bytes = scan(nullptr);
+        return true;
+    }
+
+    // A hit maps the cached image into `out`. Entries that fail validation
+    // or whose header names different source bytes are treated as misses.
+    bool lookup(uint64_t key, uint64_t source_hash, size_t source_length, AstImage* out) {
+        std::string path = entry_path(key);
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+        if (!out->open(path.c_str(), true))
+            return false;
+        const AstImage::Header* header = out->getHeader();
+        if (header->source_length != source_length || header->source_hash != source_hash)
+            return false;
+        touch(path.c_str());
+        return true;
+    }
+
+    bool store(uint64_t key, AstImage* image) {
+        static std::atomic<uint32_t> s_sequence = 0;
+        std::string path = entry_path(key);
+        std::string temporary = std::format("{}.{}.{}.tmp", path, process_id(), s_sequence++);
+        if (!image->save(temporary.c_str())) {
+            remove(temporary.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        bool renamed = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bool renamed = rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+        if (!renamed) {
+            fprintf(stderr, "ERROR: failed to publish cache entry '%s'\n", path.c_str());
+            remove(temporary.c_str());
+            return false;
+        }
+        // Replacing an entry another process published counts it twice;
+        // the rescan in evict() corrects the total.
+        uint64_t size = image->getHeader()->file_size;
+        if (m_bytes.fetch_add(size, std::memory_order_relaxed) + size > m_max_bytes)
+            evict();
+        return true;
+    }
+
+    // Returns the image for `file`, parsing and storing it on a miss. Parse
+    // errors go to `diagnostics` when it is set, and `stats` counts a hit
+    // as reading and storing as serializing.
+    bool get_or_parse(SourceFile* file, uint64_t options, AstImage* out, bool* hit, DiagnosticSink* diagnostics = nullptr,
+                      ParseStats* stats = nullptr) {
+        const SourceBuffer& source = file->getBuffer();
+        uint64_t source_hash = AstImage::hash_source(source);
+        uint64_t cache_key = key(source_hash, options);
+        {
+            JS_STAT(PhaseTimer timer(stats, &ParseStats::read_ns);)
+            *hit = lookup(cache_key, source_hash, source.getLength(), out);
+        }
+        if (*hit) {
+            JS_STAT(if (stats != nullptr) stats->nodes += out->size();)
+            return true;
+        }
+
+        Lexer lexer(file);
+        lexer.setDiagnostics(diagnostics);
+        lexer.setStats(stats);
+        FlatParser parser(&lexer);
+        parser.setOptions(options);
+        FlatAst ast;
+        if (!parser.parse_flat(&ast))
+            return false;
+        // The caller gets the image built here rather than a re-open of the
+        // entry, which eviction or another process may already have removed;
+        // failing to store it only costs a later miss.
+        JS_STAT(PhaseTimer timer(stats, &ParseStats::serialize_ns);)
+        if (!out->load(&ast, source_hash))
+            return false;
+        store(cache_key, out);
+        return true;
+    }
+
+    // Deletes the oldest entries until the directory is back under three
+    // quarters of the cap. Only one worker evicts at a time; the others
+    // keep storing and leave the total to the next crossing.
+    void evict() {
+        std::unique_lock<std::mutex> lock(m_evict_mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+            return;
+        std::vector<Entry> entries;
+        uint64_t total = scan(&entries);
+        uint64_t target = m_max_bytes / 4 * 3;
+        if (total > m_max_bytes) {
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.time < b.time; });
+            for (const Entry& entry : entries) {
+                if (total <= target)
+                    break;
+                // Another process may have evicted it already; either way it is gone.
+                remove(entry.path.c_str());
+                total -= entry.size;
+            }
+        }
+        m_bytes.store(total, std::memory_order_relaxed);
+    }
+
+    const char* getDir() { return m_dir; }
+
+private:
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        int64_t time;
+    };
+
+    // Returns the total size of the entries in the directory, listing them
+    // in `entries` when it is set.
+    uint64_t scan(std::vector<Entry>* entries) {
+        uint64_t total = 0;
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA(std::format("{}\\*.ast", m_dir).c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+            return 0;
+        do {
+            uint64_t size = (uint64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow;
+            int64_t time = (int64_t) ((uint64_t) data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime);
+            if (entries != nullptr)
+                entries->push_back(Entry { std::format("{}\\{}", m_dir, data.cFileName), size, time });
+            total += size;
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+#else
+        DIR* dir = opendir(m_dir);
+        if (dir == nullptr)
+            return 0;
+        while (dirent* entry = readdir(dir)) {
+            std::string_view name = entry->d_name;
+            if (name.size() < 4 || name.substr(name.size() - 4) != ".ast")
+                continue;
+            std::string path = std::format("{}/{}", m_dir, name);
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0)
+                continue;
+            int64_t time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            if (entries != nullptr)
+                entries->push_back(Entry { std::move(path), (uint64_t) st.st_size, time });
+            total += st.st_size;
+        }
+        closedir(dir);
+#endif
+        return total;
+    }
+
+    std::string entry_path(uint64_t key) {
+        return std::format("{}/{:016x}.ast", m_dir, key);
+    }
+
+    static unsigned long process_id() {
+#ifdef _WIN32
+        return (unsigned long) GetCurrentProcessId();
+#else
+        return (unsigned long) getpid();
+#endif
+    }
+
+    static void touch(const char* path) {
+#ifdef _WIN32
+        _utime(path, nullptr);
+#else
+        utimensat(AT_FDCWD, path, nullptr, 0);
+#endif
     }
 
-    ~WhileStatement() { 
-        free(m_body);
+    const char* m_dir;
+    uint64_t m_max_bytes;
+    std::atomic<uint64_t> m_bytes;
+    std::mutex m_evict_mutex;
+};
+
+// Parses many files on a pool of worker threads. Every worker owns its
+// lexer, parser, atom table and arenas, so the only shared mutable state is
+// the job queues. Jobs are sorted largest first and dealt round-robin into
+// per-worker deques; a worker takes from the front of its own deque and,
+// once that is empty, steals from the back of the others', so big files
+// start early and small ones fill in the tail. Results and diagnostics
+// land in a slot per input and are read back in input order.
+class BatchParser {
+public:
+    struct Result {
+        uint64_t bytes = 0;
+        size_t nodes = 0;
+        bool ok = false;
+        bool cached = false;
+        std::string diagnostics;
+        ParseStats stats;
+    };
+
+    BatchParser(unsigned threads, uint64_t options, ParseCache* cache)
+        : m_threads(threads ? threads : std::max(1u, std::thread::hardware_concurrency())),
+          m_options(options),
+          m_cache(cache),
+          m_format(DiagnosticSink::Format::Text),
+          m_max_errors(DiagnosticSink::DEFAULT_LIMIT) {}
+
+    // How each file's diagnostics are rendered, and how many it keeps.
+    void setDiagnostics(DiagnosticSink::Format format, size_t max_errors) {
+        m_format = format;
+        m_max_errors = max_errors;
+    }
+
+    // Adds `path`, or every script below it when it is a directory. Files
+    // in a directory are added in name order.
+    bool add(const char* path) {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            fprintf(stderr, "ERROR: failed to open '%s': %s\n", path, strerror(errno));
+            return false;
+        }
+        if ((st.st_mode & S_IFMT) == S_IFDIR)
+            return walk(path);
+        m_jobs.push_back(Job { path, (uint64_t) st.st_size });
+        return true;
+    }
+
+    // Adds the paths listed one per line in `list_path` ("-" for stdin).
+    bool add_list(const char* list_path) {
+        MappedFile file;
+        if (!file.open(list_path))
+            return false;
+        std::string_view text(file.getBuffer().getData(), file.getBuffer().getLength());
+        bool ok = true;
+        while (!text.empty()) {
+            size_t end = std::min(text.find('\n'), text.size());
+            std::string line(text.substr(0, end));
+            text.remove_prefix(std::min(end + 1, text.size()));
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                ok = add(line.c_str()) && ok;
+        }
+        return ok;
+    }
+
+    void run() {
+        m_results.assign(m_jobs.size(), Result());
+        std::vector<size_t> order(m_jobs.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) { return m_jobs[a].size > m_jobs[b].size; });
+
+        unsigned threads = (unsigned) std::min<size_t>(m_threads, std::max<size_t>(order.size(), 1));
+        m_queues = std::vector<Queue>(threads);
+        for (size_t i = 0; i < order.size(); ++i)
+            m_queues[i % threads].jobs.push_back(order[i]);
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(&BatchParser::work, this, i);
+        work(0);
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    size_t size() { return m_jobs.size(); }
+
+    unsigned getThreads() { return m_threads; }
+
+    const std::string& getPath(size_t index) { return m_jobs[index].path; }
+
+    const Result& getResult(size_t index) { return m_results[index]; }
+
+    // Stats summed over every file.
+    ParseStats getStats() {
+        ParseStats total;
+        for (const Result& result : m_results)
+            total.add(result.stats);
+        return total;
+    }
+
+private:
+    struct Job {
+        std::string path;
+        uint64_t size;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    bool take(size_t worker, size_t* job) {
+        {
+            Queue& own = m_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.jobs.empty()) {
+                *job = own.jobs.front();
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        // Nothing is ever queued after run() starts, so one empty sweep
+        // means every job has been claimed.
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            Queue& victim = m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.jobs.empty()) {
+                *job = victim.jobs.back();
+                victim.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t worker) {
+        FlatAst ast;
+        DiagnosticSink diagnostics(m_max_errors);
+        JS_STAT(if (worker > 0) Tracer::name_thread(std::format("worker {}", worker));)
+        size_t job;
+        while (take(worker, &job)) {
+            diagnostics.clear();
+            parse_one(m_jobs[job], &ast, &diagnostics, &m_results[job]);
+        }
+    }
+
+    void parse_one(const Job& job, FlatAst* ast, DiagnosticSink* diagnostics, Result* result) {
+        const char* path = job.path.c_str();
+        JS_STAT(TraceSpan span("file", job.path);)
+        MappedFile file;
+        if (!open_source(&file, path, &result->stats))
+            return;
+        result->bytes = file.getBuffer().getLength();
+        SourceFile source_file(path, file.getBuffer());
+        if (m_cache != nullptr) {
+            AstImage image;
+            result->ok = m_cache->get_or_parse(&source_file, m_options, &image, &result->cached, diagnostics, &result->stats);
+            result->nodes = result->ok ? image.size() : 0;
+        } else {
+            // Streamed: lexing is timed as part of the parse (see ParseStats).
+            Lexer lexer(&source_file);
+            lexer.setDiagnostics(diagnostics);
+            lexer.setStats(&result->stats);
+            FlatParser parser(&lexer);
+            parser.setOptions(m_options);
+            result->ok = parser.parse_flat(ast);
+            result->nodes = result->ok ? ast->size() : 0;
+        }
+        // Rendered while the source is still registered.
+        if (!diagnostics->empty())
+            diagnostics->render(&result->diagnostics, m_format);
+        if (!result->ok)
+            print_diagnostic(&result->diagnostics, "ERROR: failed to parse %s\n", path);
+    }
+
+    static bool is_script(std::string_view name) {
+        for (std::string_view extension : { ".js", ".mjs", ".cjs" }) {
+            if (name.size() > extension.size() && name.substr(name.size() - extension.size()) == extension)
+                return true;
+        }
+        return false;
+    }
+
+    // Symlinked directories are skipped so links back up the tree (common
+    // in node_modules) cannot loop.
+    bool walk(const std::string& dir) {
+        struct Entry {
+            std::string path;
+            bool directory;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE find = FindFirstFileA(std::format("{}\\*", dir).c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "ERROR: failed to read directory '%s'\n", dir.c_str());
+            return false;
+        }
+        do {
+            std::string_view name = data.cFileName;
+            if (name == "." || name == "..")
+                continue;
+            bool directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            if (directory && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+                continue;
+            if (!directory && !is_script(name))
+                continue;
+            uint64_t size = (uint64_t) data.nFileSizeHigh << 32 | data.nFileSizeLow;
+            entries.push_back(Entry { std::format("{}\\{}", dir, name), directory, size });
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+#else
+        DIR* handle = opendir(dir.c_str());
+        if (handle == nullptr) {
+            fprintf(stderr, "ERROR: failed to read directory '%s': %s\n", dir.c_str(), strerror(errno));
+            return false;
+        }
+        while (dirent* entry = readdir(handle)) {
+            std::string_view name = entry->d_name;
+            if (name == "." || name == "..")
+                continue;
+            std::string path = std::format("{}/{}", dir, name);
+            struct stat st;
+            if (lstat(path.c_str(), &st) != 0)
+                continue;
+            if (S_ISLNK(st.st_mode) && (stat(path.c_str(), &st) != 0 || S_ISDIR(st.st_mode)))
+                continue;
+            bool directory = S_ISDIR(st.st_mode);
+            if (!directory && (!S_ISREG(st.st_mode) || !is_script(name)))
+                continue;
+            entries.push_back(Entry { std::move(path), directory, (uint64_t) st.st_size });
+        }
+        closedir(handle);
+#endif
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+        bool ok = true;
+        for (Entry& entry : entries) {
+            if (entry.directory)
+                ok = walk(entry.path) && ok;
+            else
+                m_jobs.push_back(Job { std::move(entry.path), entry.size });
+        }
+        return ok;
     }
 
-private:
-    Expression* m_test;
-    Statement* m_body;
-    Location m_location;
+    unsigned m_threads;
+    uint64_t m_options;
+    ParseCache* m_cache;
+    DiagnosticSink::Format m_format;
+    size_t m_max_errors;
+    std::vector<Job> m_jobs;
+    std::vector<Result> m_results;
+    std::vector<Queue> m_queues;
 };
 
-class ExpressionStatement : public Statement {
+// Moves a kept subtree to its place in edited text: shifts every location
+// by `delta` and points literal values back into the current text.
+class AstRebaser : public AstVisitor<AstRebaser> {
 public:
-    ExpressionStatement(Expression* expression, Location location)
-        : m_expression(expression),
-          m_location(location) {
-        m_class_name = "ExpressionStatement";
-    }
+    AstRebaser(const char* text, int64_t delta)
+        : m_text(text),
+          m_delta(delta) {}
 
-    ~ExpressionStatement() { 
-        free(m_expression);
+    void visitNode(Node* node) {
+        Location location = node->getLocation();
+        node->setLocation(Location(location.getFileId(), (uint32_t) (location.getCursor() + m_delta)));
     }
 
-    Expression* getExpression() { return m_expression; }
-
-private:    
-    Expression* m_expression;
-    Location m_location;
-};
-
-class FunctionArgument {
-public:
-    FunctionArgument(Identifier id)
-        : m_id(id),
-          m_value(nullptr) {}
-
-    FunctionArgument(Identifier id, Statement* value)
-        : m_id(id),
-          m_value(value) {}
+    void visitLiteral(Literal* node) {
+        node->setValue(std::string_view(m_text + node->getLocation().getCursor(), node->getValue().size()));
+    }
 
-    ~FunctionArgument() { 
-        free(m_value);
+    void visitFunctionDeclarationStatement(FunctionDeclarationStatement* node) {
+        node->setBodyRange((uint32_t) (node->getBodyStart() + m_delta), (uint32_t) (node->getBodyEnd() + m_delta));
+        AstVisitor::visitFunctionDeclarationStatement(node);
     }
 
 private:
-    Identifier m_id;
-    Statement* m_value;
+    const char* m_text;
+    int64_t m_delta;
 };
 
-class BlockStatement : public Statement {
+// A source text that stays lexed and parsed across edits, for editor
+// services that re-parse on every keystroke. apply_edit re-lexes from the
+// end of the last token before the edit until a new token starts where an
+// old one (moved by the edit) did, in the same regex state; the rest of the
+// old tokens are only shifted. Then only the top-level statements whose
+// tokens changed are re-parsed, up to the next old statement boundary.
+// Statements after the edit are kept as they are and rebased (AstRebaser)
+// when they are next read, so an edit does not touch the whole tree.
+// Errors stay local too: a statement that does not lex or parse is kept
+// as damaged, and only damaged statements are looked at again after an
+// edit elsewhere, to report their errors once more.
+class Document {
 public:
-    BlockStatement(Location location)
-        : m_location(location) {
-        m_class_name = "BlockStatement";
+    Document(const char* path, std::string_view text)
+        : m_path(path ? path : ""),
+          m_atoms(std::make_shared<AtomTable>()),
+          m_lexed(false),
+          m_parsed(false),
+          m_baseline(0),
+          m_damaged(0),
+          m_relexed(0),
+          m_reparsed(0),
+          m_discard(0) {
+        m_text.reserve(text.size() + text.size() / 4 + SourceBuffer::PADDING);
+        m_text.assign(text.begin(), text.end());
+        m_text.resize(text.size() + SourceBuffer::PADDING, 0);
+        m_file = std::make_unique<SourceFile>(path ? m_path.c_str() : nullptr, getBuffer());
     }
 
-private:
-    Location m_location;
-};
+    Document(const Document&) = delete;
+    Document& operator=(const Document&) = delete;
 
-class FunctionDeclarationStatement : public Statement {
-public:
-    FunctionDeclarationStatement(Identifier id, bool async, bool generator, std::vector<FunctionArgument> args, BlockStatement body, Location location)
-        : m_id(id),
-          m_async(async),
-          m_generator(generator),
-          m_args(args),
-          m_body(body),
-          m_location(location) {
-        m_class_name = "FunctionDeclarationStatement";
+    // Lexes and parses everything from scratch. The parser runs even when
+    // lexing failed, to report everything else that is wrong too.
+    bool parse() {
+        m_diagnostics.clear();
+        m_discard.clear();
+        bool lexed = relex_all();
+        return parse_all() && lexed;
     }
 
-private:
-    Identifier m_id;
-    bool m_async;
-    bool m_generator;
-    std::vector<FunctionArgument> m_args;
-    BlockStatement m_body;
-    Location m_location;
-};
+    // Replaces `removed` bytes at `offset` with `inserted`. Returns false
+    // when the edited text does not lex or parse; getDiagnostics says why.
+    bool apply_edit(size_t offset, size_t removed, std::string_view inserted) {
+        m_diagnostics.clear();
+        m_discard.clear();
+        m_relexed = 0;
+        m_reparsed = 0;
+        size_t length = getLength();
+        if (offset > length || removed > length - offset) {
+            report_diagnostic(&m_diagnostics, DiagnosticCode::EditOutOfRange, Severity::Error, m_file->getId(), length, length,
+                              std::format("edit at {} removing {} bytes is outside the {} byte document", offset, removed, length));
+            return false;
+        }
+        int64_t delta = (int64_t) inserted.size() - (int64_t) removed;
+        m_text.erase(m_text.begin() + offset, m_text.begin() + offset + removed);
+        m_text.insert(m_text.begin() + offset, inserted.begin(), inserted.end());
+        m_file->setBuffer(getBuffer());
+        if (!m_lexed)
+            return parse();
+
+        // Tokens ending before the edit are unchanged, and so is the lexer
+        // state right after them.
+        size_t count = m_tokens.size();
+        size_t first = 0;
+        for (size_t step = count; step > 0;) {
+            size_t half = step / 2;
+            if (m_tokens.getEnd(first + half) < offset) {
+                first += half + 1;
+                step -= half + 1;
+            } else {
+                step = half;
+            }
+        }
+        auto old_type = [this](size_t i) { return m_tokens.getType(i); };
+        Lexer::RegexState regex = Lexer::regex_state_at(first, old_type);
+        Lexer lexer(m_file.get(), m_atoms);
+        lexer.setDiagnostics(&m_discard);
+        lexer.seek(first > 0 ? m_tokens.getEnd(first - 1) : 0, regex);
+        m_scratch.reset(m_file->getId(), getBuffer(), m_atoms);
+
+        size_t edit_end = offset + removed;
+        size_t last = first;
+        bool synced = false;
+        Lexer::RawToken token;
+        Lexer::RegexState before = regex;
+        while (!synced && lexer.next(&token)) {
+            while (last < count && (m_tokens.getStart(last) < edit_end || m_tokens.getStart(last) + delta < token.start))
+                ++last;
+            synced = last < count && m_tokens.getStart(last) + delta == token.start &&
+                     before == Lexer::regex_state_at(last, old_type);
+            if (!synced)
+                m_scratch.push(token.type, token.start, token.length, token.atom);
+            before = lexer.getRegexState();
+        }
+        // Without a match the new tokens run to the end of the input.
+        if (!synced)
+            last = count;
+        m_tokens.splice(first, last, m_scratch, delta);
+        m_relexed = m_scratch.size();
+        if (!m_parsed)
+            return parse_all();
+        return reparse(first, last, (int64_t) m_scratch.size() - (int64_t) (last - first), delta);
+    }
 
-// Variables
-class ReturnStatement : public Statement {
-public:
-    ReturnStatement(Expression* argument, Location location)
-        : m_argument(argument),
-          m_location(location) {
-        m_class_name = "ReturnStatement";
+    size_t getStatementCount() { return m_entries.size(); }
+
+    // While the text has errors, damaged statements are partial or null.
+    Statement* getStatement(size_t index) {
+        Entry& entry = m_entries[index];
+        if (entry.statement == nullptr)
+            return nullptr;
+        if (entry.shift != 0 || entry.text != m_text.data()) {
+            AstRebaser rebaser(m_text.data(), entry.shift);
+            rebaser.visit(entry.statement);
+            entry.shift = 0;
+            entry.text = m_text.data();
+        }
+        return entry.statement;
     }
 
-    ~ReturnStatement() {
-        free(m_argument);
+    std::vector<Statement*> getStatements() {
+        std::vector<Statement*> statements;
+        statements.reserve(m_entries.size());
+        for (size_t i = 0; i < m_entries.size(); ++i)
+            statements.push_back(getStatement(i));
+        return statements;
     }
 
-private:
-    Expression* m_argument;
-    Location m_location;
-};
+    const Lexer::TokenStream& getTokens() { return m_tokens; }
 
-// Program
-class Program  {
-public:
-    Program(std::vector<Statement> statements)
-        : m_statements(statements) {}
+    SourceBuffer getBuffer() { return SourceBuffer::borrow_padded(m_text.data(), getLength()); }
 
-    std::vector<Statement> statements() { return m_statements; }
+    size_t getLength() { return m_text.size() - SourceBuffer::PADDING; }
 
-private:
-    std::vector<Statement> m_statements;
-};
+    AtomTable* getAtoms() { return m_atoms.get(); }
 
-// Parser
-class Parser {
-private:
-    bool isBinaryType(Lexer::TokenType type) {
-        return type == Lexer::TokenType::Plus    || 
-               type == Lexer::TokenType::Dash    || 
-               type == Lexer::TokenType::Percent || 
-               type == Lexer::TokenType::Dash;
-    }
+    const std::shared_ptr<AtomTable>& shareAtoms() { return m_atoms; }
 
-public:
-    Parser(std::vector<Lexer::Token>* tokens)
-        : m_tokens(tokens),
-          m_previous(nullptr),
-          m_cursor(0) {}
+    SourceFile* getFile() { return m_file.get(); }
+
+    bool isParsed() { return m_parsed; }
 
-    ~Parser() {}
+    DiagnosticSink& getDiagnostics() { return m_diagnostics; }
 
-    void report(const char* message, Location location) {
-        // char* part = strslice(m_input, location.getCursor(), location.getCursor() + 12);
-        fprintf(stderr, "[Parser] (%s:%i:%i)\n", location.getPath(), location.getRow(), location.getCol());
-        fprintf(stderr, ">     %s\n", "...");
-        fprintf(stderr, "      ^\n");
-        fprintf(stderr, "      %s\n\n", message);
+    // What the last edit had to redo.
+    size_t getRelexedTokens() { return m_relexed; }
+
+    size_t getReparsedStatements() { return m_reparsed; }
+
+private:
+    // A top-level statement and its tokens [first, end). Its nodes still
+    // have to move by `shift` bytes, and its literals point into `text`.
+    // A damaged one had errors, or Error tokens, in its range.
+    struct Entry {
+        Statement* statement;
+        size_t first;
+        size_t end;
+        int64_t shift;
+        const char* text;
+        bool damaged;
+    };
+
+    // Lexer errors come back as Error tokens, so the tokens always cover
+    // the whole text.
+    bool relex_all() {
+        Lexer lexer(m_file.get(), m_atoms);
+        lexer.setDiagnostics(&m_discard);
+        bool lexed = lexer.parse(&m_tokens);
+        m_lexed = true;
+        m_relexed = m_tokens.size();
+        return lexed;
     }
 
-    void report(std::string message, Location location) {
-        report(message.c_str(), location);
+    bool parse_all() {
+        drop_tree();
+        Parser parser(&m_tokens);
+        parser.setDiagnostics(&m_discard);
+        while (!parser.isAtEnd()) {
+            m_entries.push_back(parse_entry(&parser));
+            m_damaged += m_entries.back().damaged;
+        }
+        m_arena = parser.takeArena();
+        m_baseline = m_arena.getUsed();
+        m_reparsed = m_entries.size();
+        m_parsed = true;
+        return diagnose();
     }
 
-    void report(const char* message) {
-        report(message, current().getLocation());
+    // Parses the next top-level statement, skipping past it as a full
+    // parse would when it fails.
+    Entry parse_entry(Parser* parser) {
+        size_t first = parser->getTokenIndex();
+        size_t errors = parser->getErrorCount();
+        Statement* statement = parser->parse_statement();
+        if (statement == nullptr)
+            parser->recover();
+        size_t end = parser->getTokenIndex();
+        bool damaged = statement == nullptr || parser->getErrorCount() != errors;
+        for (size_t i = first; i < end && !damaged; ++i)
+            damaged = m_tokens.getType(i) == Lexer::TokenType::Error;
+        return Entry { statement, first, end, 0, m_text.data(), damaged };
     }
 
-    void report(std::string message) {
-        report(message.c_str(), current().getLocation());
+    // Relexing and reparsing report into m_discard, since they only see
+    // the statements an edit touched. Here every damaged statement reports
+    // again, in order: first its Error tokens, lexed once more, then what
+    // the parser makes of it. Returns whether there were none.
+    bool diagnose() {
+        if (m_damaged == 0)
+            return true;
+        auto type_at = [this](size_t i) { return m_tokens.getType(i); };
+        Lexer lexer(m_file.get(), m_atoms);
+        lexer.setDiagnostics(&m_diagnostics);
+        for (const Entry& entry : m_entries) {
+            if (!entry.damaged)
+                continue;
+            for (size_t i = entry.first; i < entry.end; ++i) {
+                if (m_tokens.getType(i) != Lexer::TokenType::Error)
+                    continue;
+                Lexer::RawToken token;
+                lexer.seek(m_tokens.getStart(i), Lexer::regex_state_at(i, type_at));
+                lexer.next(&token);
+            }
+            Parser parser(&m_tokens);
+            parser.setDiagnostics(&m_diagnostics);
+            parser.seek_token(entry.first);
+            parser.parse_statement();
+        }
+        return false;
     }
 
-    bool is_eof() {
-        return m_cursor >= m_tokens->size();
+    // Tokens [first, first + changed + tokens_delta) are new; old tokens
+    // from `last` on moved by `tokens_delta` places and `delta` bytes.
+    bool reparse(size_t first, size_t last, int64_t tokens_delta, int64_t delta) {
+        // The parser looks one token past a statement to see that it ended,
+        // so the statement before the change is parsed again too.
+        auto from = std::partition_point(m_entries.begin(), m_entries.end(), [&](const Entry& entry) { return entry.end + 1 < first; });
+        auto keep = std::partition_point(from, m_entries.end(), [&](const Entry& entry) { return entry.first < last; });
+        size_t start = from != m_entries.end() ? from->first : 0;
+
+        Parser parser(&m_tokens);
+        parser.setDiagnostics(&m_discard);
+        parser.seek_token(start);
+        std::vector<Entry> fresh;
+        for (;;) {
+            size_t index = parser.getTokenIndex();
+            while (keep != m_entries.end() && (int64_t) keep->first + tokens_delta < (int64_t) index)
+                ++keep;
+            if (keep != m_entries.end() && (int64_t) keep->first + tokens_delta == (int64_t) index)
+                break;
+            if (parser.isAtEnd())
+                break;
+            fresh.push_back(parse_entry(&parser));
+            m_damaged += fresh.back().damaged;
+        }
+        m_arena.absorb(parser.takeArena());
+        m_reparsed = fresh.size();
+
+        size_t kept = keep - m_entries.begin();
+        size_t replaced = kept - (from - m_entries.begin());
+        for (auto entry = from; entry != keep; ++entry)
+            m_damaged -= entry->damaged;
+        for (size_t i = kept; i < m_entries.size(); ++i) {
+            m_entries[i].first += tokens_delta;
+            m_entries[i].end += tokens_delta;
+            m_entries[i].shift += delta;
+        }
+        size_t at = from - m_entries.begin();
+        m_entries.erase(m_entries.begin() + at, m_entries.begin() + at + replaced);
+        m_entries.insert(m_entries.begin() + at, fresh.begin(), fresh.end());
+
+        // Replaced statements stay in the arena; start over once they
+        // dominate it.
+        if (m_arena.getUsed() > 4 * m_baseline + (1 << 20))
+            return parse_all();
+        return diagnose();
     }
 
-    Lexer::Token current() {
-        return m_tokens->at(m_cursor);
+    void drop_tree() {
+        m_entries.clear();
+        m_arena = AstArena();
+        m_damaged = 0;
+        m_parsed = false;
     }
 
-    Lexer::Token peek() {
-        if (m_cursor + 1 >= m_tokens->size()) {
-            Location location = current().getLocation();
-            report("EOF hit which is unexpected", location);
-        }
-        return m_tokens->at(m_cursor + 1);
+    std::string m_path;
+    std::vector<char> m_text;
+    std::unique_ptr<SourceFile> m_file;
+    std::shared_ptr<AtomTable> m_atoms;
+    Lexer::TokenStream m_tokens;
+    Lexer::TokenStream m_scratch;
+    bool m_lexed;
+    bool m_parsed;
+    std::vector<Entry> m_entries;
+    AstArena m_arena;
+    size_t m_baseline;
+    size_t m_damaged;
+    size_t m_relexed;
+    size_t m_reparsed;
+    DiagnosticSink m_diagnostics;
+    DiagnosticSink m_discard;
+};
+
+/* ?? -- ?? -- ? CONSTRUCTION ? -- ?? -- ??*/
+class AstPrinter : public AstVisitor<AstPrinter> {
+public:
+    AstPrinter(AtomTable* atoms)
+        : m_atoms(atoms),
+          m_program(nullptr),
+          m_file(nullptr),
+          m_diagnostics(nullptr),
+          m_failed(false),
+          m_depth(0) {}
+
+    // Parses each body a lazy parse skipped as the printer reaches it, so
+    // only the functions that are printed pay for their bodies. A body that
+    // fails reports into `diagnostics`, stays a LazyBody and sets hasFailed.
+    void setExpand(Program* program, const SourceFile* file, DiagnosticSink* diagnostics = nullptr) {
+        m_program = program;
+        m_file = file;
+        m_diagnostics = diagnostics;
     }
 
-    bool try_consume(Lexer::TokenType type, char* data) {
-        if (is_eof())
-            return false;
+    bool hasFailed() const { return m_failed; }
 
-        auto current = m_tokens->front(); 
-        if (current.getType() != type && (data != nullptr && strcmp(current.getSlice(), data) != 0)) 
-            return false;
-    
-        m_cursor++;
-        *m_previous = current;
-        return true;
+    void visitProgram(Program* program) {
+        print_statements(program->statements());
     }
 
-    bool consume(Lexer::Token* out, Lexer::TokenType type, const char* data) {    
-        if (is_eof()) {
-            printf("[consume] EOF!\n");
-            return false;
+    void print_statements(const std::vector<Statement*>& statements) {
+        printf("Program([\n");
+        m_depth++;
+        for (size_t i = 0; i < statements.size(); ++i) {
+            print_node(statements[i]);
+            if (i != statements.size() - 1)
+                printf(",");
+            printf("\n");
         }
+        m_depth--;
+        printf("]);\n");
+    }
 
-        Lexer::Token current = this->current();
-        if (current.getType() != type) 
-            return false;
+    void visitIdentifier(Identifier* identifier) {
+        print_indent();
+        std::string_view name = m_atoms->getText(identifier->getName());
+        printf("Identifier(name=%.*s, ", (int) name.size(), name.data());
+        print_location(identifier->getLocation());
+        printf(")");
+    }
 
-        if (data != nullptr && strcmp(current.getSlice(), data) != 0) 
-            return false;
+    void visitLiteral(Literal* literal) {
+        print_indent();
+        std::string_view value = literal->getValue();
+        printf("Literal(value=%.*s, ", (int) value.size(), value.data());
+        print_location(literal->getLocation());
+        printf(")");
+    }
 
-        m_cursor++;
-        if (out != nullptr) {
-            *m_previous = current;
-            *out = current;
-        }
+    void visitArrayExpression(ArrayExpression* node) {
+        print_open("ArrayExpression");
+        for (size_t i = 0; i < node->getCount(); ++i)
+            print_field(node->getElement(i), i + 1 != node->getCount());
+        print_close();
+    }
 
-        return true;
+    void visitUnaryExpression(UnaryExpression* node) {
+        print_open("UnaryExpression");
+        print_operator(node->getOperator());
+        print_field(node->getArgument(), false);
+        print_close();
     }
 
-    bool consume(Lexer::TokenType type) {    
-        return consume(nullptr, type, nullptr);
+    void visitUpdateExpression(UpdateExpression* node) {
+        print_open(node->isPrefix() ? "UpdateExpression(prefix)" : "UpdateExpression");
+        print_operator(node->getOperator());
+        print_field(node->getArgument(), false);
+        print_close();
     }
 
-    bool consume(Lexer::TokenType type, const char* data) {    
-        return consume(nullptr, type, data);
+    void visitBinaryExpression(BinaryExpression* node) { print_operator_expression("BinaryExpression", node); }
+
+    void visitLogicalExpression(LogicalExpression* node) { print_operator_expression("LogicalExpression", node); }
+
+    void visitAssignmentExpression(AssignmentExpression* node) { print_operator_expression("AssignmentExpression", node); }
+
+    void visitConditionalExpression(ConditionalExpression* node) {
+        print_open("ConditionalExpression");
+        print_field(node->getTest(), true);
+        print_field(node->getConsequent(), true);
+        print_field(node->getAlternate(), false);
+        print_close();
     }
 
-    FunctionDeclarationStatement* parse_function_statement()  {
-        report("TODO: function statement");
-        return nullptr;
+    void visitMemberExpression(MemberExpression* node) {
+        print_open(node->isOptional() ? "MemberExpression(optional)" : "MemberExpression");
+        print_field(node->getObject(), true);
+        if (node->isComputed())
+            m_work.push_back(Work { Step::Computed, node });
+        print_field(node->getProperty(), false);
+        print_close();
     }
 
-    std::vector<FunctionArgument> parse_function_args_list() {
-        report("TODO: args list");
-        return std::vector<FunctionArgument>();
+    void visitCallExpression(CallExpression* node) {
+        print_open(node->isOptional() ? "CallExpression(optional)" : "CallExpression");
+        print_field(node->getCallee(), node->getCount() != 0);
+        for (size_t i = 0; i < node->getCount(); ++i)
+            print_field(node->getArgument(i), i + 1 != node->getCount());
+        print_close();
     }
 
-    Identifier* parse_identifier() {
-        if (is_eof()) {
-            report("Failed to get current token.");
-            return nullptr;
-        }
-        Lexer::Token current = this->current();
-        if (!this->try_consume(Lexer::TokenType::Identifier, nullptr)) {
-            report(std::format("Expected identifier got {}", Lexer::TokenTypeName(current.getType())));
-            return nullptr;
-        }
-        return new Identifier(current.getSlice(), current.getLocation());
+    void visitEmptyStatement(EmptyStatement*) {
+        print_indent();
+        printf("EmptyStatement");
     }
 
-    Literal* parse_literal() {
-        if (is_eof()) {
-            report("Failed to get current token.");
-            return nullptr;
-        }
-        Lexer::Token current = this->current();
-        const char* data = current.getSlice();
-        if (!this->try_consume(Lexer::TokenType::Number, nullptr) || 
-            (current.getType() != Lexer::TokenType::Identifier && 
-            (data != nullptr && strcmp(data, "true") != 0 && strcmp(data, "false") != 0 && strcmp(data, "null") != 0))) {
-            report(std::format("Expected either number, identifier, or keyword but got '%s'", Lexer::TokenTypeName(current.getType())));
-            return nullptr;
-        }
-        return new Literal(current.getSlice(), current.getLocation());
+    void visitDebuggerStatement(DebuggerStatement*) {
+        print_indent();
+        printf("DebuggerStatement");
     }
 
-    BlockStatement* parse_block_statement() {
-        report("TODO: block statement");
-        return nullptr;
+    void visitIfStatement(IfStatement* node) {
+        print_open("IfStatement");
+        print_field(node->getTest(), true);
+        print_field(node->getBody(), node->getAlternate() != nullptr);
+        if (node->getAlternate() != nullptr)
+            print_field(node->getAlternate(), false);
+        print_close();
     }
 
-    ReturnStatement* parse_return_statement() {
-        report("TODO: return statement");
-        return nullptr;
-    } 
+    void visitWhileStatement(WhileStatement* node) {
+        print_open("WhileStatement");
+        print_field(node->getTest(), true);
+        print_field(node->getBody(), false);
+        print_close();
+    }
 
-    // VariableDeclarator* parse_variable_declarator() {}
+    void visitExpressionStatement(ExpressionStatement* node) {
+        print_open("ExpressionStatement");
+        print_field(node->getExpression(), false);
+        print_close();
+    }
 
-    // VariableDeclarationStatement* parse_variable_declaration() {}
+    void visitBlockStatement(BlockStatement* node) {
+        print_open("BlockStatement");
+        for (size_t i = 0; i < node->getCount(); ++i)
+            print_field(node->getStatement(i), i + 1 != node->getCount());
+        print_close();
+    }
 
-    // ArrayExpression* 
-    Expression* parse_array_expression() {
-        report("TODO: array expr");
-        return nullptr;
+    void visitFunctionDeclarationStatement(FunctionDeclarationStatement* node) {
+        print_open(node->isAsync() ? "FunctionDeclarationStatement(async)" : "FunctionDeclarationStatement");
+        print_field(node->getId(), true);
+        for (size_t i = 0; i < node->getArgCount(); ++i) {
+            print_field(node->getArg(i)->getId(), true);
+            if (node->getArg(i)->getValue() != nullptr)
+                print_field(node->getArg(i)->getValue(), true);
+        }
+        if (node->isLazy() && m_program != nullptr)
+            m_failed |= Parser::parse_lazy_body(m_program, m_file, node, m_diagnostics) == nullptr;
+        if (node->isLazy())
+            m_work.push_back(Work { Step::LazyBody, node });
+        else
+            print_field(node->getBody(), false);
+        print_close();
     }
 
-    Expression* parse_member_expression(Expression* object) { // MemberExpression | CallExpression | null
-        (void) object;
-        report("TODO: member expr");
-        return nullptr;
+    void visitFunctionExpression(FunctionExpression* node) {
+        print_open("FunctionExpression");
+        print_field(node->getFunction(), false);
+        print_close();
     }
 
-    Expression* parse_assignment_expression(Expression* left) {
-        (void) left;
-        report("TODO: assignment expression");
-        return nullptr;
+    void visitSequenceExpression(SequenceExpression* node) {
+        print_open("SequenceExpression");
+        for (size_t i = 0; i < node->getCount(); ++i)
+            print_field(node->getExpression(i), i + 1 != node->getCount());
+        print_close();
     }
 
-    Expression* parse_expression() {
-        if (is_eof())
-            return nullptr;
+    void visitReturnStatement(ReturnStatement* node) {
+        print_open("ReturnStatement");
+        print_field(node->getArgument(), false);
+        print_close();
+    }
 
-        Lexer::Token current = this->current();
-        Lexer::TokenType type = current.getType();
-        Location location = current.getLocation();
-        const char* data = current.getSlice();
+private:
+    // The hooks print a node's opening line at once and schedule the rest:
+    // its fields, the text between them and the closing paren. Deep trees
+    // then cost heap rather than native stack, as in AstVisitor.
+    enum class Step : uint8_t {
+        Node,
+        Separator,
+        Newline,
+        Computed,
+        LazyBody,
+        Close,
+    };
 
-        if (isBinaryType(type)) {
-            report("TODO: unary expr");
-            return nullptr;
-        }
+    struct Work {
+        Step step;
+        Node* node;
+    };
 
-        else if (type == Lexer::TokenType::Identifier || 
-                 type == Lexer::TokenType::Number || 
-                 type == Lexer::TokenType::String) {
-            Expression* ret;
-            this->consume(type);
-            if (type == Lexer::TokenType::Identifier && 
-                (data != nullptr && (strcmp(data, "true") != 0 && strcmp(data, "false") != 0 && strcmp(data, "null") != 0)))
-                ret = new Identifier(data, location);
-            else
-                ret = new Literal(data, location);
-            if (is_eof()) {
-                report("this might be error?");
-                return nullptr;
-            }
-            current = this->current();
-            type = current.getType();
-            data = current.getSlice();
-            location = current.getLocation();
-            if (type == Lexer::TokenType::Period)
-                return this->parse_member_expression(ret);
-            else if (type == Lexer::TokenType::Equal)
-                return this->parse_assignment_expression(ret);
-            else if (type == Lexer::TokenType::OpenParen)
-                return this->parse_call_expression(ret);
-            else if (type == Lexer::TokenType::Colon) {
-                report("TODO: uhh i forgot the name of expr but its like not json yknow");
-                return nullptr;
+    void print_node(Node* node) {
+        size_t base = m_work.size();
+        m_work.push_back(Work { Step::Node, node });
+        while (m_work.size() > base) {
+            Work work = m_work.back();
+            m_work.pop_back();
+            size_t mark = m_work.size();
+            switch (work.step) {
+                case Step::Node:
+                    if (work.node == nullptr) {
+                        print_indent();
+                        printf("null");
+                    } else {
+                        visit(work.node);
+                    }
+                    break;
+                case Step::Separator:
+                    printf(",\n");
+                    break;
+                case Step::Newline:
+                    printf("\n");
+                    break;
+                case Step::Computed:
+                    print_indent();
+                    printf("computed:\n");
+                    break;
+                case Step::LazyBody: {
+                    auto function = static_cast<FunctionDeclarationStatement*>(work.node);
+                    print_indent();
+                    printf("LazyBody(%u..%u)\n", function->getBodyStart(), function->getBodyEnd());
+                    break;
+                }
+                case Step::Close:
+                    m_depth--;
+                    print_indent();
+                    printf(")");
+                    break;
             }
-            else if (isBinaryType(type)) 
-                ret = this->parse_binary_expression(ret);
-
-            printf("got ret: %s\n", ret->getClassName());
-            return ret;
-        }  
-
-        // Array Expression
-        else if (current.getType() == Lexer::TokenType::OpenSquareBracket) {
-            return this->parse_array_expression();
+            std::reverse(m_work.begin() + mark, m_work.end());
         }
+    }
 
-        report(std::format("TODO: Implement expr {}", Lexer::TokenTypeName(type)));
-        return nullptr;
+    void print_indent() {
+        for (int i = 0; i < m_depth; ++i)
+            printf("    ");
     }
 
-    ExpressionStatement* parse_expression_statement() {
-        Expression* expression = this->parse_expression();
-        if (!expression)
-            return nullptr;
-        printf("expr %s\n", expression->getClassName());
-        return new ExpressionStatement(expression, expression->getLocation());
+    void print_location(Location location) {
+        printf("location=(%s, %i, %i)", location.getPath(), location.getRow(), location.getCol());
     }
 
-    // CallExpression*
-    Expression* parse_call_expression(Expression* callee) {
-        (void) callee;
-        report("TODO: call expr");
-        return nullptr;
+    void print_open(const char* name) {
+        print_indent();
+        printf("%s(\n", name);
+        m_depth++;
     }
 
-//  BinaryExpression*
-    Expression* parse_binary_expression(Expression* left) {
-        (void) left;
-        report("TODO: binar expr");
-        return nullptr;
+    void print_field(Node* node, bool more) {
+        m_work.push_back(Work { Step::Node, node });
+        m_work.push_back(Work { more ? Step::Separator : Step::Newline, nullptr });
     }
 
-    IfStatement* parse_if_statement() {
-        return nullptr;
+    void print_operator(TokenType op) {
+        print_indent();
+        printf("operator=%s,\n", operators::text(op));
     }
-    
-    WhileStatement* parse_while_statement() {
-        return nullptr;
+
+    void print_operator_expression(const char* name, OperatorExpression* node) {
+        print_open(name);
+        print_operator(node->getOperator());
+        print_field(node->getLeft(), true);
+        print_field(node->getRight(), false);
+        print_close();
     }
-    
-    Statement* parse_statement() {
-        if (is_eof())
-            return nullptr;
 
-        auto current = this->current();
-        auto location = current.getLocation();
-        auto type = current.getType();
-        auto slice = current.getSlice();
-
-        // let ret;
-        if (type == Lexer::TokenType::Keyword) {
-            Statement* ret = nullptr;
-            if (strcmp(slice, "async") == 0 || strcmp(slice, "function") == 0) 
-                ret = this->parse_function_statement();
-            else if (strcmp(slice, "return") == 0) 
-                ret = this->parse_return_statement();
-            else if (strcmp(slice, "const") == 0 || strcmp(slice, "let") == 0 || strcmp(slice, "var") == 0) {
-                report("TODO: variable declaration statement");
-                // ret = this->parse_variable_declaration();
-            }
-            else if (strcmp(slice, "true") == 0 || strcmp(slice, "false") == 0 || strcmp(slice, "null") == 0) {
-                report("TODO: literals");
-                // ret = this->parse_literal();
-            }
-            else if (strcmp(slice, "if") == 0) 
-                ret = this->parse_if_statement();
-
-            else if (strcmp(slice, "while") == 0) 
-                ret = this->parse_while_statement();
-            else if (strcmp(slice, "debugger") == 0) {
-                consume(Lexer::TokenType::Keyword);
-                ret = new DebuggerStatement(location);     
-            }
-            else if (strcmp(slice, "do") == 0 || strcmp(slice, "for") == 0) {
-                report("TODO: do/for statement");
-                return nullptr;
-            }
-            consume(Lexer::TokenType::Semicolon);
-            if (ret)
-                return ret; 
-            report(std::format("TODO: statement keyword for {}", slice));
-            return nullptr;
-        } 
+    void print_close() { m_work.push_back(Work { Step::Close, nullptr }); }
 
-        else if (type == Lexer::TokenType::OpenBracket) {
-            return this->parse_block_statement();
-        }
+    AtomTable* m_atoms;
+    Program* m_program;
+    const SourceFile* m_file;
+    DiagnosticSink* m_diagnostics;
+    bool m_failed;
+    int m_depth;
+    std::vector<Work> m_work;
+};
 
-        else if (type == Lexer::TokenType::Semicolon) {
-            consume(Lexer::TokenType::Semicolon);
-            return new EmptyStatement(location);
-        }
+// With `expand` set to the program's source, lazy bodies are parsed and
+// printed instead of their ranges. Returns false when one of them failed
+// to parse; its errors go to `diagnostics`.
+bool print_program(Program* program, const SourceFile* expand = nullptr, DiagnosticSink* diagnostics = nullptr) {
+    AstPrinter printer(program->getAtoms());
+    if (expand != nullptr)
+        printer.setExpand(program, expand, diagnostics);
+    printer.visitProgram(program);
+    return !printer.hasFailed();
+}
 
-        else if (type == Lexer::TokenType::Identifier || 
-                 type == Lexer::TokenType::String ||
-                 type == Lexer::TokenType::Number ||
-                 type == Lexer::TokenType::Period || 
-                 type == Lexer::TokenType::Equal || 
-                 type == Lexer::TokenType::OpenSquareBracket || 
-                 type == Lexer::TokenType::Plus || 
-                 type == Lexer::TokenType::Dash || 
-                 type == Lexer::TokenType::Slash || 
-                 type == Lexer::TokenType::Percent) {
-            consume(Lexer::TokenType::Semicolon);
-            return this->parse_expression_statement();
+// One node per line in index order; depth comes from a stack of subtree ends.
+// Works on a FlatAst or a mapped AstImage.
+template <typename Ast>
+void print_flat_ast(Ast* ast) {
+    std::vector<FlatAst::Index> ends;
+    for (FlatAst::Index i = 0; i < ast->size(); ++i) {
+        while (!ends.empty() && ends.back() <= i)
+            ends.pop_back();
+        printf("%6u ", i);
+        for (size_t depth = 0; depth < ends.size(); ++depth)
+            printf("    ");
+        printf("%s", NodeKindName(ast->getKind(i)));
+        if (ast->getKind(i) == NodeKind::Identifier) {
+            std::string_view name = ast->getNameText(i);
+            printf(" %.*s", (int) name.size(), name.data());
+        } else if (ast->getKind(i) == NodeKind::Literal) {
+            std::string_view value = ast->getLiteralValue(i);
+            printf(" %.*s", (int) value.size(), value.data());
+        } else if (ast->getKind(i) >= NodeKind::UnaryExpression && ast->getKind(i) <= NodeKind::AssignmentExpression) {
+            printf(" %s", operators::text((TokenType) ast->getData(i)));
         }
-
-        report(std::format("TODO: statement other for {} -> '{}'\n", Lexer::TokenTypeName(type), slice));
-        return nullptr;
+        LineColumn position = ast->resolve(i);
+        printf(" (%i, %i)\n", position.row, position.col);
+        ends.push_back(ast->getEnd(i));
     }
+}
+/* ?? -- ?? -- ? CONSTRUCTION ? -- ?? -- ??*/
 
-    Program* parse() {
-        auto statements = std::vector<Statement>();
-        while (!is_eof()) {
-            Statement* statement = this->parse_statement();
-            if (statement == nullptr)
-                return nullptr;
-            statements.push_back(*statement);
-        }
-        return new Program(statements);
-    }
+void print_usage(const char* program) {
+    fprintf(stderr, "usage: %s [options] <file>...\n", program);
+    fprintf(stderr, "    -             read source from stdin\n");
+    fprintf(stderr, "    --tokens      dump the token stream\n");
+    fprintf(stderr, "    --ast         print the parsed program\n");
+    fprintf(stderr, "    --flat        parse into the flat AST and print it\n");
+    fprintf(stderr, "    --emit-ast=FILE  write the flat AST of the input as a binary image\n");
+    fprintf(stderr, "    --load-ast    treat inputs as AST images and print them\n");
+    fprintf(stderr, "    --cache-dir=DIR  reuse parse results stored in DIR\n");
+    fprintf(stderr, "    --cache-max=MB   evict least recently used cache entries past MB (default 256)\n");
+    fprintf(stderr, "    --lex-only    stop after lexing\n");
+    fprintf(stderr, "    --stream      parse while lexing instead of lexing the whole file first\n");
+    fprintf(stderr, "    --lazy        skip function bodies, keeping only their source ranges\n");
+    fprintf(stderr, "    --expand-lazy  with --lazy --ast, parse each skipped body as it is printed\n");
+    fprintf(stderr, "    --edit=OFFSET,REMOVED,TEXT  after parsing, replace REMOVED bytes at OFFSET with TEXT\n");
+    fprintf(stderr, "                  incrementally (repeatable, applied in order)\n");
+    fprintf(stderr, "    --lex-threads=N  split each input across N lexing threads (0 = one per core)\n");
+    fprintf(stderr, "    --jobs=N      parse inputs on N threads (0 = one per core); directories are searched for scripts\n");
+    fprintf(stderr, "    --files-from=FILE  also parse the paths listed in FILE, one per line\n");
+    fprintf(stderr, "    --scan=KIND   force scanning kernels (scalar, sse2, avx2)\n");
+    fprintf(stderr, "    --diagnostics=FORMAT  print diagnostics as text (default) or json, one object per file\n");
+    fprintf(stderr, "    --max-errors=N   stop reporting, and recovering, after N diagnostics per file (default %zu, 0 = no limit)\n",
+            DiagnosticSink::DEFAULT_LIMIT);
+    fprintf(stderr, "    --stats=json  print counters and phase times for each file, or their total for batch runs\n");
+    fprintf(stderr, "    --trace=FILE  write read, lex, parse and output spans per thread to FILE as Chrome trace-event JSON\n");
+    fprintf(stderr, "                  (streamed parses, which include batch runs and cache misses, lex inside their parse spans\n");
+    fprintf(stderr, "                  and report lex_ms 0)\n");
+}
 
-private:
-    std::vector<Lexer::Token>* m_tokens;
-    Lexer::Token* m_previous;
-    size_t m_cursor;
+struct EditSpec {
+    size_t offset;
+    size_t removed;
+    const char* text;
 };
 
-/* ?? -- ?? -- ? CONSTRUCTION ? -- ?? -- ??*/
-void print_indent() {
-    for (int i = 0; i < 4; ++i)
-        printf(" ");
+struct Options {
+    bool dump_tokens = false;
+    bool dump_ast = false;
+    bool flat = false;
+    bool load_ast = false;
+    bool stream = false;
+    bool lazy = false;
+    bool expand_lazy = false;
+    int jobs = -1;
+    unsigned lex_threads = 1;
+    std::vector<EditSpec> edits;
+    const char* files_from = nullptr;
+    const char* emit_ast = nullptr;
+    const char* cache_dir = nullptr;
+    uint64_t cache_max = 256ull << 20;
+    bool lex_only = false;
+    DiagnosticSink::Format diagnostics = DiagnosticSink::Format::Text;
+    size_t max_errors = DiagnosticSink::DEFAULT_LIMIT;
+    bool stats = false;
+    const char* trace = nullptr;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-void print_identifier(Identifier* identifier) {
-    print_indent();
-    Location location = identifier->getLocation();
-    printf("Identifier(name=%s, location=(%s, %i, %i))", identifier->getName(), location.getPath(), location.getRow(), location.getCol());
+double megabytes_per_second(size_t bytes, double seconds) {
+    return seconds > 0 ? bytes / seconds / 1e6 : 0;
 }
 
-void print_literal(Literal* literal) {
-    print_indent();
-    Location location = literal->getLocation();
-    printf("Literal(value=%s, location=(%s, %i, %i))", literal->getValue(), location.getPath(), location.getRow(), location.getCol());
+// Stats go to stdout after the summary line they belong to.
+void print_stats(const ParseStats& stats) {
+    std::string json;
+    stats.render_json(&json);
+    fputs(json.c_str(), stdout);
 }
 
-void print_expression(Expression* expression) {
-    const char* cls_name = expression->getClassName();
-    if (strcmp(cls_name, "Identifier") == 0) {
-        print_identifier(static_cast<Identifier*>(expression));
+// Prints what one input collected, after anything already on stdout.
+void print_diagnostics(const DiagnosticSink& sink, const Options& options) {
+    if (sink.empty())
         return;
+    std::string text;
+    sink.render(&text, options.diagnostics);
+    fflush(stdout);
+    fputs(text.c_str(), stderr);
+}
+
+bool load_image(const char* path) {
+    AstImage image;
+    if (!image.open(path))
+        return false;
+    print_flat_ast(&image);
+    printf("%s: %u nodes, %u strings, source %u bytes\n", path, image.getHeader()->node_count,
+           image.getHeader()->string_count, image.getHeader()->source_length);
+    return true;
+}
+
+// Cached runs only need the flat tree, so they skip lexing entirely on a hit.
+bool process_cached(const char* path, Options options, ParseCache* cache) {
+    auto start = std::chrono::steady_clock::now();
+    JS_STAT(TraceSpan span("file", path);)
+
+    ParseStats stats;
+    MappedFile file;
+    if (!open_source(&file, path, &stats))
+        return false;
+    SourceFile source_file(strcmp(path, "-") == 0 ? nullptr : path, file.getBuffer());
+    AstImage image;
+    bool hit;
+    uint64_t parse_options = options.lazy ? (uint64_t) PARSE_LAZY_FUNCTIONS : 0;
+    DiagnosticSink diagnostics(options.max_errors);
+    bool parsed = cache->get_or_parse(&source_file, parse_options, &image, &hit, &diagnostics, &stats);
+    print_diagnostics(diagnostics, options);
+    if (!parsed) {
+        fprintf(stderr, "ERROR: failed to parse %s\n", path);
+        return false;
     }
-     
-    else if (strcmp(cls_name, "Literal") == 0) {
-        print_literal(static_cast<Literal*>(expression));
-        return;
+    if (options.flat) {
+        JS_STAT(PhaseTimer timer(&stats, &ParseStats::serialize_ns);)
+        print_flat_ast(&image);
     }
 
-    else {    
-        print_indent();
-        printf("expression: %s", cls_name);
-        return; 
+    double total_seconds = seconds_since(start);
+    size_t bytes = file.getBuffer().getLength();
+    printf("%s: %zu bytes, %zu nodes, cache %s, total %.3f ms (%.1f MB/s)\n",
+           path, bytes, image.size(), hit ? "hit" : "miss",
+           total_seconds * 1e3, megabytes_per_second(bytes, total_seconds));
+    if (options.stats)
+        print_stats(stats);
+    return true;
+}
+
+// Batch runs print one line per file in input order and a summary; per-file
+// diagnostics are printed just before their file's line.
+bool process_batch(const std::vector<const char*>& paths, Options options, ParseCache* cache) {
+    auto start = std::chrono::steady_clock::now();
+    BatchParser batch((unsigned) std::max(options.jobs, 0), options.lazy ? (uint64_t) PARSE_LAZY_FUNCTIONS : 0, cache);
+    batch.setDiagnostics(options.diagnostics, options.max_errors);
+    bool ok = true;
+    for (const char* path : paths)
+        ok = batch.add(path) && ok;
+    if (options.files_from != nullptr)
+        ok = batch.add_list(options.files_from) && ok;
+    batch.run();
+
+    JS_STAT(TraceSpan span("output");)
+    uint64_t bytes = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        const BatchParser::Result& result = batch.getResult(i);
+        if (!result.diagnostics.empty()) {
+            fflush(stdout);
+            fputs(result.diagnostics.c_str(), stderr);
+        }
+        printf("%s: %llu bytes, %zu nodes%s%s\n", batch.getPath(i).c_str(), (unsigned long long) result.bytes,
+               result.nodes, result.cached ? ", cached" : "", result.ok ? "" : ", failed");
+        bytes += result.bytes;
+        failed += !result.ok;
     }
+    double total_seconds = seconds_since(start);
+    printf("%zu files, %zu failed, %llu bytes on %u threads, total %.3f ms (%.1f MB/s)\n",
+           batch.size(), failed, (unsigned long long) bytes, batch.getThreads(),
+           total_seconds * 1e3, megabytes_per_second(bytes, total_seconds));
+    if (options.stats)
+        print_stats(batch.getStats());
+    return ok && failed == 0;
 }
 
-void print_expression_statement(ExpressionStatement* expression_statement) {
-    Expression* expression = expression_statement->getExpression();
-    print_indent();
-    printf("ExpressionStatement(\n");
-    print_indent();
-    print_expression(expression);
-    printf("\n");
-    print_indent();
-    printf(")");
+// Opens the file as an editor would, applies the --edit list one change
+// at a time, and reports what each edit had to redo.
+bool process_document(const char* path, const Options& options) {
+    MappedFile file;
+    if (!file.open(path))
+        return false;
+    const SourceBuffer& source = file.getBuffer();
+    Document document(strcmp(path, "-") == 0 ? nullptr : path, std::string_view(source.getData(), source.getLength()));
+    document.getDiagnostics().setLimit(options.max_errors);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = document.parse();
+    print_diagnostics(document.getDiagnostics(), options);
+    printf("%s: %zu bytes, %zu tokens, %zu statements, parse %.3f ms\n", path, source.getLength(),
+           document.getTokens().size(), document.getStatementCount(), seconds_since(start) * 1e3);
+
+    for (size_t i = 0; i < options.edits.size(); ++i) {
+        const EditSpec& edit = options.edits[i];
+        start = std::chrono::steady_clock::now();
+        ok = document.apply_edit(edit.offset, edit.removed, edit.text);
+        double seconds = seconds_since(start);
+        print_diagnostics(document.getDiagnostics(), options);
+        printf("edit %zu: %zu tokens relexed, %zu statements reparsed%s, %.3f ms\n", i + 1,
+               document.getRelexedTokens(), document.getReparsedStatements(), ok ? "" : ", failed", seconds * 1e3);
+    }
+    if (ok && options.dump_ast) {
+        AstPrinter printer(document.getAtoms());
+        printer.print_statements(document.getStatements());
+    }
+    return ok;
 }
 
-void print_statement(Statement* statement) {
-    const char* cls_name = statement->getClassName();
+bool process_file(const char* path, Options options, ParseCache* cache) {
+    if (options.load_ast)
+        return load_image(path);
+    if (!options.edits.empty())
+        return process_document(path, options);
+    if (cache != nullptr && !options.dump_tokens && !options.dump_ast && !options.lex_only && !options.emit_ast)
+        return process_cached(path, options, cache);
 
-    if (strcmp(cls_name, "ExpressionStatement") == 0) {
-        print_expression_statement(static_cast<ExpressionStatement*>(statement));
-        return;
+    auto start = std::chrono::steady_clock::now();
+    JS_STAT(TraceSpan span("file", path);)
+
+    ParseStats stats;
+    MappedFile file;
+    if (!open_source(&file, path, &stats))
+        return false;
+    const SourceBuffer& source = file.getBuffer();
+    const char* display_path = strcmp(path, "-") == 0 ? nullptr : path;
+
+    auto lex_start = std::chrono::steady_clock::now();
+    SourceFile source_file(display_path, source);
+    DiagnosticSink diagnostics(options.max_errors);
+    Lexer lexer(&source_file);
+    lexer.setDiagnostics(&diagnostics);
+    lexer.setStats(&stats);
+    Lexer::TokenStream tokens;
+    // Streaming hands tokens straight from the lexer to the parser, so
+    // there is no separate lexing phase to time.
+    bool stream = options.stream && !options.dump_tokens && !options.lex_only;
+    bool lexed = stream || (options.lex_threads > 1 ? lexer.parse_parallel(&tokens, options.lex_threads) : lexer.parse(&tokens));
+    double lex_seconds = seconds_since(lex_start);
+    // Parts that did not lex are Error tokens, so the parser still runs
+    // and reports everything else in the same pass.
+    if (!lexed && options.lex_only) {
+        print_diagnostics(diagnostics, options);
+        fprintf(stderr, "ERROR: failed to lex %s\n", path);
+        return false;
     }
 
-    else if (strcmp(cls_name, "EmptyStatement") == 0) {
-        print_indent();
-        printf("EmptyStatement");
-        return;
+    if (options.dump_tokens) {
+        JS_STAT(PhaseTimer timer(&stats, &ParseStats::serialize_ns);)
+        printf("token count: %zu\n", tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            Lexer::Token token = tokens.at(i);
+            Lexer::TokenType type = token.getType(); 
+            Location location = token.getLocation(); 
+            printf("- (%s:%i:%i) ", location.getPath(), location.getRow(), location.getCol());
+            std::string_view slice = token.getSlice();
+            printf("%s > %.*s\n", Lexer::TokenTypeName(type), (int) slice.size(), slice.data());
+        }
+        printf("\n");
     }
 
-    else {
-        printf("TODO[print_statement]: %s", cls_name);
-        return;
+    bool ok = lexed;
+    if (!options.lex_only && (options.flat || options.emit_ast)) {
+        FlatParser parser = stream ? FlatParser(&lexer) : FlatParser(&tokens);
+        parser.setLazy(options.lazy);
+        parser.setDiagnostics(&diagnostics);
+        parser.setStats(&stats);
+        FlatAst ast;
+        bool parsed = parser.parse_flat(&ast);
+        print_diagnostics(diagnostics, options);
+        if (!parsed) {
+            fprintf(stderr, "ERROR: failed to parse %s\n", path);
+            ok = false;
+        } else {
+            JS_STAT(PhaseTimer timer(&stats, &ParseStats::serialize_ns);)
+            if (options.flat) {
+                print_flat_ast(&ast);
+                printf("flat ast: %zu nodes, %zu bytes\n", ast.size(), ast.memoryUsage());
+            }
+            if (options.emit_ast)
+                ok = AstImage::write(options.emit_ast, &ast) && ok;
+        }
+    } else if (!options.lex_only) {
+        Parser parser = stream ? Parser(&lexer) : Parser(&tokens);
+        parser.setLazy(options.lazy);
+        parser.setDiagnostics(&diagnostics);
+        parser.setStats(&stats);
+        Program* program = parser.parse();
+        bool parsed = program != nullptr;
+        if (parsed && options.dump_ast) {
+            // Expanded bodies report into the same sink, so it is printed
+            // after them.
+            JS_STAT(PhaseTimer timer(&stats, &ParseStats::serialize_ns);)
+            parsed = print_program(program, options.expand_lazy ? &source_file : nullptr, &diagnostics);
+        }
+        print_diagnostics(diagnostics, options);
+        if (!parsed) {
+            fprintf(stderr, "ERROR: failed to parse %s\n", path);
+            ok = false;
+        }
+        delete program;
     }
-}
 
-void print_program(Program* program) {
-    std::vector<Statement> statements = program->statements();
-    size_t stmts_size = statements.size();
-    printf("Program([\n");
-    for (size_t i = 0; i < stmts_size; ++i) {
-        Statement statement = statements.at(i);
-        print_statement(&statement);
-        if (i != stmts_size - 1)
-            printf(",");
-        printf("\n");
+    double total_seconds = seconds_since(start);
+    size_t bytes = source.getLength();
+    if (stream) {
+        printf("%s: %zu bytes, streamed%s, total %.3f ms (%.1f MB/s)\n",
+               path, bytes, file.isMapped() ? "" : " (buffered)",
+               total_seconds * 1e3, megabytes_per_second(bytes, total_seconds));
+    } else {
+        printf("%s: %zu bytes, %zu tokens%s, lex %.3f ms (%.1f MB/s), total %.3f ms (%.1f MB/s)\n",
+               path, bytes, tokens.size(), file.isMapped() ? "" : " (buffered)",
+               lex_seconds * 1e3, megabytes_per_second(bytes, lex_seconds),
+               total_seconds * 1e3, megabytes_per_second(bytes, total_seconds));
     }
-    printf("]);\n");
+    if (options.stats)
+        print_stats(stats);
+    return ok;
 }
-/* ?? -- ?? -- ? CONSTRUCTION ? -- ?? -- ??*/
 
-//       int argc, char** argv
-int main() {    
-    Lexer lexer(nullptr, "true;");
-    
-    std::vector<Lexer::Token> tokens;
-    if (!lexer.parse(&tokens)) {
-        fprintf(stderr, "ERROR: failed to lex input\n");
+// Tools that embed the parser (e.g. bench.cpp) include this file with
+// JS_PARSER_NO_MAIN defined and bring their own main.
+#ifndef JS_PARSER_NO_MAIN
+int main(int argc, char** argv) {
+    Options options;
+    std::vector<const char*> paths;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--tokens") == 0)
+            options.dump_tokens = true;
+        else if (strcmp(arg, "--ast") == 0)
+            options.dump_ast = true;
+        else if (strcmp(arg, "--flat") == 0)
+            options.flat = true;
+        else if (strncmp(arg, "--emit-ast=", 11) == 0)
+            options.emit_ast = arg + 11;
+        else if (strcmp(arg, "--load-ast") == 0)
+            options.load_ast = true;
+        else if (strcmp(arg, "--stream") == 0)
+            options.stream = true;
+        else if (strcmp(arg, "--lazy") == 0)
+            options.lazy = true;
+        else if (strcmp(arg, "--expand-lazy") == 0)
+            options.expand_lazy = true;
+        else if (strncmp(arg, "--jobs=", 7) == 0) {
+            char* end;
+            options.jobs = (int) strtol(arg + 7, &end, 10);
+            if (end == arg + 7 || *end != 0 || options.jobs < 0) {
+                fprintf(stderr, "ERROR: invalid job count '%s'\n", arg + 7);
+                return -1;
+            }
+        }
+        else if (strncmp(arg, "--edit=", 7) == 0) {
+            EditSpec edit;
+            char* end;
+            edit.offset = strtoull(arg + 7, &end, 10);
+            bool valid = end != arg + 7 && *end == ',';
+            const char* removed = end + 1;
+            if (valid) {
+                edit.removed = strtoull(removed, &end, 10);
+                valid = end != removed && *end == ',';
+            }
+            if (!valid) {
+                fprintf(stderr, "ERROR: invalid edit '%s', expected OFFSET,REMOVED,TEXT\n", arg + 7);
+                return -1;
+            }
+            edit.text = end + 1;
+            options.edits.push_back(edit);
+        }
+        else if (strncmp(arg, "--lex-threads=", 14) == 0) {
+            char* end;
+            long threads = strtol(arg + 14, &end, 10);
+            if (end == arg + 14 || *end != 0 || threads < 0) {
+                fprintf(stderr, "ERROR: invalid thread count '%s'\n", arg + 14);
+                return -1;
+            }
+            options.lex_threads = threads ? (unsigned) threads : std::max(1u, std::thread::hardware_concurrency());
+        }
+        else if (strncmp(arg, "--files-from=", 13) == 0)
+            options.files_from = arg + 13;
+        else if (strncmp(arg, "--cache-dir=", 12) == 0)
+            options.cache_dir = arg + 12;
+        else if (strncmp(arg, "--cache-max=", 12) == 0) {
+            char* end;
+            options.cache_max = strtoull(arg + 12, &end, 10) << 20;
+            if (end == arg + 12 || *end != 0) {
+                fprintf(stderr, "ERROR: invalid cache size '%s'\n", arg + 12);
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "--lex-only") == 0)
+            options.lex_only = true;
+        else if (strcmp(arg, "--diagnostics=text") == 0)
+            options.diagnostics = DiagnosticSink::Format::Text;
+        else if (strcmp(arg, "--diagnostics=json") == 0)
+            options.diagnostics = DiagnosticSink::Format::Json;
+        else if (strcmp(arg, "--stats=json") == 0) {
+#ifndef JS_PARSER_STATS
+            fprintf(stderr, "ERROR: this build has stats compiled out (JS_PARSER_NO_STATS)\n");
+            return -1;
+#endif
+            options.stats = true;
+        }
+        else if (strncmp(arg, "--trace=", 8) == 0) {
+#ifndef JS_PARSER_STATS
+            fprintf(stderr, "ERROR: this build has tracing compiled out (JS_PARSER_NO_STATS)\n");
+            return -1;
+#endif
+            options.trace = arg + 8;
+        }
+        else if (strncmp(arg, "--max-errors=", 13) == 0) {
+            char* end;
+            options.max_errors = strtoull(arg + 13, &end, 10);
+            if (end == arg + 13 || *end != 0) {
+                fprintf(stderr, "ERROR: invalid error limit '%s'\n", arg + 13);
+                return -1;
+            }
+        }
+        else if (strncmp(arg, "--scan=", 7) == 0) {
+            if (!scan::select(arg + 7)) {
+                fprintf(stderr, "ERROR: scanning kernels '%s' are not available\n", arg + 7);
+                return -1;
+            }
+        }
+        else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        else if (arg[0] == '-' && arg[1] != 0) {
+            fprintf(stderr, "ERROR: unknown option '%s'\n", arg);
+            print_usage(argv[0]);
+            return -1;
+        }
+        else
+            paths.push_back(arg);
+    }
+
+    if (paths.empty() && options.files_from == nullptr) {
+        print_usage(argv[0]);
         return -1;
     }
 
-    printf("token count: %llu\n", tokens.size());
-    for (size_t i = 0; i < tokens.size(); ++i) {
-        Lexer::Token token = tokens.at(i);
-        Lexer::TokenType type = token.getType(); 
-        Location location = token.getLocation(); 
-        printf("- (%s:%i:%i) ", location.getPath(), location.getRow(), location.getCol());
-        printf("%s > %s\n", Lexer::TokenTypeName(type), token.getSlice());
+    std::unique_ptr<ParseCache> cache;
+    if (options.cache_dir != nullptr) {
+        cache = std::make_unique<ParseCache>(options.cache_dir, options.cache_max);
+        if (!cache->prepare())
+            return -1;
     }
-    printf("\n");
 
-    Parser parser(&tokens);
+    JS_STAT(Tracer tracer;)
+    JS_STAT(if (options.trace != nullptr) tracer.start();)
 
-    Program* program = parser.parse();
-    if (program == nullptr) {
-        fprintf(stderr, "ERROR: failed to parse program\n");
-        return -1;
+    bool ok = true;
+    if (options.jobs >= 0 || options.files_from != nullptr)
+        ok = process_batch(paths, options, cache.get());
+    else {
+        for (const char* path : paths)
+            ok = process_file(path, options, cache.get()) && ok;
     }
 
-    print_program(program);
-    return 0;
-}
\ No newline at end of file
+    // Every worker has been joined by now, so the buffers are complete.
+    JS_STAT(if (options.trace != nullptr) ok = tracer.write(options.trace) && ok;)
+    return ok ? 0 : -1;
+}
+#endif